@@ -2,8 +2,16 @@
 #define DEM_PARSER_H
 
 #include "elevation_reader.h"
+#include "map_arena.h"
+#include "map_cache.h"
+#include "geometry_cache.h"
+#include "geodesic_grid.h"
+#include "spherical_kernel.h"
+#include "half_float.h"
 #include "threevector.h"
 #include "../options.h"
+#include "../numa_topology.h"
+#include <atomic>
 
 // Define EXPORTED for any platform
 // This code copied from: https://atomheartother.github.io/c++/2018/07/12/CPPDynLib.html
@@ -37,26 +45,138 @@
 #endif
 
 // chunk_t
-// A single element of the terrain map.
+// A single element of the terrain map, as read by getMap.
 typedef struct chunk_t {
     float r,az,el;         // Spherical Coordinates w.r.t. radar transmitter.
     uint8_t shadowed;
     float grazing;         // Grazing Angle.
 } chunk_t;
 
+// Side of the square tiles of the tiled layout, in cells.
+#define MAP_TILE_SHIFT 6
+#define MAP_TILE_SIZE (1 << MAP_TILE_SHIFT)
+
+// map_planes_t
+// The terrain map, stored as one plane per field of chunk_t so that each
+// stage only streams the fields it uses. The planes start on a cache line.
+//
+// In the row layout, cell (x, y) is element x * stride + y of every plane,
+// and the stride is a multiple of 64 cells, so every row is 64-byte
+// aligned. In the tiled layout, the planes are made of 64 x 64 cell tiles
+// stored one after the other, tiles rows of them per row of tiles, and
+// the cells of a tile are stored by rows. The lines of sight cast for
+// shadowing and the grazing angle stencil then stay within a few tiles,
+// which fit in L2 and in the TLB, rather than crossing a row per step.
+//
+// The compact profile stores every field in 16 bits instead, in the *16
+// planes, and the stages convert at the accessors:
+//  - the elevation and grazing angles as half floats,
+//  - the azimuth as a fixed point fraction of a turn, 1e-4 rad,
+//  - the range in steps of rangeStep, 1.5 * radius / 65535,
+//  - the elevations in decimetres from the ground at the radar, which
+//    holds terrain within 3276 m of it.
+typedef struct map_planes_t {
+    float* r;
+    float* az;
+    float* el;
+    uint8_t* shadowed;
+    float* grazing;
+    float* heights;     // The rows of elevation_map, unless in the map cache.
+    bool compact;
+    uint16_t* r16;
+    int16_t* az16;
+    uint16_t* el16;
+    uint16_t* grazing16;
+    int16_t* heights16;
+    float rangeStep;
+    float heightOffset;
+    size_t stride;
+    size_t cells;       // Cells of each plane, with the padding.
+    bool tiled;
+    size_t tiles;
+    int firstRow;       // Row of the map held by the first row of the planes.
+} map_planes_t;
+
+// RayTile
+// A run of cells along a ray of the polar grid, produced with every field
+// of chunk_t by ElevationMap::nextRayTile in the fused mode, and the state
+// carried from one run of the ray to the next. Each thread keeps its own.
+class RayTile {
+public:
+    int ray, first, n;      // Cells first to first + n - 1 of the ray.
+    std::vector<float> r, az, el, grazing;
+    std::vector<uint8_t> shadowed;
+
+    RayTile();
+    ~RayTile();
+
+private:
+    friend class ElevationMap;
+    SphericalKernel kernel;
+    GeodesicRay geodesic;
+    double horizon;         // Highest elevation angle along the ray so far.
+    float before;           // Elevation of cell first - 1.
+    std::vector<float> lat, lon, range, height, footprint;
+
+    RayTile(const RayTile&);
+    RayTile& operator=(const RayTile&);
+};
+
 // ElevationMap
 // A class containing the map, with functions to calculate/populate the map.
 class ElevationMap {
 private:
-    // Instance of the elevation reader.
-    ElevationReader* ER;
+    // Instance of the DEM source.
+    DemSource* ER;
+    // The DEM source of each thread of the pool, see reader.
+    std::vector<DemSource*> readers;
     options_t* Options;
-    // 2D arrays containing the map.
-    chunk_t** map;
+    // The map planes, and the rows of elevations, carved from one arena
+    // or mapped from the geometry cache.
+    MapArena arena;
+    map_planes_t planes;
     float** elevation_map;
+    size_t cell(int x, int y) const {
+        if (!planes.tiled)
+            return (size_t)(x - planes.firstRow) * planes.stride + y;
+        size_t tile = (size_t)(x >> MAP_TILE_SHIFT) * planes.tiles + (y >> MAP_TILE_SHIFT);
+        return (tile << (2 * MAP_TILE_SHIFT)) | ((x & (MAP_TILE_SIZE - 1)) << MAP_TILE_SHIFT)
+               | (y & (MAP_TILE_SIZE - 1));
+    }
+
+    // Fields of a cell, whatever the storage profile.
+    float rangeAt(size_t c) const {
+        return planes.compact ? planes.r16[c] * planes.rangeStep : planes.r[c];
+    }
+    float azimuthAt(size_t c) const {
+        return planes.compact ? planes.az16[c] * (float)(M_PI / 32768) : planes.az[c];
+    }
+    float elevationAt(size_t c) const {
+        return planes.compact ? HalfToFloat(planes.el16[c]) : planes.el[c];
+    }
+    float grazingAt(size_t c) const {
+        return planes.compact ? HalfToFloat(planes.grazing16[c]) : planes.grazing[c];
+    }
+    float heightAt(int x, int y) const {
+        if (planes.heights16)
+            return planes.heights16[(size_t)(x - planes.firstRow) * planes.stride + y] * 0.1f + planes.heightOffset;
+        return elevation_map[x][y];
+    }
+    void setAngles(size_t c, float r, float az, float el);
+    void setGrazing(size_t c, float grazing) {
+        if (planes.compact)
+            planes.grazing16[c] = FloatToHalf(grazing);
+        else
+            planes.grazing[c] = grazing;
+    }
+    bool setHeight(int x, int y, float h);
 
     // Coordinates of the origin in the map array
     int mapOriginX, mapOriginY;
+    // The cells within the radius: circleExtent[d] is the largest offset
+    // from the origin within it, d cells away along the other axis.
+    std::vector<int> circleExtent;
+    int circleCells(int d) const;
     
     // The origin lat, lon, and height
     double originLat, originLon, originHeight;
@@ -68,45 +188,124 @@ private:
 
     // The distance between chunks in meters.
     double deltaDistance = 30;
+
+    // Polar grid: row x is the ray at x * polarStep radians from north,
+    // column y the point (y + 0.5) * deltaDistance along it.
+    bool polar;
+    double polarStep;
   
     // Calculates secondary parameters. 
     void calculateSecondaryParameters();
 
     // Calculates the longitude and latitude for a given array element.
+    GeodesicGrid grid;
     void calculateLatLon(int x, int y, float* lat, float* lon);
+
+    // Calculates the latitude and longitude bounds of the map.
+    void calculateFootprint(double* latMin, double* latMax, double* lonMin, double* lonMax);
+
+    // Lists the tiles covering the map.
+    void listTiles(double latMin, double latMax, double lonMin, double lonMax,
+                   std::vector<TilePrefetcher::request_t>* tiles);
+
+    // Loads the tiles covering the map in the background.
+    TilePrefetcher prefetcher;
+    void prefetchTiles(const std::vector<TilePrefetcher::request_t>& tiles);
+
+    // Resampled grid of the site, reused across runs.
+    MapCache mapCache;
+    uint64_t siteKey(const std::vector<TilePrefetcher::request_t>& tiles);
+    bool openMapCache(uint64_t key);
+
+    // Finished planes of the site, reused across runs that only change
+    // the radar parameters.
+    GeometryCache geometryCache;
+    uint64_t geometryKey;
+    bool openGeometryCache(uint64_t key);
+    void saveGeometryCache();
    
-    // Calculates the spherical coordinates for a given lon,lat,height pair. 
-    void calculateSphericalCoordinates(float lat, float lon,float h, float*az, float*el, float* r);
+    // Calculates the spherical coordinates of whole rows of the map.
+    SphericalKernel kernel;
     
     void populateSphericalCoordinates(int start, int end);
     void populatePartial(int start, int end);    	
+    DemSource* reader();
+
+    // Stages of populateMap, which a streamed map runs a wedge at a time.
+    void setupMap();
+    void populateRows(int first, int last);
+    void finishMap();
+    void calculateRowAngles();
     // Grazing Angle Calculations
     double calculateDirectionalDerivative(float* h, float az);
     void calculateTerrainSlope();
     void populateGrazingAngle();
     void populateGrazingAnglePartial(int start, int end);
+    void populateGrazingAnglePolar(int start, int end);
     
     // Shadowing Calculations
     void calculateShadowing();
+    void calculateShadowingLines();
     void calculateShadowingPartial(int start, int end);
     void calculateShadowingAlongLine(int x, int y);
+    double lineCells(int dx, int dy) const;
+    void calculateShadowingPolar(int start, int end);
+    void calculateShadowingAlongRay(int x);
+    void calculateShadowingSweep();
+    void calculateShadowingSectors(int rings, int sectors, int start, int end);
+    void benchmarkShadowing();
      
     void allocateMap();
     void deallocateMap();
     void deallocateElevation();
     
     // Shared memory for multithreading.
-    unsigned int threadCount; 
-    int alloc_i;
     int elevation_i;
+    // The rows being processed, and the rays per wedge when streaming.
+    int rowBegin, rowEnd;
+    int wedgeRows;
+    // Elevations clamped by the compact profile.
+    std::atomic<size_t> clampedHeights;
+    // The page allocations of each NUMA node when the map was allocated.
+    std::vector<NumaTopology::counters_t> numaCounters;
+    void reportNuma();
 public:
     int mapSizeX, mapSizeY, mapRangeMax;
     void populateMap();
 
+    // Streaming: the map is produced a wedge of rays at a time, within
+    // the memory budget, instead of at once by populateMap.
+    bool isStreaming() const { return Options->DEM_PARSER_MEMORY_BUDGET > 0; }
+    void beginStream();
+    bool nextWedge(int* first, int* last);
+
+    // Fused mode: the echo stage pulls each ray a tile at a time, with
+    // its shadowing and grazing angles, and no map is stored.
+    bool isFused() const { return Options->DEM_PARSER_FUSED; }
+    void beginFused();
+    void beginRay(RayTile* tile, int ray);
+    bool nextRayTile(RayTile* tile);
+    void endFused();
+
     // Accessor Functions
+    bool isPolar() const { return polar; }
+    double cellArea(int x, int y) const;
     chunk_t getMap(int x, int y);
     void setMap(int x, int y, chunk_t m);
 
+    // Rows of the map planes: the cells of row x from column y. They are
+    // contiguous up to the next multiple of rowSpan(), which is the whole
+    // row in the row layout and a tile in the tiled one.
+    int rowSpan() const { return planes.tiled ? MAP_TILE_SIZE : mapSizeY; }
+    // The float planes are returned as they are. In the compact profile,
+    // n cells are converted to buffer, which is returned.
+    const float* rangeRow(int x, int y, int n, float* buffer) const;
+    const float* azimuthRow(int x, int y, int n, float* buffer) const;
+    const float* elevationRow(int x, int y, int n, float* buffer) const;
+    const float* grazingRow(int x, int y, int n, float* buffer) const;
+    const uint8_t* shadowedRow(int x, int y = 0) const  { return planes.shadowed + cell(x, y); }
+    int visibleCells(int x) const;
+
     void exportMap();
     
     ElevationMap(options_t*);
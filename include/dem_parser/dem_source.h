@@ -0,0 +1,40 @@
+#ifndef DEM_SOURCE_H
+#define DEM_SOURCE_H
+
+#include <stddef.h>
+#include <vector>
+#include "options.h"
+#include "tile_prefetcher.h"
+
+/* DemSource
+ * A source of terrain elevations. ElevationMap only reads the DEM through
+ * this interface. Readers may keep per-thread state, so every worker
+ * creates its own instance with Create().
+ *
+ * Implementations:
+ *      ElevationReader     SRTM .hgt/.dem tiles, see elevation_reader.h.
+ *      MosaicReader        One pre-mosaicked raster, see mosaic_reader.h.
+ */
+class DemSource {
+public:
+    virtual ~DemSource() {}
+
+    // Elevation at a point in meters. range is the distance from the radar
+    // and footprint the ground size of the point, both in meters. Sources
+    // may use them to choose a resolution.
+    virtual float GetElevation(float lat, float lon, float range = 0, float footprint = 0) = 0;
+    // Highest terrain around a point, never below GetElevation.
+    virtual float GetMaxElevation(float lat, float lon, float range = 0, float footprint = 0) = 0;
+    virtual void GetElevationBatch(const float* lat, const float* lon, float* out, size_t n,
+                                   const float* range = NULL, const float* footprint = NULL) = 0;
+
+    // Appends the tiles to load for an area. Sources without tiles add none.
+    virtual void ListTiles(double latMin, double latMax, double lonMin, double lonMax, float range,
+                           std::vector<TilePrefetcher::request_t>* tiles) = 0;
+    // Returns false if the source has no data for part of an area.
+    virtual bool Covers(double latMin, double latMax, double lonMin, double lonMax) = 0;
+
+    static DemSource* Create(options_t* Options);
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef DEM_TILE_H
+#define DEM_TILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/* Pre-decoded elevation tiles.
+ *
+ * A .dem tile holds the same samples as the .hgt tile it was converted
+ * from, but stored as native-endian int16 with every void already filled,
+ * so that readers can load them directly without decoding.
+ *
+ * Layout:
+ *      0-63    dem_tile_header_t
+ *      64-     totalPx * totalPx int16 samples, north row first.
+ */
+
+#define DEM_TILE_MAGIC          "RCSD"
+#define DEM_TILE_VERSION        2   // 2: voids interpolated from their neighbours.
+#define DEM_TILE_SAMPLE_INT16   0
+#define DEM_TILE_VOID           (-32768)
+
+typedef struct dem_tile_header_t {
+    char        magic[4];       // DEM_TILE_MAGIC
+    uint8_t     version;        // DEM_TILE_VERSION
+    uint8_t     sampleType;     // DEM_TILE_SAMPLE_INT16
+    uint16_t    headerSize;     // Offset of the first sample in bytes.
+    int32_t     lat, lon;       // South west corner of the tile.
+    int32_t     totalPx;        // Samples per row and column.
+    int32_t     secondsPerPx;   // Arc seconds between samples.
+    uint64_t    checksum;       // MapCache::Hash of the samples, 0 if not recorded.
+    uint8_t     reserved[32];
+} dem_tile_header_t;
+
+// Replaces the voids of a tile in place. Returns the number of voids filled.
+size_t FillVoids(int16_t* samples, int totalPx);
+
+// Converts a single .hgt tile into a .dem tile.
+bool ConvertSrtmTile(const std::string& source, const std::string& destination, int lat, int lon);
+
+// Converts every .hgt tile of a folder. Returns the number of tiles converted.
+int ConvertSrtmFolder(const std::string& source, const std::string& destination, bool verbose);
+
+#endif
@@ -12,7 +12,11 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string>
 #include "options.h"
+#include "tile_cache.h"
+#include "tile_prefetcher.h"
+#include "dem_source.h"
 
 #ifndef M_PI
     #define M_PI 3.14159265358979323846
@@ -26,42 +30,97 @@ typedef struct _SrtmAscentDescent {
     float descentOn;
 } TSrtmAscentDescent;
 
+/* SrtmGeometry
+ * The compile-time geometry of an SRTM tile. Every tile spans one degree
+ * of latitude and longitude, and shares its last row and column with the
+ * neighbouring tiles.
+ */
+template <int SecondsPerPx>
+struct SrtmGeometry {
+    static constexpr int secondsPerPx = SecondsPerPx;          //arc seconds per pixel
+    static constexpr int totalPx = 3600 / SecondsPerPx + 1;
+};
+
+typedef SrtmGeometry<1> Srtm1;     // 1 arc second, cca 30m, 3601 px.
+typedef SrtmGeometry<3> Srtm3;     // 3 arc seconds, cca 90m, 1201 px.
+
+/* SrtmTileReader
+ * Reads interpolated elevations from the tiles of one SRTM product.
+ * The tile geometry is a template parameter, so that the index math is
+ * fully specialized for each resolution.
+ */
+template <class Geometry>
+class SrtmTileReader {
+    static constexpr int secondsPerPx = Geometry::secondsPerPx;
+    static constexpr int totalPx = Geometry::totalPx;
+
+    int srtmLat;
+    int srtmLon;
+    TileCache::TileHandle tile;     // Keeps the current tile in the cache.
+    const unsigned char * srtmTile;
+    const int16_t * nativeTile;     // The current tile if it is pre-decoded, NULL otherwise.
+
+    std::string folder;
+    const char* extension;
+    bool required;
+
+    std::string TileFilename (int latDec, int lonDec);
+    bool LoadTileInMemory (int latDec, int lonDec);
+    void ReadHeightFromTile (int y, int x, int* height);
+    int PyramidLevel(float footprint);
+    bool Sample(float lat, float lon, int level, bool max, float* elevation);
+    void InterpolateRun(const float* lat, const float* lon, float* out, size_t n, int latDec, int lonDec, int level);
+public:
+    bool GetElevation(float lat, float lon, float* elevation, float footprint = 0);
+    bool GetMaxElevation(float lat, float lon, float* elevation, float footprint = 0);
+    size_t GetElevationBatch(const float* lat, const float* lon, float* out, size_t n, const float* footprint = NULL);
+    void ListTiles(double latMin, double latMax, double lonMin, double lonMax, 
+                   std::vector<TilePrefetcher::request_t>* tiles);
+
+    SrtmTileReader();
+    void SetFolder(const std::string& folder, const char* extension, bool required);
+};
+
 /* The elevation reader class.
  *
  * Description:
  * 	Reads elevation data, processes metadata such as coordinates,
  * 	shadowing, depression angle.
+ *
+ * 	1 arc second tiles are used within DEM_PARSER_SRTM1_RANGE of the radar
+ * 	if they are available, and 3 arc second tiles everywhere else.
+ *
+ * 	If DEM_PARSER_PYRAMID is set, points can be given a ground footprint,
+ * 	and are then read from the coarsest pyramid level whose sample spacing
+ * 	does not exceed it. GetMaxElevation reads the max reduction of the
+ * 	same level, which never underestimates the terrain it covers.
  * */
-class ElevationReader {
-    static constexpr int secondsPerPx = 3;  //arc seconds per pixel (3 equals cca 90m)
-    static constexpr int totalPx = 1201;
-
-    FILE* srtmFd;
-    int srtmLat;
-    int srtmLon;
-    unsigned char * srtmTile;
-    
+class ElevationReader : public DemSource {
 private:
     options_t* Options;
-    char folder[1024];
-    int16_t prevHeight = 0;
-
-    void LoadTileInMemory (int latDec, int lonDec);
-    void ReadHeightFromTile (int y, int x, int* height);
-
-    void srtmClose();
+    SrtmTileReader<Srtm3> srtm3;
+    SrtmTileReader<Srtm1> srtm1;
+    bool srtm1Enabled;
 public:
     // Major and Minor axis:
     static constexpr double a = 6378137.0;
     static constexpr double b = 6356752.314245;
+    // Reduced resolution levels built per tile if DEM_PARSER_PYRAMID is set.
+    static constexpr int pyramidLevels = 4;
 
-    float GetElevation(float lat, float lon);
+    float GetElevation(float lat, float lon, float range = 0, float footprint = 0);
+    float GetMaxElevation(float lat, float lon, float range = 0, float footprint = 0);
+    void GetElevationBatch(const float* lat, const float* lon, float* out, size_t n, 
+                           const float* range = NULL, const float* footprint = NULL);
+    void ListTiles(double latMin, double latMax, double lonMin, double lonMax, float range,
+                   std::vector<TilePrefetcher::request_t>* tiles);
+    bool Covers(double latMin, double latMax, double lonMin, double lonMax);
 
 
     TSrtmAscentDescent GetAscentDescent(float lat1, float lon1, float lat2, float lon2, float dist);
 
-    double GetDistance(double lat1, double lon1, double lat2, double lon2);
-    void WalkDistance(double lat, double lon, double az, double s, double*lat_out, double* lon_out);
+    static double GetDistance(double lat1, double lon1, double lat2, double lon2);
+    static void WalkDistance(double lat, double lon, double az, double s, double*lat_out, double* lon_out);
 
     ElevationReader();
     ElevationReader(options_t*);
@@ -69,5 +128,4 @@ public:
     ~ElevationReader();
 };
 
-
 #endif
@@ -0,0 +1,86 @@
+#ifndef GEOMETRY_CACHE_H
+#define GEOMETRY_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/* Terrain geometry cache.
+ *
+ * A .geom file holds the finished map planes of one radar site: range,
+ * azimuth, elevation angle, grazing angle, shadowing and elevation of
+ * every cell, in the layout and storage profile they were computed in.
+ * None of them depend on the carrier, the power, the pulse or the
+ * antenna, so runs that only change those map the file and go straight
+ * to the echo stage. The file is named after a key that extends the map
+ * cache key (see MapCache) with the options the planes depend on.
+ *
+ * Layout:
+ *      0-63    geometry_cache_header_t
+ *      64-     The range, azimuth, elevation and grazing planes, of cells
+ *              floats or halves (see map_planes_t), then the cells bytes
+ *              of the shadowing plane, then sizeX * stride float
+ *              elevations, row i first. Each plane is padded to 64 bytes.
+ */
+
+#define GEOMETRY_CACHE_MAGIC    "RCSM"
+// Bump when the planes computed from the same inputs change.
+#define GEOMETRY_CACHE_VERSION  1
+
+typedef struct geometry_cache_header_t {
+    char        magic[4];           // GEOMETRY_CACHE_MAGIC, written last.
+    uint32_t    version;            // GEOMETRY_CACHE_VERSION
+    uint64_t    key;                // See ElevationMap::openGeometryCache.
+    int32_t     sizeX, sizeY;       // Map size in cells.
+    uint64_t    stride;             // See map_planes_t.
+    uint64_t    cells;              // Cells of each plane, with padding.
+    uint32_t    tiles;
+    uint8_t     tiled, compact;
+    uint8_t     reserved[2];
+    float       rangeStep, heightOffset;
+    double      originHeight;       // Height of the radar above the ellipsoid.
+} geometry_cache_header_t;
+
+/* GeometryCache
+ * A memory-mapped .geom file. Open() maps an existing file copy-on-write:
+ * its pages are shared with the page cache until written. Create() maps a
+ * new temporary file for writing, which Commit() moves into place once
+ * every plane has been written.
+ */
+class GeometryCache {
+public:
+    enum Plane_t { PlaneRange, PlaneAzimuth, PlaneElevation, PlaneGrazing, PlaneShadowed, PlaneHeights, PlaneCount };
+
+    bool Open(const std::string& folder, uint64_t key, int sizeX, int sizeY);
+    bool Create(const std::string& folder, const geometry_cache_header_t& layout);
+    bool Commit();
+    void Close();
+
+    bool IsOpen() { return base != NULL; }
+    bool IsHit() { return base != NULL && !writable; }
+    const std::string& Path() { return path; }
+    size_t Size() { return length; }
+
+    const geometry_cache_header_t& Header() { return *header; }
+    void* Plane(Plane_t p) { return base + offset(*header, p); }
+    static size_t PlaneBytes(const geometry_cache_header_t& layout, Plane_t p);
+
+    GeometryCache();
+    ~GeometryCache();
+
+private:
+    std::string path;
+    std::string tmpPath;
+    unsigned char* base;
+    size_t length;
+    bool writable;
+    geometry_cache_header_t* header;
+
+    static size_t offset(const geometry_cache_header_t& layout, int p);
+    static std::string Filename(const std::string& folder, uint64_t key);
+
+    GeometryCache(const GeometryCache&);
+    GeometryCache& operator=(const GeometryCache&);
+};
+
+#endif
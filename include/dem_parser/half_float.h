@@ -0,0 +1,60 @@
+#ifndef HALF_FLOAT_H
+#define HALF_FLOAT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__F16C__)
+    #include <immintrin.h>
+#endif
+
+/* FloatToHalf, HalfToFloat
+ * Conversions between float and IEEE 754 half precision, rounding to
+ * nearest even. Halves have 11 significant bits: angles in radians are
+ * stored to within 5e-4 of pi/2, and much closer to 0. With F16C the
+ * conversions are single instructions.
+ */
+inline uint16_t FloatToHalf(float f) {
+#if defined(__F16C__)
+    return _cvtss_sh(f, 0);
+#else
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t mag = x & 0x7fffffff;
+    // Too large, infinite or NaN.
+    if (mag >= 0x47800000)
+        return sign | (mag > 0x7f800000 ? 0x7e00 : 0x7c00);
+    // Below 2^-14: a subnormal half, in units of 2^-24.
+    if (mag < 0x38800000) {
+        float a;
+        memcpy(&a, &mag, sizeof(a));
+        return sign | (uint16_t)lrintf(a * 16777216.0f);
+    }
+    // Rebias the exponent from 127 to 15 and round off 13 bits.
+    uint32_t h = mag - 0x38000000;
+    h = (h + 0x0fff + ((h >> 13) & 1)) >> 13;
+    return sign | (uint16_t)h;
+#endif
+}
+
+inline float HalfToFloat(uint16_t h) {
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    if (exponent == 0) {
+        float f = mantissa * (1.0f / 16777216.0f);
+        return sign ? -f : f;
+    }
+    uint32_t x = sign | (mantissa << 13) | (exponent == 31 ? 0x7f800000 : (exponent + 112) << 23);
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+#endif
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef MAP_ARENA_H
+#define MAP_ARENA_H
+
+#include <stddef.h>
+#include <vector>
+
+/* MapArena
+ * One anonymous mapping holding every plane of the terrain map, so the map
+ * is allocated with a single call. The pages are zero and are only backed
+ * when first written: each page lands in the memory of the worker that
+ * fills it.
+ *
+ * With huge pages, the arena first asks for reserved MAP_HUGETLB pages,
+ * then falls back to regular pages advised for transparent huge pages.
+ * Platforms without mmap use one aligned heap block.
+ */
+class MapArena {
+public:
+    MapArena();
+    ~MapArena();
+
+    // Reserves the arena. Exits if the memory is not available.
+    void Allocate(size_t bytes, bool hugePages);
+    void Release();
+
+    // Returns the next block of the arena, on a 64 byte boundary.
+    void* Carve(size_t bytes);
+    // Size of a block once padded to 64 bytes, to size the arena.
+    static size_t Padded(size_t bytes) { return (bytes + 63) & ~(size_t)63; }
+
+    // Spreads each block over the NUMA nodes: the stripe of rows from
+    // starts[k] to starts[k + 1] is backed by node k, see NumaTopology.
+    // Interleave spreads one block page by page instead. Call before the
+    // blocks are written.
+    void Spread(const std::vector<double>& starts);
+    void Interleave(const void* block);
+    // Adds the resident bytes of the arena held by each node.
+    void Resident(std::vector<size_t>* perNode) const;
+
+    size_t Size() const { return length; }
+    // How the arena is backed: "huge pages", "transparent huge pages" or "pages".
+    const char* Backing() const;
+
+private:
+    enum Backing_t { BackingNone, BackingHeap, BackingPages, BackingTransparent, BackingHuge };
+    char* base;
+    size_t length;
+    size_t used;
+    Backing_t backing;
+    // Offset and size of each block carved.
+    std::vector<size_t> blockOffsets, blockSizes;
+};
+
+#endif
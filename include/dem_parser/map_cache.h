@@ -0,0 +1,90 @@
+#ifndef MAP_CACHE_H
+#define MAP_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/* Site-local map cache.
+ *
+ * A .grid file holds the resampled grid of one radar site: the latitude,
+ * longitude and ground elevation of every cell of the elevation map. It
+ * is named after a key that hashes every input the grid depends on (the
+ * origin, the map spacing and size, the sampling options and the DEM
+ * tiles the map covers, by the checksum of their contents), so a stale
+ * file is never picked up. Repeat runs for the same site map the file
+ * instead of walking geodesics and sampling the DEM again.
+ *
+ * The checksums of the tiles are kept in a "checksums" file in the same
+ * folder, one line per file: its size, modification time, inode, change
+ * time, checksum and path. A file whose four attributes still match is
+ * not read again; a copy that keeps the modification time still has a
+ * new inode or change time. .dem tiles carry the checksum of their samples in their header.
+ *
+ * Layout:
+ *      0-63    map_cache_header_t
+ *      64-     sizeX * sizeY float latitudes, row i first.
+ *              sizeX * sizeY float longitudes.
+ *              sizeX * sizeY float elevations.
+ */
+
+#define MAP_CACHE_MAGIC         "RCSG"
+#define MAP_CACHE_VERSION       1
+
+typedef struct map_cache_header_t {
+    char        magic[4];           // MAP_CACHE_MAGIC, written last.
+    uint32_t    version;            // MAP_CACHE_VERSION
+    uint64_t    key;                // See MapCache::Hash.
+    int32_t     sizeX, sizeY;       // Map size in cells.
+    float       originElevation;    // Ground elevation at the origin.
+    uint8_t     reserved[36];
+} map_cache_header_t;
+
+/* MapCache
+ * A memory-mapped .grid file. Open() maps an existing file read-only;
+ * Create() maps a new temporary file for writing, which Commit() moves
+ * into place once every cell has been written.
+ */
+class MapCache {
+public:
+    bool Open(const std::string& folder, uint64_t key, int sizeX, int sizeY);
+    bool Create(const std::string& folder, uint64_t key, int sizeX, int sizeY);
+    bool Commit(float originElevation);
+    void Close();
+
+    bool IsOpen() { return base != NULL; }
+    bool IsHit() { return base != NULL && !writable; }
+    const std::string& Path() { return path; }
+
+    // Rows of the planes. Writable only after Create().
+    float* Lat(int i)       { return plane(0, i); }
+    float* Lon(int i)       { return plane(1, i); }
+    float* Height(int i)    { return plane(2, i); }
+    float OriginElevation() { return header->originElevation; }
+
+    static uint64_t Hash(const void* data, size_t bytes, uint64_t hash);
+    static uint64_t HashFile(const std::string& folder, const std::string& filename, uint64_t hash);
+    static const uint64_t hashSeed = 14695981039346656037ULL;
+
+    MapCache();
+    ~MapCache();
+
+private:
+    std::string path;
+    std::string tmpPath;
+    unsigned char* base;
+    size_t length;
+    bool writable;
+    map_cache_header_t* header;
+    int sizeX, sizeY;
+
+    float* plane(int p, int i) {
+        return (float*)(base + sizeof(map_cache_header_t)) + ((size_t)p * sizeX + i) * sizeY;
+    }
+    static std::string Filename(const std::string& folder, uint64_t key);
+
+    MapCache(const MapCache&);
+    MapCache& operator=(const MapCache&);
+};
+
+#endif
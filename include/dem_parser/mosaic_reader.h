@@ -0,0 +1,71 @@
+#ifndef MOSAIC_READER_H
+#define MOSAIC_READER_H
+
+#include <stdint.h>
+#include <string>
+#include "dem_source.h"
+
+/* Pre-mosaicked elevation rasters.
+ *
+ * A mosaic is a single raster covering a whole site, so that readers
+ * never switch tiles. Samples lie on a regular latitude/longitude grid
+ * and must not have voids.
+ *
+ * Layout:
+ *      0-63    dem_mosaic_header_t
+ *      64-     width * height samples, north row first, each row from
+ *              west to east. int16 or float, native-endian.
+ */
+
+#define DEM_MOSAIC_MAGIC            "RCSM"
+#define DEM_MOSAIC_VERSION          1
+#define DEM_MOSAIC_SAMPLE_INT16     0
+#define DEM_MOSAIC_SAMPLE_FLOAT     1
+
+typedef struct dem_mosaic_header_t {
+    char        magic[4];       // DEM_MOSAIC_MAGIC
+    uint8_t     version;        // DEM_MOSAIC_VERSION
+    uint8_t     sampleType;     // DEM_MOSAIC_SAMPLE_INT16 or DEM_MOSAIC_SAMPLE_FLOAT
+    uint16_t    headerSize;     // Offset of the first sample in bytes.
+    int32_t     width, height;  // Samples per row, and rows.
+    double      north, west;    // Position of the first sample in degrees.
+    double      latStep;        // Degrees between rows, positive.
+    double      lonStep;        // Degrees between samples of a row, positive.
+    uint8_t     reserved[16];
+} dem_mosaic_header_t;
+
+/* MosaicReader
+ * Reads interpolated elevations from a mosaic. The raster is mapped
+ * read-only, so every worker shares the same pages. Points outside the
+ * raster take the elevation of its nearest edge. The range and footprint
+ * of a point are ignored.
+ */
+class MosaicReader : public DemSource {
+private:
+    dem_mosaic_header_t header;
+    const unsigned char* base;  // The mapped file.
+    size_t length;
+    const void* samples;
+    float rowMax, colMax;       // Largest fractional row and column.
+
+    template <typename T, bool Max>
+    void Interpolate(const float* lat, const float* lon, float* out, size_t n);
+    void Read(const float* lat, const float* lon, float* out, size_t n, bool max);
+public:
+    float GetElevation(float lat, float lon, float range = 0, float footprint = 0);
+    float GetMaxElevation(float lat, float lon, float range = 0, float footprint = 0);
+    void GetElevationBatch(const float* lat, const float* lon, float* out, size_t n,
+                           const float* range = NULL, const float* footprint = NULL);
+    void ListTiles(double latMin, double latMax, double lonMin, double lonMax, float range,
+                   std::vector<TilePrefetcher::request_t>* tiles);
+    bool Covers(double latMin, double latMax, double lonMin, double lonMax);
+
+    MosaicReader(const std::string& filename);
+    ~MosaicReader();
+};
+
+// Writes an int16 mosaic of the SRTM tiles around the site, at the resolution
+// of the 3 arc second tiles. Returns false if the file could not be written.
+bool BuildMosaic(options_t* Options, const std::string& filename);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef SPHERICAL_KERNEL_H
+#define SPHERICAL_KERNEL_H
+
+#include <stddef.h>
+#include <math.h>
+#include <vector>
+#include "threevector.h"
+
+/* SphericalKernel
+ * Converts whole map rows of (lat, lon, h) to the range, azimuth and
+ * elevation seen from the radar, in place of one calculateECEF call and
+ * three libm calls per cell.
+ *
+ * Every cell of a map row shares its longitude (see GeodesicGrid), so the
+ * longitude terms of the ECEF position, projected on the local axes, are
+ * computed once per row. Cells handles grids whose cells do not share
+ * one. The latitude and longitude of a cell are at most a few degrees
+ * from the origin's, so their sines and cosines are those of the origin
+ * rotated by a short Taylor series of the difference. The ECEF position
+ * and its projection stay in double, as they are the difference of two
+ * numbers of 6e6 m; the angles are then taken in float with a polynomial
+ * atan2.
+ *
+ * Error bound: the sin/cos series are exact to 1e-16 within 20 degrees of
+ * the origin. Atan2 is within 3e-7 rad (about 1.7e-5
+ * degrees) of the libm result, and the range within one float ulp.
+ */
+class SphericalKernel {
+public:
+    void Init(double originLat, double originLon, const ThreeVector& origin, const ThreeVector axis[3]);
+    void Row(double lon, const float* lat, const float* h, size_t n, float* r, float* az, float* el);
+    void Cells(const float* lat, const float* lon, const float* h, size_t n, float* r, float* az, float* el);
+
+    static inline float Atan2(float y, float x);
+
+private:
+    double refLat, sinRef, cosRef;
+    double refLon, sinRefLon, cosRefLon;
+    double axis[3][3];
+    double originDot[3];    // The origin projected on each axis.
+    // Local cartesian coordinates of a row.
+    std::vector<float> x, y, z;
+};
+
+/** SphericalKernel::Atan2
+ * DESCRIPTION:
+ *      Branch-free float atan2, so that loops calling it vectorize. The
+ *      ratio of the smaller to the larger magnitude is reduced to
+ *      [0, tan(pi/8)] and evaluated with the Cephes atanf polynomial; the
+ *      octant is restored with selects. Within 3e-7 rad of atan2.
+ */
+inline float SphericalKernel::Atan2(float y, float x) {
+    float ax = fabsf(x);
+    float ay = fabsf(y);
+    // Plain selects rather than fmaxf/fminf, whose NaN rules keep the
+    // compiler from using vector min/max.
+    float mx = ax > ay ? ax : ay;
+    float mn = ax > ay ? ay : ax;
+    // Both quotients are always taken, so that there is nothing to branch on.
+    float t = mn / (mx > 1e-30f ? mx : 1e-30f);
+    // atan(t) = pi/4 + atan((t - 1) / (t + 1))
+    bool big = t > 0.414213562373f;
+    float reduced = (t - 1) / (t + 1);
+    float u = big ? reduced : t;
+    float u2 = u * u;
+    float a = (((8.05374449538e-2f * u2 - 1.38776856032e-1f) * u2
+                + 1.99777106478e-1f) * u2 - 3.33329491539e-1f) * u2 * u + u;
+    a = big ? a + (float)(M_PI / 4) : a;
+    a = ay > ax ? (float)(M_PI / 2) - a : a;
+    a = x < 0 ? (float)M_PI - a : a;
+    return copysignf(a, y);
+}
+
+#endif
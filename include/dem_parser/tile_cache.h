@@ -0,0 +1,122 @@
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+enum TileFormat {  TileFormatHgt,        // Big-endian int16 with voids, as in .hgt files.
+                   TileFormatNative      // Native-endian int16 without voids, see dem_tile.h.
+};
+
+/* pyramid_level_t
+ * A reduced resolution copy of a tile. Sample (row, col) of level k is
+ * centered on full resolution sample (row * 2^k, col * 2^k), and holds
+ * the mean and the maximum of the terrain around it. Samples are native
+ * int16, north row first. The maximum is empty until a reader asks for
+ * it, see TileCache::BuildMaxLevels.
+ */
+typedef struct pyramid_level_t {
+    int totalPx;
+    std::vector<int16_t> mean;
+    std::vector<int16_t> max;
+} pyramid_level_t;
+
+/* SrtmTile
+ * A single elevation tile held in memory. The samples are kept in the
+ * layout of the file (north row first), either copied into the heap or
+ * mapped read-only from the file. The voids of .dem tiles were filled
+ * when they were converted. Those of a heap .hgt tile are filled in
+ * place; a mapped .hgt tile is only checked for voids in the rows the
+ * run reads, and the pages that hold voids are replaced by filled
+ * private copies. Either way every sample a reader sees is valid.
+ */
+class SrtmTile {
+public:
+    int totalPx;            // Samples per row and column.
+    size_t bytes;           // Size of data in bytes.
+    unsigned char* data;    // Tile samples.
+    size_t offset;          // Offset of data in the file mapping.
+    bool mapped;            // True if data is a file mapping.
+    TileFormat format;
+    size_t checkedRows[2];  // Rows [first, last) known to be free of voids.
+    std::vector<pyramid_level_t> levels;    // levels[k-1] holds level k.
+    std::once_flag maxBuilt;
+
+    void Decode(std::vector<int16_t>* samples) const;
+    void BuildPyramid(int levelCount);
+    void BuildMaxPyramid(std::vector<std::vector<int16_t> >* max) const;
+    size_t MemoryUsage() const;
+
+    SrtmTile();
+    ~SrtmTile();
+};
+
+/* TileCache
+ * A process-wide cache of elevation tiles, shared by every ElevationReader.
+ *
+ * Tiles are reference counted: a tile handed out by Acquire() stays in
+ * memory for as long as any reader holds its handle. Tiles that are no
+ * longer referenced are kept around until the cache exceeds its byte
+ * budget, at which point the least recently used ones are released.
+ * Concurrent requests for a tile that is still being loaded block until
+ * the first request has finished, so every tile is read at most once
+ * while it stays cached.
+ */
+class TileCache {
+public:
+    typedef std::shared_ptr<const SrtmTile> TileHandle;
+
+    static TileCache& Instance();
+
+    TileHandle Acquire(const std::string& filename, int latDec, int totalPx, bool required = true);
+    void BuildMaxLevels(const TileHandle& handle);
+
+    void SetBudget(size_t bytes);
+    size_t Budget();
+    void SetMemoryMapped(bool enabled);
+    void SetPyramidLevels(int levels);
+    void SetFootprint(double latMin, double latMax);
+    size_t BytesInUse();
+    void Clear();
+
+    // Statistics, for verbose output.
+    unsigned long loads;
+    unsigned long hits;
+    unsigned long evictions;
+
+private:
+    typedef struct entry_t {
+        std::shared_ptr<SrtmTile> tile;
+        bool loading;
+        std::list<std::string>::iterator lruPosition;
+    } entry_t;
+
+    std::mutex lock;
+    std::condition_variable loaded;
+    std::map<std::string, entry_t> entries;
+    std::list<std::string> lru;     // Most recently used first.
+    size_t budget;
+    size_t bytesInUse;
+    bool memoryMapped;
+    int pyramidLevels;
+
+    // Latitudes covered by the current run, used for readahead hints.
+    double footprintLat[2];
+
+    static SrtmTile* LoadTile(const std::string& filename, int totalPx);
+    static SrtmTile* MapTile(const std::string& filename, int totalPx, size_t firstRow, size_t lastRow);
+    void evict();
+
+    TileCache();
+    TileCache(const TileCache&);
+    TileCache& operator=(const TileCache&);
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef TILE_PREFETCHER_H
+#define TILE_PREFETCHER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "tile_cache.h"
+
+/* TilePrefetcher
+ * Loads a list of tiles into the TileCache on background threads.
+ *
+ * The prefetcher holds a handle to every tile it loads until it is
+ * released, so that the tiles stay cached while the map is populated.
+ * Readers that need a tile before it has arrived simply block in
+ * TileCache::Acquire until the load has finished.
+ */
+class TilePrefetcher {
+public:
+    typedef struct request_t {
+        std::string filename;
+        int latDec;
+        int totalPx;
+    } request_t;
+
+    void Start(const std::vector<request_t>& requests, int threadCount, size_t byteLimit);
+    void Wait();
+    void Release();
+
+    TilePrefetcher();
+    ~TilePrefetcher();
+
+private:
+    std::vector<request_t> queue;
+    std::vector<TileCache::TileHandle> handles;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next;
+
+    void Worker();
+};
+
+#endif
@@ -24,6 +24,7 @@
 #define ECHO_SIM_H
 #include <math.h>
 #include <mutex>
+#include <vector>
 #include "../dem_parser/elevation_reader.h"
 #include "../dem_parser/dem_parser.h"
 #include "echo_sim/antenna_pattern.h"
@@ -43,6 +44,8 @@ private:
     double** attenTable;
     std::mutex* mutexTable;
 
+    // Power, power * azimuth and power * elevation, see AccumulatePolar.
+    static const int polarPlanes = 3;
     void AddPowerReceived(double , float, float, int, int);
     float GetRotatedAzimuthAngle(float az, int azBin); 
 
@@ -51,6 +54,15 @@ public:
    
     void PopulateAttenTable();
     void PopulateAttenTablePartial(int start, int end);
+    void PopulateAttenTablePolar(int start, int end);
+    void PopulateAttenTableStreaming();
+    void PopulateAttenTableFused();
+    void AccumulatePolar(int i, int j0, int n, const float* r, const float* az, const float* el,
+                         const uint8_t* shadowed, const float* grazing, float azRef,
+                         double* edge, double* run);
+    void AddPolarBin(float azRef, const double* edge, const double* run);
+    void PopulateAttenTableThreads(void (EchoSimulator::*partial)(int, int), int first, int last,
+                                   const std::vector<double>* weight = NULL);
 
     void SaveCSV(const char* filename);
     void SaveToFile(const char* filename); 
@@ -0,0 +1,65 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* NumaTopology
+ * The NUMA nodes of the host and their logical CPUs, read from sysfs on
+ * Linux. Elsewhere, or when sysfs cannot be read, the host is a single
+ * node holding every CPU, and pinning and placement do nothing.
+ *
+ * Threads of the pool are spread over the nodes in contiguous blocks:
+ * thread i of n runs on node i * nodes / n. As the loops of a NUMA pool
+ * hand thread i the i-th of n equal shares of the rows, placing the rows
+ * of the shares of node k's threads on node k keeps most accesses local.
+ *
+ * Within a node, the CPUs are ordered one per physical core before the
+ * second SMT sibling of any core, so that threads only share a core once
+ * every core is in use.
+ */
+class NumaTopology {
+public:
+    static const NumaTopology& Instance();
+
+    int Nodes() const { return cpus.size(); }
+    // The node and logical CPU of thread index of count threads.
+    int NodeOf(int index, int count) const;
+    int CpuOf(int index, int count) const;
+    // The first of count threads on a node.
+    int FirstOf(int node, int count) const;
+
+    // Pins the calling thread to a logical CPU, or to every CPU of a node.
+    // Returns false if the thread could not be pinned.
+    bool PinToCpu(int cpu) const;
+    bool PinToNode(int node) const;
+
+    // Asks the kernel to back pages, not yet touched, with the memory of a
+    // node. addr must be page aligned.
+    static bool Bind(void* addr, size_t bytes, int node);
+    // Asks the kernel to back pages, not yet touched, round-robin on
+    // every node.
+    static bool Interleave(void* addr, size_t bytes);
+    // Adds the bytes of the resident pages of [addr, addr + bytes) to the
+    // count of the node holding them.
+    void Resident(const void* addr, size_t bytes, std::vector<size_t>* perNode) const;
+
+    // The page allocation counters of a node, from its numastat: pages
+    // allocated by threads of the node on it and on other nodes. They
+    // count every process on the host.
+    struct counters_t {
+        uint64_t local, remote;
+    };
+    counters_t Counters(int node) const;
+
+private:
+    // The logical CPUs of each node, in pinning order.
+    std::vector<std::vector<int> > cpus;
+    // The sysfs id of each node, which may have gaps.
+    std::vector<int> ids;
+
+    NumaTopology();
+};
+
+#endif
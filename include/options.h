@@ -14,7 +14,26 @@ typedef struct options_t {
     uint8_t     DEM_PARSER_EXPORT_GRAZING_ANGLE = 0;
     uint8_t     DEM_PARSER_EXPORT_SHADOWING = 0;
     std::string DEM_PARSER_SRTM_FOLDER = "srtm";
+    std::string DEM_PARSER_DEM_CACHE_FOLDER = "";   // Pre-decoded .dem tiles, see dem_tile.h.
+    std::string DEM_PARSER_SRTM1_FOLDER = "";       // 1 arc second tiles, disabled if empty.
+    std::string DEM_PARSER_MOSAIC_FILE = "";        // Single raster used instead of the tiles, see mosaic_reader.h.
+    std::string DEM_PARSER_MAP_CACHE_FOLDER = "";   // Resampled site grids, disabled if empty.
+    std::string DEM_PARSER_GEOMETRY_CACHE_FOLDER = ""; // Finished map planes, see geometry_cache.h.
+    float       DEM_PARSER_SRTM1_RANGE = 30000.0;   // Range within which 1 arc second tiles are used.
     uint8_t     DEM_PARSER_DISABLE_ELEVATION = 0;
+    uint32_t    DEM_PARSER_TILE_CACHE_SIZE = 1024;  // Tile cache budget in MB.
+    uint8_t     DEM_PARSER_MMAP_TILES = 0;
+    uint8_t     DEM_PARSER_PYRAMID = 0;             // Sample far range cells from the tile pyramid.
+    int32_t     DEM_PARSER_PREFETCH_THREADS = 2;    // Background tile loaders, 0 disables prefetching.
+    uint8_t     DEM_PARSER_HUGEPAGES = 0;           // Back the map with huge pages.
+    uint8_t     DEM_PARSER_POLAR = 0;               // Sample the map along rays instead of a Cartesian grid.
+    int32_t     DEM_PARSER_POLAR_OVERSAMPLE = 4;    // Rays per azimuth bin of the polar grid.
+    uint8_t     DEM_PARSER_MAP_LAYOUT = 0;          // 0: rows, 1: 64 x 64 tiles, see map_planes_t.
+    uint32_t    DEM_PARSER_MEMORY_BUDGET = 0;       // Map budget in MB: streams the polar map in wedges if set.
+    uint8_t     DEM_PARSER_COMPACT = 0;             // Store the map in 16 bits per field, see map_planes_t.
+    uint8_t     DEM_PARSER_FUSED = 0;               // Produce the polar map a tile at a time for the echo stage.
+    uint8_t     DEM_PARSER_SHADOWING_ENGINE = 0;    // Cartesian maps, 0: lines to the edges, 1: radial sweep.
+    uint8_t     DEM_PARSER_SHADOWING_BENCHMARK = 0; // Run both shadowing engines and compare them.
     
     
     float       SIMULATOR_RADIUS = 264000.0;
@@ -38,6 +57,7 @@ typedef struct options_t {
                                              // If you have more than 127 threads:
                                              // First of all, congrats.
                                              // Second, you'll need to make this a int16_t
+    uint8_t     SIMULATOR_NUMA = 0;     // Pin the threads and spread the map over the NUMA nodes.
     uint8_t     PROG_VERBOSE = 0;
 } options_t;
 
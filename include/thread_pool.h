@@ -0,0 +1,96 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+/* ThreadPool
+ * The process-wide workers shared by every stage of the simulator. They
+ * are started once, and wait between parallel loops instead of being
+ * created and joined by each stage.
+ *
+ * ParallelFor cuts a range into tiles of a few indices. Each thread,
+ * the caller included, starts with a contiguous share of the tiles and
+ * takes them from the front; a thread that runs out steals tiles from
+ * the back of another's share. Uneven tiles, such as the rows of a
+ * Cartesian map that lie mostly outside the radius, are then balanced
+ * without the stages having to size their shares. WeightedFor also cuts
+ * the tiles, and so the shares, to equal estimated work.
+ *
+ * Loops are not nested: a ParallelFor called from within a tile runs on
+ * the calling thread, as do loops when the pool has not been started.
+ *
+ * A NUMA pool pins each worker to a core, see NumaTopology, and the
+ * caller to the cores of the first node. Thread i then starts with the
+ * i-th of the equal parts of the range, even in WeightedFor, so that the
+ * rows it starts with are those placed on its node.
+ */
+class ThreadPool {
+public:
+    static ThreadPool& Instance();
+
+    // Starts the pool. threads counts the caller, which works too.
+    void Start(int threads, bool numa = false);
+    void Stop();
+    int Size() const { return size; }
+    bool IsNuma() const { return numa; }
+    // The share of the calling thread, from 0 to Size() - 1: 0 for the
+    // caller of the loops, and for threads outside the pool.
+    static int ThreadIndex();
+
+    // Calls body(begin, end) on tiles of grain indices covering first to
+    // last inclusive, and returns once every tile is done.
+    void ParallelFor(int first, int last, int grain, const std::function<void(int, int)>& body);
+    // Same, with tiles of about equal weight. weight[k] is the work of
+    // index first + k, in any unit.
+    void WeightedFor(int first, int last, const std::vector<double>& weight,
+                     const std::function<void(int, int)>& body);
+
+    // Prints the share of the loops since the last report that each
+    // thread spent running tiles, and resets it.
+    void Report(const char* stage);
+
+    ~ThreadPool();
+
+private:
+    // The tiles of a thread not taken yet: next to end - 1.
+    struct share_t {
+        std::mutex lock;
+        int next, end;
+        // Time spent in tiles, and tiles run, since the last report.
+        double busy;
+        int tiles;
+    };
+    std::vector<std::thread> workers;
+    int size;
+    bool numa;
+    std::unique_ptr<share_t[]> shares;
+    // Wall time of the loops since the last report.
+    double elapsed;
+
+    // The current loop, written while no worker is busy. Tile t covers
+    // indices bounds[t] to bounds[t + 1] - 1.
+    std::mutex lock;
+    std::condition_variable wake, idle;
+    uint64_t generation;
+    int busy;
+    bool stopping;
+    const std::function<void(int, int)>* body;
+    std::vector<int> bounds;
+
+    void Loop(std::vector<int>& tiles, const std::function<void(int, int)>& body);
+    void Worker(int index, uint64_t seen);
+    void Run(int index);
+    bool Take(int index, int* tile);
+
+    ThreadPool();
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+};
+
+#endif
@@ -4,9 +4,13 @@
 using namespace std::chrono;
 
 #include "dem_parser/dem_parser.h"
+#include "dem_parser/dem_tile.h"
+#include "dem_parser/mosaic_reader.h"
 #include "echo_sim/echo_sim.h"
 #include "cxxopts.h"
 #include "options.h"
+#include "thread_pool.h"
+#include "numa_topology.h"
 
 using std::cout;
 using std::endl;
@@ -35,8 +39,30 @@ cxxopts::ParseResult parse(int argc, char* argv[],cxxopts::Options* options ) {
             ("wave-speed", "The speed that the wave propogates. (m/s)", cxxopts::value<float>()->default_value("299702505.269398111"))
             
             ("srtm", "SRTM folder", cxxopts::value<std::string>())
+            ("tile-cache", "SRTM tile cache budget (MB)", cxxopts::value<int>())
+            ("srtm1", "SRTM 1 arc second folder", cxxopts::value<std::string>())
+            ("srtm1-range", "Range within which 1 arc second tiles are used (meters)", cxxopts::value<float>())
+            ("dem-cache", "Folder of pre-decoded .dem tiles", cxxopts::value<std::string>())
+            ("build-dem-cache", "Convert the SRTM folder into pre-decoded .dem tiles in this folder and exit", cxxopts::value<std::string>())
+            ("mosaic", "Read elevations from a single mosaic raster instead of the tiles", cxxopts::value<std::string>())
+            ("build-mosaic", "Write a mosaic of the SRTM tiles around the site to this file and exit", cxxopts::value<std::string>())
+            ("map-cache", "Folder to keep the resampled grid of each site in", cxxopts::value<std::string>())
+            ("geometry-cache", "Folder to keep the finished terrain geometry of each site in", cxxopts::value<std::string>())
+            ("prefetch-threads", "Number of background tile loading threads", cxxopts::value<int>())
+            ("mmap-tiles", "Memory map the tiles read-only instead of reading them", cxxopts::value<bool>()->default_value("false"))
+            ("dem-pyramid", "Read far range cells from reduced resolution tiles", cxxopts::value<bool>()->default_value("false"))
+            ("hugepages", "Back the map with huge pages", cxxopts::value<bool>()->default_value("false"))
+            ("polar", "Sample the terrain along rays at the range and azimuth steps of the radar", cxxopts::value<bool>()->default_value("false"))
+            ("polar-oversample", "Rays per azimuth bin of the polar grid", cxxopts::value<int>())
+            ("map-layout", "Layout of the map planes: rows or tiled", cxxopts::value<std::string>())
+            ("memory-budget", "Stream the polar map in wedges within this many MB", cxxopts::value<int>())
+            ("compact-map", "Store the map in 16 bits per field", cxxopts::value<bool>()->default_value("false"))
+            ("fused", "Compute the terrain and its echoes a tile of a ray at a time, without storing the map", cxxopts::value<bool>()->default_value("false"))
+            ("shadowing-engine", "Shadowing of Cartesian maps: lines or sweep", cxxopts::value<std::string>())
+            ("shadowing-benchmark", "Compare the time and the cells shadowed by both shadowing engines", cxxopts::value<bool>()->default_value("false"))
             ("antenna-file", "Antenna pattern file", cxxopts::value<std::string>())
             ("threads", "Number of CPU threads", cxxopts::value<int>())
+            ("numa", "Pin the threads to cores and place the map on the NUMA node of the threads reading it", cxxopts::value<bool>()->default_value("false"))
             ("benchmark", "Benchmark mode. Radius: [start] [step] [end]", cxxopts::value<std::vector<int>>())
             ("o,output", "Output file name", cxxopts::value<std::string>()->default_value("output.atten"))
             ("h,help", "Print help page");
@@ -81,12 +107,70 @@ int main(int argc, char*argv[]) {
             O.DEM_PARSER_EXPORT_SHADOWING = 1;
         if (result.count("srtm")) 
             O.DEM_PARSER_SRTM_FOLDER = result["srtm"].as<std::string>();
+        if (result.count("srtm1")) 
+            O.DEM_PARSER_SRTM1_FOLDER = result["srtm1"].as<std::string>();
+        if (result.count("srtm1-range"))
+            O.DEM_PARSER_SRTM1_RANGE = result["srtm1-range"].as<float>();
+        if (result.count("dem-cache")) 
+            O.DEM_PARSER_DEM_CACHE_FOLDER = result["dem-cache"].as<std::string>();
+        if (result.count("mosaic")) 
+            O.DEM_PARSER_MOSAIC_FILE = result["mosaic"].as<std::string>();
+        if (result.count("map-cache")) 
+            O.DEM_PARSER_MAP_CACHE_FOLDER = result["map-cache"].as<std::string>();
+        if (result.count("geometry-cache")) 
+            O.DEM_PARSER_GEOMETRY_CACHE_FOLDER = result["geometry-cache"].as<std::string>();
+        if (result.count("tile-cache"))
+            O.DEM_PARSER_TILE_CACHE_SIZE = result["tile-cache"].as<int>();
+        if (result.count("prefetch-threads"))
+            O.DEM_PARSER_PREFETCH_THREADS = result["prefetch-threads"].as<int>();
+        if (result.count("mmap-tiles"))
+            O.DEM_PARSER_MMAP_TILES = 1;
+        if (result.count("dem-pyramid"))
+            O.DEM_PARSER_PYRAMID = 1;
+        if (result.count("hugepages"))
+            O.DEM_PARSER_HUGEPAGES = 1;
+        if (result.count("polar"))
+            O.DEM_PARSER_POLAR = 1;
+        if (result.count("polar-oversample"))
+            O.DEM_PARSER_POLAR_OVERSAMPLE = result["polar-oversample"].as<int>();
+        if (result.count("map-layout")) {
+            std::string layout = result["map-layout"].as<std::string>();
+            if (layout == "rows")
+                O.DEM_PARSER_MAP_LAYOUT = 0;
+            else if (layout == "tiled")
+                O.DEM_PARSER_MAP_LAYOUT = 1;
+            else {
+                cout << "Error: unknown map layout " << layout << ", expected rows or tiled." << endl;
+                return 1;
+            }
+        }
+        if (result.count("shadowing-engine")) {
+            std::string engine = result["shadowing-engine"].as<std::string>();
+            if (engine == "lines")
+                O.DEM_PARSER_SHADOWING_ENGINE = 0;
+            else if (engine == "sweep")
+                O.DEM_PARSER_SHADOWING_ENGINE = 1;
+            else {
+                cout << "Error: unknown shadowing engine " << engine << ", expected lines or sweep." << endl;
+                return 1;
+            }
+        }
+        if (result.count("shadowing-benchmark"))
+            O.DEM_PARSER_SHADOWING_BENCHMARK = 1;
+        if (result.count("compact-map"))
+            O.DEM_PARSER_COMPACT = 1;
+        if (result.count("fused"))
+            O.DEM_PARSER_FUSED = 1;
+        if (result.count("memory-budget"))
+            O.DEM_PARSER_MEMORY_BUDGET = result["memory-budget"].as<int>();
         if (result.count("output")) 
             O.SIMULATOR_OUTPUT_FILENAME = result["output"].as<std::string>();
         if (result.count("threads"))
             O.SIMULATOR_THREAD_COUNT = result["threads"].as<int>();
         else
             O.SIMULATOR_THREAD_COUNT = std::thread::hardware_concurrency();
+        if (result.count("numa"))
+            O.SIMULATOR_NUMA = 1;
         if (result.count("wave-speed"))
             O.SIMULATOR_WAVE_SPEED = result["wave-speed"].as<float>();
         if (result.count("frequency"))
@@ -105,6 +189,42 @@ int main(int argc, char*argv[]) {
         cout << options->help();
         return 1; 
     }
+    if (result.count("build-dem-cache")) {
+        std::string folder = result["build-dem-cache"].as<std::string>();
+        int converted = ConvertSrtmFolder(O.DEM_PARSER_SRTM_FOLDER, folder, O.PROG_VERBOSE);
+        if (converted < 0)
+            return 1;
+        // 1 arc second tiles go to a subfolder, where the readers expect them.
+        if (O.DEM_PARSER_SRTM1_FOLDER != "") {
+            int converted1 = ConvertSrtmFolder(O.DEM_PARSER_SRTM1_FOLDER, folder + "/srtm1", O.PROG_VERBOSE);
+            if (converted1 < 0)
+                return 1;
+            converted += converted1;
+        }
+        cout << "Converted " << converted << " tiles." << endl;
+        return 0;
+    }
+    if (result.count("build-mosaic")) {
+        std::string filename = result["build-mosaic"].as<std::string>();
+        if (!BuildMosaic(&O, filename)) {
+            cout << "Error writing " << filename << endl;
+            return 1;
+        }
+        return 0;
+    }
+    // Only the rays of the polar grid can be processed independently of
+    // each other, so streaming and the fused mode switch to it.
+    if (!O.DEM_PARSER_POLAR && (O.DEM_PARSER_MEMORY_BUDGET > 0 || O.DEM_PARSER_FUSED))
+        cout << "Notice: " << (O.DEM_PARSER_FUSED ? "--fused" : "--memory-budget")
+             << " samples the map on the polar grid, as with --polar." << endl;
+    if (O.DEM_PARSER_MMAP_TILES && O.DEM_PARSER_DEM_CACHE_FOLDER == "")
+        cout << "Warning: --mmap-tiles without --dem-cache maps the .hgt tiles, whose voids are filled "
+             << "in private copies of their pages. Convert them with --build-dem-cache to share every page." << endl;
+    // The workers are shared by every stage, and by every run of the
+    // benchmark.
+    ThreadPool::Instance().Start(O.SIMULATOR_THREAD_COUNT, O.SIMULATOR_NUMA);
+    if (O.SIMULATOR_NUMA && O.PROG_VERBOSE)
+        cout << "Threads pinned, NUMA nodes: " << NumaTopology::Instance().Nodes() << endl;
     if (benchmark[0] == 0) {
         high_resolution_clock::time_point t1 = high_resolution_clock::now();
         EchoSimulator Simulator(&O);
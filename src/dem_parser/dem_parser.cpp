@@ -1,14 +1,18 @@
 #include "dem_parser/dem_parser.h"
 #include <math.h>
+#include <float.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fstream>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
-#include <thread>
-#include <chrono>
 #include <iostream>
 
+#include "thread_pool.h"
+
 using std::cout;
 using std::endl;
 
@@ -25,22 +29,78 @@ using std::endl;
  *          The radius from the origin to populate in meters.
  */
 void ElevationMap::populateMap(){
-    ER = new ElevationReader(Options);
+    setupMap();
+    if (!geometryCache.IsHit()) {
+        populateRows(0, mapSizeX - 1);
+        finishMap();
+        calculateRowAngles();
+        saveGeometryCache();
+    }
+    exportMap();
+}
+
+/** ElevationMap::beginStream
+ * DESCRIPTION:
+ *      Sets the map up to be produced a wedge at a time by nextWedge,
+ *      in place of populateMap.
+ */
+void ElevationMap::beginStream() {
+    setupMap();
+    if (Options->PROG_VERBOSE && (Options->DEM_PARSER_EXPORT_ELEVATION_MAP || Options->DEM_PARSER_EXPORT_AZIMUTH_ANGLE
+                                  || Options->DEM_PARSER_EXPORT_ELEVATION_ANGLE || Options->DEM_PARSER_EXPORT_GRAZING_ANGLE
+                                  || Options->DEM_PARSER_EXPORT_SHADOWING))
+        cout << "Warning: the map is not exported when streamed." << endl;
+}
+
+/** ElevationMap::nextWedge
+ * DESCRIPTION:
+ *      Populates the next wedge of rays of a streamed map, with its
+ *      shadowing and grazing angles, in place of the previous one.
+ * ARGUMENTS:
+ *      int* first, last
+ *          The first and last rays of the wedge. Only these rows of the
+ *          map can be read until the next call.
+ * RETURNS:
+ *      bool
+ *          False once every wedge has been produced.
+ */
+bool ElevationMap::nextWedge(int* first, int* last) {
+    if (rowEnd >= mapSizeX - 1)
+        return false;
+    *first = rowEnd + 1;
+    *last = std::min(rowEnd + wedgeRows, mapSizeX - 1);
+    populateRows(*first, *last);
+    if (*last == mapSizeX - 1)
+        finishMap();
+    calculateRowAngles();
+    return true;
+}
+
+/** ElevationMap::setupMap
+ * DESCRIPTION:
+ *      Sizes the map, opens the DEM and the map cache, starts loading the
+ *      tiles and reserves the map planes. If the planes are in the
+ *      geometry cache, they are mapped from it instead.
+ */
+void ElevationMap::setupMap() {
+    TileCache& cache = TileCache::Instance();
+    cache.SetBudget((size_t)Options->DEM_PARSER_TILE_CACHE_SIZE * 1024 * 1024);
+    cache.SetMemoryMapped(Options->DEM_PARSER_MMAP_TILES);
+    cache.SetPyramidLevels(Options->DEM_PARSER_PYRAMID ? ElevationReader::pyramidLevels : 0);
+    ER = DemSource::Create(Options);
+    // Each slot is only written by its own thread, once.
+    readers.assign(ThreadPool::Instance().Size(), NULL);
     
     if (Options->SIMULATOR_SEEK_LOCAL_MAXIMA)
         seekMaxima();
     originLat = Options->SIMULATOR_ORIGIN_LAT;
     originLon = Options->SIMULATOR_ORIGIN_LON;
-    originHeight = ER->GetElevation(originLat,originLon) + Options->SIMULATOR_TRANSMITTER_HEIGHT;
     float radius = Options->SIMULATOR_RADIUS;
 
     deltaDistance = Options->DEM_PARSER_DELTA_DISTANCE;
     
-    threadCount = Options->SIMULATOR_THREAD_COUNT;
-    std::thread* threads = new std::thread[threadCount];
-
     if (Options->PROG_VERBOSE)
-        cout << "Starting DEM Parser with " << threadCount << " threads." << endl;    
+        cout << "Starting DEM Parser with " << ThreadPool::Instance().Size() << " threads." << endl;    
     
     mapSizeX = 2 * radius / deltaDistance;
     mapSizeY = 2 * radius / deltaDistance;
@@ -48,13 +108,71 @@ void ElevationMap::populateMap(){
     
     mapOriginX = mapSizeX/2;
     mapOriginY = mapSizeY/2;
-    float mapDelta = float(mapSizeX-1)/float(threadCount);
-    
-    // Start allocating map.
-    alloc_i = 0;
-    threads[0] = std::thread(&ElevationMap::allocateMap,this);
-    
-    
+
+    // Half the length of the chord of the circle at each distance from
+    // the origin: max + (min >> 1) grows with either distance.
+    circleExtent.assign(mapRangeMax + 1, -1);
+    for (int d = 0, e = mapRangeMax; d <= mapRangeMax; d++) {
+        while (e >= 0 && std::max(d, e) + (std::min(d, e) >> 1) > mapRangeMax)
+            e--;
+        circleExtent[d] = e;
+    }
+
+    // Solve the east/west walk of every column once.
+    grid.Build(originLat, originLon, mapOriginX, mapOriginY, mapSizeX, deltaDistance);
+
+    // Let the tile cache know which rows of each tile will be read. The
+    // polar grid covers the circle inscribed in the Cartesian one.
+    double latMin, latMax, lonMin, lonMax;
+    calculateFootprint(&latMin, &latMax, &lonMin, &lonMax);
+
+    // Only the rays of the polar grid can be processed independently of
+    // each other, so streaming and the fused mode use it.
+    polar = Options->DEM_PARSER_POLAR || isStreaming() || isFused();
+    if (polar) {
+        // One row per ray, finer than the azimuth bins, and one column
+        // per range step from the radar out to the radius.
+        mapSizeX = Options->SIMULATOR_AZIMUTH_ANGLE_COUNT * std::max(1, Options->DEM_PARSER_POLAR_OVERSAMPLE);
+        mapSizeY = (int)ceil(radius / deltaDistance);
+        polarStep = 2 * M_PI / mapSizeX;
+        if (Options->PROG_VERBOSE)
+            cout << "Polar grid of " << mapSizeX << " rays by " << mapSizeY << " range steps." << endl;
+    }
+    cache.SetFootprint(latMin, latMax);
+    if (!ER->Covers(latMin, latMax, lonMin, lonMax))
+        cout << "Warning: the DEM does not cover the whole map, edge elevations are extended." << endl;
+    vector<TilePrefetcher::request_t> tiles;
+    listTiles(latMin, latMax, lonMin, lonMax, &tiles);
+    uint64_t key = siteKey(tiles);
+    if (openGeometryCache(key)) {
+        // The map of this site has been computed before: neither the
+        // tiles nor the grid are read.
+        originHeight = geometryCache.Header().originHeight;
+    } else {
+        if (openMapCache(key)) {
+            // The grid of this site has been resampled before.
+            originHeight = mapCache.OriginElevation();
+        } else {
+            // Load the tiles in the background while the map is set up.
+            prefetchTiles(tiles);
+            originHeight = ER->GetElevation(originLat,originLon);
+        }
+        originHeight += Options->SIMULATOR_TRANSMITTER_HEIGHT;
+
+        // Reserve the map. Its pages are backed by the workers that fill
+        // them, each a contiguous share of the rows, see populateRows.
+        // The fused mode keeps no map.
+        if (!isFused())
+            allocateMap();
+    }
+    if (Options->PROG_VERBOSE && !geometryCache.IsHit() && !isFused()) {
+        cout << "Map arena of " << arena.Size() / (1024 * 1024) << " MB, backed by "
+             << arena.Backing() << (planes.tiled ? ", in 64 x 64 tiles." : ".") << endl;
+        if (isStreaming())
+            cout << "Streaming the map in " << (mapSizeX + wedgeRows - 1) / wedgeRows
+                 << " wedges of " << wedgeRows << " rays." << endl;
+    }
+
     // Calculate origin and unit vectors
     origin = calculateECEF(originLat, originLon, originHeight);
    
@@ -67,44 +185,121 @@ void ElevationMap::populateMap(){
     
     for (int i = 0; i < 3; i++)
         axis[i] = axis[i].normalize();
-    
-    if (threadCount <= 1) {
-        // Finish allocating map.
-        threads[0].join();
-        // Populate map using single thread.
-        populatePartial(0, mapSizeX);
-    }
+    kernel.Init(originLat, originLon, origin, axis);
+    rowBegin = 0;
+    rowEnd = -1;
+}
+
+/** ElevationMap::populateRows
+ * DESCRIPTION:
+ *      Populates the elevation, range, azimuth and elevation angle of
+ *      rows of the map, which become the rows held by the planes.
+ * ARGUMENTS:
+ *      int first, last
+ *          The first and last rows.
+ */
+void ElevationMap::populateRows(int first, int last) {
+    rowBegin = first;
+    rowEnd = last;
+    planes.firstRow = isStreaming() ? first : 0;
+    if (isStreaming() && planes.heights)
+        // The heights of the wedge reuse the rows of the previous one.
+        for (int i = first; i <= last; i++)
+            elevation_map[i] = planes.heights + (size_t)(i - first) * planes.stride;
+
+    // Populate elevation, azimuth, elevation, and radius, a tile of
+    // rows of the map at a time. Each thread starts with a contiguous
+    // share of the rows, so that it is the only one to write the pages of
+    // its rows, and the first to touch them.
+    ThreadPool& pool = ThreadPool::Instance();
+    auto partial = [this](int start, int end) { populatePartial(start, end); };
+    if (polar)
+        pool.ParallelFor(first, last, 1, partial);
     else {
-        // Break map into N-1 parts.
-        float mapDelta2 = float(mapSizeX-1)/float(threadCount - 1);
-        
-        // Use N-1 threads to populate elevation, azimuth, elevation, and radius.
-        threads[1] = std::thread(&ElevationMap::populatePartial, this, 0, int(mapDelta2));
-        for (int i = 2; i < threadCount; i++) 
-            threads[i] = std::thread(   &ElevationMap::populatePartial,this, 
-                                        int(mapDelta2*(i-1))+1,
-                                        int(mapDelta2*(i))
-                                    );
-        // Wait for threads to complete.
-        for (int i = 0; i < threadCount; i++)
-            threads[i].join();
-        
-        delete[] threads;
-        if (Options->PROG_VERBOSE)
-            cout << "Finished populating map." << endl;
+        // The rows far from the radar are mostly outside the radius,
+        // where cells are only given dummy values.
+        vector<double> weight(last - first + 1);
+        for (int i = first; i <= last; i++) {
+            int live = circleCells(abs(i - mapOriginX));
+            weight[i - first] = live + (mapSizeY - live) / 16.0;
+        }
+        pool.WeightedFor(first, last, weight, partial);
+    }
+    if (Options->PROG_VERBOSE && !isStreaming()) {
+        cout << "Finished populating map." << endl;
+        pool.Report("Populating");
     }
+}
+
+/** ElevationMap::finishMap
+ * DESCRIPTION:
+ *      Releases the tiles and saves the map cache once every row of the
+ *      map has been populated.
+ */
+void ElevationMap::finishMap() {
+    TileCache& cache = TileCache::Instance();
+    prefetcher.Release();
+    if (mapCache.IsOpen() && !mapCache.IsHit()) {
+        bool saved = mapCache.Commit(originHeight - Options->SIMULATOR_TRANSMITTER_HEIGHT);
+        if (Options->PROG_VERBOSE && saved)
+            cout << "Saved map cache " << mapCache.Path() << endl;
+    }
+    if (clampedHeights > 0)
+        cout << "Warning: " << clampedHeights << " cells are more than 3276 m from the radar's elevation"
+             << " and were clamped in the compact map." << endl;
+    if (Options->PROG_VERBOSE && Options->SIMULATOR_NUMA)
+        reportNuma();
+    if (Options->PROG_VERBOSE) {
+        cout << "Tile cache: " << cache.loads << " tiles loaded, " 
+             << cache.hits << " hits, " << cache.evictions << " evicted." << endl;
+    }
+}
+
+/** ElevationMap::reportNuma
+ * DESCRIPTION:
+ *      Prints the share of the map held by each NUMA node, and the pages
+ *      allocated by the threads of each node on it and on other nodes
+ *      since the map was allocated, from numastat. The kernel counts
+ *      allocations of every process, and does not count bandwidth.
+ */
+void ElevationMap::reportNuma() {
+    const NumaTopology& topology = NumaTopology::Instance();
+    if (arena.Size() == 0 || numaCounters.empty())
+        return;
+    std::vector<size_t> resident;
+    arena.Resident(&resident);
+    for (int k = 0; k < topology.Nodes(); k++) {
+        NumaTopology::counters_t now = topology.Counters(k);
+        cout << "NUMA node " << k << ": " << resident[k] / (1024 * 1024) << " MB of the map, "
+             << now.local - numaCounters[k].local << " pages allocated locally, "
+             << now.remote - numaCounters[k].remote << " remotely." << endl;
+    }
+}
+
+/** ElevationMap::calculateRowAngles
+ * DESCRIPTION:
+ *      Calculates the shadowing and grazing angles of the rows held by
+ *      the planes.
+ */
+void ElevationMap::calculateRowAngles() {
+    bool verbose = Options->PROG_VERBOSE && !isStreaming();
     // Calculate Shadowing.
     if (Options->SIMULATOR_SHADOWING_ENABLED) {
         calculateShadowing();
-        if (Options->PROG_VERBOSE)
+        if (verbose) {
             cout << "Finished shadowing calculations." << endl;
+            ThreadPool::Instance().Report("Shadowing");
+        }
     }
 
     populateGrazingAngle();
-    if (Options->PROG_VERBOSE)
+    if (verbose) {
         cout << "Finished grazing angle calculations." << endl;
-    map[mapOriginX][mapOriginY].shadowed = 1;
-    exportMap();
+        ThreadPool::Instance().Report("Grazing angles");
+    }
+    // The radar does not see its own cell. The polar grid has none.
+    if (!polar)
+        planes.shadowed[cell(mapOriginX, mapOriginY)] = 1;
 }
 
 
@@ -141,7 +336,9 @@ void ElevationMap::seekMaxima() {
 }
 /** ElevationReader::calculateLatLon
  * DESCRIPTION:
- *      Calculates the latitude and longitude for a specific element on the map. 
+ *      Calculates the latitude and longitude for a specific element on the
+ *      map, by walking east or west from the origin, then north or south.
+ *      See GeodesicGrid, which must have been built.
  * ARGUMENTS:
  *      int x, y
  *          The element of the map. 
@@ -149,64 +346,280 @@ void ElevationMap::seekMaxima() {
  *          Pointers to the latitude and longitude. These will be overwritten. 
  */
 void ElevationMap::calculateLatLon(int x, int y, float* lat, float* lon) {
-    double latTemp = (double)originLat;
-    double lonTemp = (double)originLon;
-
-    double walkAzimuth = 0;
-    if (x != mapOriginX) {
-        if (x < mapOriginX)
-            walkAzimuth = 90;
-        else if (x > mapOriginX)
-            walkAzimuth = 270;
-        ER->WalkDistance(    (double)originLat, 
-                            (double)originLon, 
-                            walkAzimuth, 
-                            (double)fabs(x-mapOriginX)*deltaDistance,
-                            &latTemp, 
-                            &lonTemp );
+    grid.LatLon(x, y, lat, lon);
+}
+
+/** ElevationMap::circleCells
+ * DESCRIPTION:
+ *      Counts the cells of a row of the map that are within the radius,
+ *      as measured by the alpha max plus beta min distance of
+ *      populatePartial.
+ * ARGUMENTS:
+ *      int d
+ *          The distance of the row from the origin, in cells.
+ */
+int ElevationMap::circleCells(int d) const {
+    if (d >= (int)circleExtent.size())
+        return 0;
+    int e = circleExtent[d];
+    return std::max(0, std::min(mapSizeY - 1, mapOriginY + e) - std::max(0, mapOriginY - e) + 1);
+}
+
+/** ElevationMap::visibleCells
+ * DESCRIPTION:
+ *      Counts the cells of a row that are neither shadowed nor outside the
+ *      radius.
+ * ARGUMENTS:
+ *      int x
+ *          The row.
+ */
+int ElevationMap::visibleCells(int x) const {
+    int span = rowSpan();
+    int count = 0;
+    for (int j0 = 0; j0 < mapSizeY; j0 += span) {
+        const uint8_t* shadowed = shadowedRow(x, j0);
+        int n = std::min(span, mapSizeY - j0);
+        for (int k = 0; k < n; k++)
+            count += shadowed[k] == 0;
+    }
+    return count;
+}
+
+/** ElevationMap::calculateFootprint
+ * DESCRIPTION:
+ *      Calculates the latitude and longitude bounds of the area covered
+ *      by the map, from its corners and the midpoints of its edges.
+ * ARGUMENTS:
+ *      double* latMin, latMax, lonMin, lonMax
+ *          Pointers to the bounds in degrees. These will be overwritten.
+ */
+void ElevationMap::calculateFootprint(double* latMin, double* latMax, double* lonMin, double* lonMax) {
+    int xs[3] = {0, mapOriginX, mapSizeX - 1};
+    int ys[3] = {0, mapOriginY, mapSizeY - 1};
+    *latMin = *lonMin = 1000;
+    *latMax = *lonMax = -1000;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++) {
+            float lat, lon;
+            calculateLatLon(xs[i], ys[j], &lat, &lon);
+            *latMin = fmin(*latMin, lat);
+            *latMax = fmax(*latMax, lat);
+            *lonMin = fmin(*lonMin, lon);
+            *lonMax = fmax(*lonMax, lon);
+        }
+}
+
+/** ElevationMap::listTiles
+ * DESCRIPTION:
+ *      Lists every tile the map will read.
+ * ARGUMENTS:
+ *      double latMin, latMax, lonMin, lonMax
+ *          The bounds of the map in degrees.
+ *      vector<TilePrefetcher::request_t>* tiles
+ *          The list to append the tiles to.
+ */
+void ElevationMap::listTiles(double latMin, double latMax, double lonMin, double lonMax,
+                             vector<TilePrefetcher::request_t>* tiles) {
+    ER->ListTiles(latMin, latMax, lonMin, lonMax, FLT_MAX, tiles);
+
+    // 1 arc second tiles are only needed close to the radar.
+    double range = Options->DEM_PARSER_SRTM1_RANGE * 1.1;
+    double dLat = range / 111000.0;
+    double dLon = range / (111000.0 * cos(originLat * M_PI / 180.0));
+    ER->ListTiles(  fmax(latMin, originLat - dLat), fmin(latMax, originLat + dLat),
+                    fmax(lonMin, originLon - dLon), fmin(lonMax, originLon + dLon),
+                    0, tiles);
+}
+
+/** ElevationMap::prefetchTiles
+ * DESCRIPTION:
+ *      Starts loading every tile the map will need on background threads,
+ *      so that the workers only wait for tiles that have not arrived yet.
+ * ARGUMENTS:
+ *      const vector<TilePrefetcher::request_t>& tiles
+ *          The tiles to load, see listTiles.
+ */
+void ElevationMap::prefetchTiles(const vector<TilePrefetcher::request_t>& tiles) {
+    if (Options->DEM_PARSER_PREFETCH_THREADS <= 0)
+        return;
+    prefetcher.Start(tiles, Options->DEM_PARSER_PREFETCH_THREADS, TileCache::Instance().Budget());
+    if (Options->PROG_VERBOSE)
+        cout << "Prefetching " << tiles.size() << " tiles." << endl;
+}
+
+/** ElevationMap::siteKey
+ * DESCRIPTION:
+ *      Hashes every input the resampled grid of the site depends on,
+ *      including the name and the checksum of the tiles it is sampled
+ *      from, see MapCache::HashFile. Returns 0 if no cache is in use.
+ * ARGUMENTS:
+ *      const vector<TilePrefetcher::request_t>& tiles
+ *          The tiles the map reads, see listTiles.
+ */
+uint64_t ElevationMap::siteKey(const vector<TilePrefetcher::request_t>& tiles) {
+    // The checksums of the tiles are kept with the cache that uses them.
+    // Without a cache, there is no need to read the tiles for the key.
+    const string& folder = Options->DEM_PARSER_MAP_CACHE_FOLDER != "" ? Options->DEM_PARSER_MAP_CACHE_FOLDER
+                                                                       : Options->DEM_PARSER_GEOMETRY_CACHE_FOLDER;
+    if (folder == "")
+        return 0;
+    uint64_t key = MapCache::hashSeed;
+    key = MapCache::Hash(&originLat, sizeof(originLat), key);
+    key = MapCache::Hash(&originLon, sizeof(originLon), key);
+    key = MapCache::Hash(&deltaDistance, sizeof(deltaDistance), key);
+    key = MapCache::Hash(&mapSizeX, sizeof(mapSizeX), key);
+    key = MapCache::Hash(&mapSizeY, sizeof(mapSizeY), key);
+    key = MapCache::Hash(&Options->DEM_PARSER_POLAR, sizeof(uint8_t), key);
+    // Cells outside the radius hold the transmitter height.
+    key = MapCache::Hash(&Options->SIMULATOR_TRANSMITTER_HEIGHT, sizeof(float), key);
+    key = MapCache::Hash(&Options->DEM_PARSER_DISABLE_ELEVATION, sizeof(uint8_t), key);
+    key = MapCache::Hash(&Options->DEM_PARSER_SRTM1_RANGE, sizeof(float), key);
+    // The pyramid level depends on the range and azimuth bins.
+    key = MapCache::Hash(&Options->DEM_PARSER_PYRAMID, sizeof(uint8_t), key);
+    if (Options->DEM_PARSER_PYRAMID) {
+        key = MapCache::Hash(&Options->SIMULATOR_RANGE_BIN_PERIOD, sizeof(float), key);
+        key = MapCache::Hash(&Options->SIMULATOR_WAVE_SPEED, sizeof(float), key);
+        key = MapCache::Hash(&Options->SIMULATOR_AZIMUTH_ANGLE_COUNT, sizeof(uint16_t), key);
     }
+    for (size_t i = 0; i < tiles.size(); i++)
+        key = MapCache::HashFile(folder, tiles[i].filename, key);
+    if (Options->DEM_PARSER_MOSAIC_FILE != "")
+        key = MapCache::HashFile(folder, Options->DEM_PARSER_MOSAIC_FILE, key);
+    return key;
+}
 
-    double latTemp2 = 0;
-    double lonTemp2 = 0;
-    walkAzimuth = 0;
-    if (y != mapOriginY) {
-        if (y < mapOriginY)
-            walkAzimuth = 180;
-        else if (y > mapOriginY)
-            walkAzimuth = 0;
+/** ElevationMap::openMapCache
+ * DESCRIPTION:
+ *      Looks for the resampled grid of this site in the map cache folder.
+ *      If it is not there, a new grid is created for the workers to fill
+ *      in and saved once the map is populated.
+ * ARGUMENTS:
+ *      uint64_t key
+ *          The key of the grid, see siteKey.
+ * RETURNS:
+ *      true if the grid was found, in which case the map is populated
+ *      from it instead of the DEM.
+ */
+bool ElevationMap::openMapCache(uint64_t key) {
+    const string& folder = Options->DEM_PARSER_MAP_CACHE_FOLDER;
+    // The fused mode has no grid to fill in.
+    if (folder == "" || isFused())
+        return false;
+    if (mapCache.Open(folder, key, mapSizeX, mapSizeY)) {
+        if (Options->PROG_VERBOSE)
+            cout << "Using map cache " << mapCache.Path() << endl;
+        return true;
     }
-    ER->WalkDistance (   (double)latTemp, 
-                        (double)lonTemp, 
-                        walkAzimuth,
-                        (double)fabs(y-mapOriginY)*deltaDistance,
-                        &latTemp2, 
-                        &lonTemp2 );
-    *lat = (float)latTemp2;
-    *lon = (float)lonTemp2;
+    if (!mapCache.Create(folder, key, mapSizeX, mapSizeY))
+        cout << "Warning: could not create a map cache in " << folder << endl;
+    return false;
 }
 
-/** ElevationReader::calculateSphericalCoordinates
+/** ElevationMap::openGeometryCache
  * DESCRIPTION:
- *      Calculates the azimuth, elevation, and range from the origin. 
+ *      Looks for the finished planes of this site in the geometry cache
+ *      folder, and maps the map from them if they are there. Otherwise the
+ *      planes are saved by saveGeometryCache once computed. A streamed or
+ *      fused map is never whole, and is not cached.
  * ARGUMENTS:
- *      int lat, lon
- *          The lattitude and longitude of the point.
- *      float* az, el, r
- *          Pointers to the azimuth angle, elevation angle, and range. 
+ *      uint64_t key
+ *          The key of the grid of the site, see siteKey. The planes also
+ *          depend on the options hashed here.
+ * RETURNS:
+ *      true if the planes were found.
  */
-void ElevationMap::calculateSphericalCoordinates(float lat, float lon, float h, float* az, float* el, float* r) {
-    ThreeVector local = calculateECEF(lat, lon, h);
-    
-    float x,y,z;
-    x = (local - origin).dot(axis[0]);
-    y = (local - origin).dot(axis[1]);
-    z = (local - origin).dot(axis[2]);
-    // Calculate radius, elevation angle, and azimuth angle relative to the transmitter.
-    *r  = sqrt( pow(x,2) + 
-                pow(y,2) + 
-                pow(z,2) );
-    *el = atan2(z, sqrt(pow(x,2) + pow(y,2)));
-    *az = atan2(x, y);
+bool ElevationMap::openGeometryCache(uint64_t key) {
+    const string& folder = Options->DEM_PARSER_GEOMETRY_CACHE_FOLDER;
+    if (folder == "" || isStreaming() || isFused())
+        return false;
+    // The radius sets the compact range step.
+    key = MapCache::Hash(&Options->SIMULATOR_RADIUS, sizeof(float), key);
+    key = MapCache::Hash(&Options->SIMULATOR_SHADOWING_ENABLED, sizeof(uint8_t), key);
+    key = MapCache::Hash(&Options->DEM_PARSER_MAP_LAYOUT, sizeof(uint8_t), key);
+    key = MapCache::Hash(&Options->DEM_PARSER_COMPACT, sizeof(uint8_t), key);
+    key = MapCache::Hash(&Options->DEM_PARSER_SHADOWING_ENGINE, sizeof(uint8_t), key);
+    geometryKey = key;
+    if (!geometryCache.Open(folder, key, mapSizeX, mapSizeY))
+        return false;
+
+    const geometry_cache_header_t& h = geometryCache.Header();
+    planes = map_planes_t();
+    planes.compact = h.compact;
+    planes.rangeStep = h.rangeStep;
+    planes.heightOffset = h.heightOffset;
+    planes.stride = h.stride;
+    planes.cells = h.cells;
+    planes.tiled = h.tiled;
+    planes.tiles = h.tiles;
+    planes.firstRow = 0;
+    if (planes.compact) {
+        planes.r16 = (uint16_t*)geometryCache.Plane(GeometryCache::PlaneRange);
+        planes.az16 = (int16_t*)geometryCache.Plane(GeometryCache::PlaneAzimuth);
+        planes.el16 = (uint16_t*)geometryCache.Plane(GeometryCache::PlaneElevation);
+        planes.grazing16 = (uint16_t*)geometryCache.Plane(GeometryCache::PlaneGrazing);
+    } else {
+        planes.r = (float*)geometryCache.Plane(GeometryCache::PlaneRange);
+        planes.az = (float*)geometryCache.Plane(GeometryCache::PlaneAzimuth);
+        planes.el = (float*)geometryCache.Plane(GeometryCache::PlaneElevation);
+        planes.grazing = (float*)geometryCache.Plane(GeometryCache::PlaneGrazing);
+    }
+    planes.shadowed = (uint8_t*)geometryCache.Plane(GeometryCache::PlaneShadowed);
+    planes.heights = (float*)geometryCache.Plane(GeometryCache::PlaneHeights);
+    elevation_map = new float* [mapSizeX];
+    for (int i = 0; i < mapSizeX; i++)
+        elevation_map[i] = planes.heights + i * planes.stride;
+    rowBegin = 0;
+    rowEnd = mapSizeX - 1;
+    if (Options->PROG_VERBOSE)
+        cout << "Using geometry cache " << geometryCache.Path() << endl;
+    return true;
+}
+
+/** ElevationMap::saveGeometryCache
+ * DESCRIPTION:
+ *      Saves the finished planes to the geometry cache folder, for the
+ *      next runs at this site. The elevations are saved as floats, in the
+ *      row layout.
+ */
+void ElevationMap::saveGeometryCache() {
+    const string& folder = Options->DEM_PARSER_GEOMETRY_CACHE_FOLDER;
+    if (folder == "" || isStreaming())
+        return;
+    geometry_cache_header_t layout = geometry_cache_header_t();
+    layout.key = geometryKey;
+    layout.sizeX = mapSizeX;
+    layout.sizeY = mapSizeY;
+    layout.stride = planes.stride;
+    layout.cells = planes.cells;
+    layout.tiles = planes.tiles;
+    layout.tiled = planes.tiled;
+    layout.compact = planes.compact;
+    layout.rangeStep = planes.rangeStep;
+    layout.heightOffset = planes.heightOffset;
+    layout.originHeight = originHeight;
+    if (!geometryCache.Create(folder, layout)) {
+        cout << "Warning: could not create a geometry cache in " << folder << endl;
+        return;
+    }
+    const void* fields[4] = { planes.r, planes.az, planes.el, planes.grazing };
+    if (planes.compact) {
+        fields[0] = planes.r16;
+        fields[1] = planes.az16;
+        fields[2] = planes.el16;
+        fields[3] = planes.grazing16;
+    }
+    for (int p = 0; p < 4; p++)
+        memcpy(geometryCache.Plane((GeometryCache::Plane_t)p), fields[p],
+               GeometryCache::PlaneBytes(layout, (GeometryCache::Plane_t)p));
+    memcpy(geometryCache.Plane(GeometryCache::PlaneShadowed), planes.shadowed,
+           GeometryCache::PlaneBytes(layout, GeometryCache::PlaneShadowed));
+    float* heights = (float*)geometryCache.Plane(GeometryCache::PlaneHeights);
+    for (int i = 0; i < mapSizeX; i++)
+        for (int j = 0; j < mapSizeY; j++)
+            heights[i * planes.stride + j] = heightAt(i, j);
+    bool saved = geometryCache.Commit();
+    if (Options->PROG_VERBOSE && saved)
+        cout << "Saved geometry cache " << geometryCache.Path() << endl;
 }
 
 /** ElevationReader::populatePartial
@@ -215,16 +628,43 @@ void ElevationMap::calculateSphericalCoordinates(float lat, float lon, float h,
  *      Used to multithread the process.
  * ARGUMENTS:
  *      int start, end
- *          The start and end points of the map. 
+ *          The first and last rows to populate, within the rows held.
  */
 void ElevationMap::populatePartial(int start, int end) {
-    ElevationReader* E = new ElevationReader(Options);
-    // Wait until the first row is allocated.
-    while (alloc_i < 1)
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    //
-    for (int i = 0; i < mapSizeY; i++) {
-        for (int j = start; j <= end; j++) {
+    DemSource* E = reader();
+    // Each worker keeps its own row buffers.
+    SphericalKernel rowKernel = kernel;
+    // Row buffers for the cells within the radius.
+    int width = mapSizeY;
+    vector<int> cols(width);
+    vector<float> lat(width), lon(width), range(width), height(width);
+    vector<float> r(width), az(width), el(width);
+    // Ground footprint of each cell, used to pick the pyramid level: the
+    // smaller of the range bin length and the azimuth bin width, but
+    // never less than the map spacing.
+    vector<float> footprint(width);
+    float rangeBin = Options->SIMULATOR_WAVE_SPEED * Options->SIMULATOR_RANGE_BIN_PERIOD / 2;
+    float azimuthBin = 2 * M_PI / Options->SIMULATOR_AZIMUTH_ANGLE_COUNT;
+    for (int i = start; i <= end; i++) {
+        int n = 0;
+        if (polar) {
+            // Row i is a ray, and every one of its cells is within the
+            // radius.
+            GeodesicRay ray;
+            ray.Init(originLat, originLon, 360.0 * i / mapSizeX);
+            for (int j = 0; j < mapSizeY; j++) {
+                cols[n] = j;
+                range[n] = (j + 0.5) * deltaDistance;
+                if (mapCache.IsHit()) {
+                    lat[n] = mapCache.Lat(i)[j];
+                    lon[n] = mapCache.Lon(i)[j];
+                } else
+                    ray.Point(range[n], &lat[n], &lon[n]);
+                footprint[n] = fmax(deltaDistance, fmin(rangeBin, range[n] * azimuthBin));
+                n++;
+            }
+        }
+        else for (int j = 0; j < mapSizeY; j++) {
             // Calculate approximate distance from the origin using
             // alpha max + beta min algorithm.
             short max = j - mapOriginY;
@@ -246,58 +686,257 @@ void ElevationMap::populatePartial(int start, int end) {
             // the alpha max beta min algorithm.
             // See: https://en.wikipedia.org/wiki/Alpha_max_plus_beta_min_algorithm
             if ((max + (min >> 1)) <= mapRangeMax) {
-                float lat, lon;
-                calculateLatLon(i, j, &lat, &lon);
-                // Load elevation of the point.
-                elevation_map[i][j] = E->GetElevation(lat, lon);
-                // Calculate spherical coordinates.
-                calculateSphericalCoordinates(  lat, 
-                                                lon, 
-                                                elevation_map[i][j], 
-                                                &map[i][j].az, 
-                                                &map[i][j].el, 
-                                                &map[i][j].r);
+                cols[n] = j;
+                if (mapCache.IsHit()) {
+                    lat[n] = mapCache.Lat(i)[j];
+                    lon[n] = mapCache.Lon(i)[j];
+                } else
+                    calculateLatLon(i, j, &lat[n], &lon[n]);
+                range[n] = (max + (min >> 1)) * deltaDistance;
+                footprint[n] = fmax(deltaDistance, fmin(rangeBin, range[n] * azimuthBin));
+                n++;
             } else {
                 // If the chunk is out of range, assign dummy values
                 // and shadow the chunk.
-                elevation_map[i][j] = Options->SIMULATOR_TRANSMITTER_HEIGHT;
-                map[i][j].az = 0.01;
-                map[i][j].el = 0.01;
-                map[i][j].r = mapRangeMax;
-                map[i][j].shadowed = (0x01 << 1);
+                if (!mapCache.IsHit())
+                    setHeight(i, j, Options->SIMULATOR_TRANSMITTER_HEIGHT);
+                size_t c = cell(i, j);
+                setAngles(c, mapRangeMax, 0.01, 0.01);
+                planes.shadowed[c] = (0x01 << 1);
             }
-                                                
         }
-        // Wait for the next row to be allocated before continuing.
-        while (i >= alloc_i - 1)
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        if (mapCache.IsHit()) {
+            // elevation_map is mapped from the cached grid.
+            for (int k = 0; k < n; k++)
+                height[k] = elevation_map[i][cols[k]];
+        } else {
+            // Load the elevation of every cell of the row at once.
+            E->GetElevationBatch(lat.data(), lon.data(), height.data(), n, range.data(),
+                                 Options->DEM_PARSER_PYRAMID ? footprint.data() : NULL);
+            for (int k = 0; k < n; k++) {
+                int j = cols[k];
+                if (!setHeight(i, j, height[k]))
+                    clampedHeights++;
+                if (mapCache.IsOpen()) {
+                    mapCache.Lat(i)[j] = lat[k];
+                    mapCache.Lon(i)[j] = lon[k];
+                }
+            }
+        }
+        // Calculate spherical coordinates. The cells of a Cartesian row
+        // share their longitude.
+        if (polar)
+            rowKernel.Cells(lat.data(), lon.data(), height.data(), n, r.data(), az.data(), el.data());
+        else if (n > 0)
+            rowKernel.Row(lon[0], lat.data(), height.data(), n, r.data(), az.data(), el.data());
+        for (int k = 0; k < n; k++) {
+            size_t c = cell(i, cols[k]);
+            planes.shadowed[c] = 0;
+            setAngles(c, r[k], az[k], el[k]);
+        }
     }
-    delete E;
+}
+
+/** ElevationMap::reader
+ * DESCRIPTION:
+ *      Returns the DEM source of the calling thread of the pool. It is
+ *      opened on first use and kept until the map is destroyed, so the
+ *      tiles of a loop, and the loops of the wedges, share it. The caller
+ *      of the loops reads through ER.
+ */
+DemSource* ElevationMap::reader() {
+    int index = ThreadPool::ThreadIndex();
+    if (index == 0)
+        return ER;
+    if (readers[index] == NULL)
+        readers[index] = DemSource::Create(Options);
+    return readers[index];
 }
 
 /*  ElevationMap::allocateMap
     DESCRIPTION:
-        Allocates the memory necessary for the map.
+        Allocates the memory necessary for the map: one arena for the
+        planes, and for the elevations unless they live in the map cache.
 */
 void ElevationMap::allocateMap() {
-    map = new chunk_t* [mapSizeX];
+    // Pad the rows to 64 cells, so that each starts on a cache line. The
+    // elevations keep the row layout of the map cache.
+    planes.stride = ((size_t)mapSizeY + 63) & ~(size_t)63;
+    // The rays of the polar grid are already contiguous: it keeps the row
+    // layout.
+    planes.tiled = Options->DEM_PARSER_MAP_LAYOUT == 1 && !polar;
+    planes.tiles = ((size_t)mapSizeY + MAP_TILE_SIZE - 1) >> MAP_TILE_SHIFT;
+    planes.firstRow = 0;
+    bool ownHeights = !mapCache.IsOpen();
+    planes.compact = Options->DEM_PARSER_COMPACT;
+    planes.rangeStep = 1.5f * Options->SIMULATOR_RADIUS / 65535;
+    planes.heightOffset = originHeight - Options->SIMULATOR_TRANSMITTER_HEIGHT;
+    clampedHeights = 0;
+    size_t fieldBytes = planes.compact ? sizeof(uint16_t) : sizeof(float);
+    size_t heightBytes = ownHeights ? fieldBytes : 0;
+    // Bytes per row of the planes, with the elevations.
+    size_t rowBytes = planes.stride * (4 * fieldBytes + sizeof(uint8_t) + heightBytes);
+    int rows = mapSizeX;
+    if (isStreaming()) {
+        // As many rays as fit in the budget, in whole azimuth bins so
+        // that each bin is accumulated at once.
+        int raysPerBin = std::max(1, mapSizeX / (int)Options->SIMULATOR_AZIMUTH_ANGLE_COUNT);
+        size_t budget = (size_t)Options->DEM_PARSER_MEMORY_BUDGET * 1024 * 1024;
+        rows = std::min((size_t)mapSizeX, budget / rowBytes);
+        rows = std::max(raysPerBin, rows - rows % raysPerBin);
+        if ((size_t)rows * rowBytes > budget)
+            cout << "Warning: a wedge of " << rows << " rays needs " << rows * rowBytes / (1024 * 1024)
+                 << " MB, over the memory budget." << endl;
+        wedgeRows = rows;
+    }
+    size_t heightCells = planes.stride * rows;
+    size_t cells = heightCells;
+    if (planes.tiled) {
+        size_t tileRows = ((size_t)rows + MAP_TILE_SIZE - 1) >> MAP_TILE_SHIFT;
+        cells = (tileRows * planes.tiles) << (2 * MAP_TILE_SHIFT);
+    }
+    planes.cells = cells;
+    size_t bytes = 4 * MapArena::Padded(cells * fieldBytes) + MapArena::Padded(cells * sizeof(uint8_t))
+                 + MapArena::Padded(heightCells * heightBytes);
+    arena.Allocate(bytes, Options->DEM_PARSER_HUGEPAGES);
+    if (planes.compact) {
+        planes.r16 = (uint16_t*)arena.Carve(cells * fieldBytes);
+        planes.az16 = (int16_t*)arena.Carve(cells * fieldBytes);
+        planes.el16 = (uint16_t*)arena.Carve(cells * fieldBytes);
+        planes.grazing16 = (uint16_t*)arena.Carve(cells * fieldBytes);
+    } else {
+        planes.r = (float*)arena.Carve(cells * fieldBytes);
+        planes.az = (float*)arena.Carve(cells * fieldBytes);
+        planes.el = (float*)arena.Carve(cells * fieldBytes);
+        planes.grazing = (float*)arena.Carve(cells * fieldBytes);
+    }
+    planes.shadowed = (uint8_t*)arena.Carve(cells * sizeof(uint8_t));
+    if (ownHeights && planes.compact)
+        planes.heights16 = (int16_t*)arena.Carve(heightCells * heightBytes);
+    else if (ownHeights)
+        planes.heights = (float*)arena.Carve(heightCells * heightBytes);
+    if (Options->SIMULATOR_NUMA) {
+        // Nothing has been written yet. Each stage splits the rows in
+        // equal shares, one per thread, so the rows of the shares of the
+        // threads of node k are backed by node k.
+        const NumaTopology& topology = NumaTopology::Instance();
+        int threads = ThreadPool::Instance().Size();
+        vector<double> starts(topology.Nodes());
+        for (int k = 0; k < topology.Nodes(); k++)
+            starts[k] = (double)topology.FirstOf(k, threads) / threads;
+        arena.Spread(starts);
+        // Cartesian shadowing writes along lines, or sectors, from the
+        // radar across every stripe of rows.
+        if (!polar)
+            arena.Interleave(planes.shadowed);
+        numaCounters.resize(topology.Nodes());
+        for (int k = 0; k < topology.Nodes(); k++)
+            numaCounters[k] = topology.Counters(k);
+    }
     elevation_map = new float* [mapSizeX];
-    for (alloc_i = 0; alloc_i < mapSizeX; ) {
-        map[alloc_i] = new chunk_t [mapSizeY];
-        elevation_map[alloc_i] = new float [mapSizeY];
-        alloc_i++;
+    for (int i = 0; i < mapSizeX; i++)
+        // With a map cache, the elevations live in the cached grid. A
+        // streamed map points the rows of each wedge at the arena.
+        elevation_map[i] = !ownHeights ? mapCache.Height(i)
+                         : i < rows && planes.heights ? planes.heights + i * planes.stride : NULL;
+}
+
+/** ElevationMap::setAngles
+ * DESCRIPTION:
+ *      Stores the range, azimuth and elevation angle of a cell, rounded to
+ *      the compact profile if used.
+ */
+void ElevationMap::setAngles(size_t c, float r, float az, float el) {
+    if (!planes.compact) {
+        planes.r[c] = r;
+        planes.az[c] = az;
+        planes.el[c] = el;
+        return;
     }
-    alloc_i++;
+    planes.r16[c] = (uint16_t)std::min(65535L, lrintf(r / planes.rangeStep));
+    // pi wraps around to -pi.
+    planes.az16[c] = (int16_t)(uint16_t)lrintf(az * (float)(32768 / M_PI));
+    planes.el16[c] = FloatToHalf(el);
+}
+
+/** ElevationMap::setHeight
+ * DESCRIPTION:
+ *      Stores the elevation of a cell, rounded to the compact profile if
+ *      used.
+ * RETURNS:
+ *      bool
+ *          False if the elevation is too far from the radar's for the
+ *          compact profile, and was clamped.
+ */
+bool ElevationMap::setHeight(int x, int y, float h) {
+    if (!planes.heights16) {
+        elevation_map[x][y] = h;
+        return true;
+    }
+    long d = lrintf((h - planes.heightOffset) * 10);
+    bool fits = d >= -32768 && d <= 32767;
+    if (!fits)
+        d = d < 0 ? -32768 : 32767;
+    planes.heights16[(size_t)(x - planes.firstRow) * planes.stride + y] = (int16_t)d;
+    return fits;
+}
+
+/** ElevationMap::rangeRow, azimuthRow, elevationRow, grazingRow
+ * DESCRIPTION:
+ *      Returns the cells of a row of a plane from a column, converted to
+ *      float in the compact profile.
+ * ARGUMENTS:
+ *      int x, y
+ *          The row and first column.
+ *      int n
+ *          The number of cells, at most to the end of the row span.
+ *      float* buffer
+ *          Room for n cells, used in the compact profile.
+ */
+const float* ElevationMap::rangeRow(int x, int y, int n, float* buffer) const {
+    if (!planes.compact)
+        return planes.r + cell(x, y);
+    const uint16_t* q = planes.r16 + cell(x, y);
+    for (int k = 0; k < n; k++)
+        buffer[k] = q[k] * planes.rangeStep;
+    return buffer;
+}
+
+const float* ElevationMap::azimuthRow(int x, int y, int n, float* buffer) const {
+    if (!planes.compact)
+        return planes.az + cell(x, y);
+    const int16_t* q = planes.az16 + cell(x, y);
+    for (int k = 0; k < n; k++)
+        buffer[k] = q[k] * (float)(M_PI / 32768);
+    return buffer;
+}
+
+const float* ElevationMap::elevationRow(int x, int y, int n, float* buffer) const {
+    if (!planes.compact)
+        return planes.el + cell(x, y);
+    const uint16_t* q = planes.el16 + cell(x, y);
+    for (int k = 0; k < n; k++)
+        buffer[k] = HalfToFloat(q[k]);
+    return buffer;
+}
+
+const float* ElevationMap::grazingRow(int x, int y, int n, float* buffer) const {
+    if (!planes.compact)
+        return planes.grazing + cell(x, y);
+    const uint16_t* q = planes.grazing16 + cell(x, y);
+    for (int k = 0; k < n; k++)
+        buffer[k] = HalfToFloat(q[k]);
+    return buffer;
 }
 
 /*  ElevationMap::deallocateMap
     DESCRIPTION:
-        Allocates the memory necessary for the map.
+        Deallocates the map planes.
 */
 void ElevationMap::deallocateMap(){
-    for (int i = 0; i < mapSizeX; i++)
-        delete [] map[i];
-    delete [] map;
+    arena.Release();
+    planes = map_planes_t();
 }
 
 /** ElevationReader::deallocateElevation
@@ -305,14 +944,60 @@ void ElevationMap::deallocateMap(){
  *      Deallocates the elevation map.
  */
 void ElevationMap::deallocateElevation() {
-    for (int i = 0; i < mapSizeX; i++)
-        delete [] elevation_map[i];
+    // The rows point into the arena or the map cache.
     delete [] elevation_map;
+    elevation_map = NULL;
 }
 
 
+/** ElevationMap::cellArea
+ * DESCRIPTION:
+ *      Returns the ground area of a cell in square meters. Polar cells are
+ *      annulus sectors, whose area grows with their range.
+ * ARGUMENTS:
+ *      int x, y
+ *          The cell.
+ */
+double ElevationMap::cellArea(int x, int y) const {
+    (void)x;
+    if (polar)
+        return (y + 0.5) * deltaDistance * polarStep * deltaDistance;
+    return deltaDistance * deltaDistance;
+}
+
+/** ElevationMap::getMap
+ * DESCRIPTION:
+ *      Returns every field of a cell of the map. Stages that scan the
+ *      map should read the planes with the row accessors instead.
+ * ARGUMENTS:
+ *      int x, y
+ *          The cell.
+ */
 chunk_t ElevationMap::getMap(int x, int y) {
-    return map[x][y];
+    size_t c = cell(x, y);
+    chunk_t m;
+    m.r = rangeAt(c);
+    m.az = azimuthAt(c);
+    m.el = elevationAt(c);
+    m.shadowed = planes.shadowed[c];
+    m.grazing = grazingAt(c);
+    return m;
+}
+
+/** ElevationMap::setMap
+ * DESCRIPTION:
+ *      Overwrites every field of a cell of the map.
+ * ARGUMENTS:
+ *      int x, y
+ *          The cell.
+ *      chunk_t m
+ *          The new values.
+ */
+void ElevationMap::setMap(int x, int y, chunk_t m) {
+    size_t c = cell(x, y);
+    setAngles(c, m.r, m.az, m.el);
+    planes.shadowed[c] = m.shadowed;
+    setGrazing(c, m.grazing);
 }
 
 
@@ -325,6 +1010,16 @@ chunk_t ElevationMap::getMap(int x, int y) {
 */
 ElevationMap::ElevationMap(options_t* O) {
     this->Options = O;
+    polar = false;
+    polarStep = 0;
+    wedgeRows = 0;
+    rowBegin = 0;
+    rowEnd = -1;
+    clampedHeights = 0;
+    geometryKey = 0;
+    planes = map_planes_t();
+    elevation_map = NULL;
+    ER = NULL;
 }
 
 /*  ElevationMap::~ElevationMap
@@ -334,6 +1029,8 @@ ElevationMap::ElevationMap(options_t* O) {
 ElevationMap::~ElevationMap(){
     deallocateMap();
     deallocateElevation();
+    for (size_t i = 0; i < readers.size(); i++)
+        delete readers[i];
     delete ER;
 }
 
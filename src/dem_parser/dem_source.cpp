@@ -0,0 +1,17 @@
+#include "dem_parser/dem_source.h"
+#include "dem_parser/elevation_reader.h"
+#include "dem_parser/mosaic_reader.h"
+
+/** DemSource::Create
+ * DESCRIPTION:
+ *      Creates the DEM source selected by the options: the mosaic if
+ *      DEM_PARSER_MOSAIC_FILE is set, the SRTM tiles otherwise.
+ * ARGUMENTS:
+ *      options_t* Options
+ *          A pointer to the program options.
+ */
+DemSource* DemSource::Create(options_t* Options) {
+    if (Options->DEM_PARSER_MOSAIC_FILE != "" && !Options->DEM_PARSER_DISABLE_ELEVATION)
+        return new MosaicReader(Options->DEM_PARSER_MOSAIC_FILE);
+    return new ElevationReader(Options);
+}
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "dem_parser/dem_tile.h"
+#include "dem_parser/map_cache.h"
+
+using std::cout;
+using std::endl;
+
+/** FillVoids
+ * DESCRIPTION:
+ *      Replaces the voids of a tile by interpolating the nearest valid
+ *      samples to the north, south, east and west of each void, weighted
+ *      by the inverse of their distance. Only samples that were valid on
+ *      entry are used, so the result does not depend on the order the
+ *      voids are visited in. Voids with no valid sample in any of the
+ *      four directions are set to 0.
+ *
+ *      The tile is scanned twice: north west to south east for the north
+ *      and west neighbours, and back for the south and east ones. Memory
+ *      use is proportional to the number of voids.
+ * ARGUMENTS:
+ *      int16_t* samples
+ *          The native-endian samples of the tile, north row first.
+ *      int totalPx
+ *          The number of samples per row and column.
+ * RETURNS:
+ *      The number of voids filled.
+ */
+size_t FillVoids(int16_t* samples, int totalPx) {
+    size_t n = (size_t)totalPx * totalPx;
+    size_t voids = 0;
+    for (size_t i = 0; i < n; i++)
+        voids += samples[i] == DEM_TILE_VOID;
+    if (voids == 0)
+        return 0;
+
+    std::vector<float> sum(voids, 0), weight(voids, 0);
+    // The last valid sample seen in each column, and its row.
+    std::vector<int> lastRow(totalPx);
+    std::vector<int16_t> lastValue(totalPx);
+
+    // Forward pass, for the north and west neighbours.
+    size_t k = 0;
+    std::fill(lastRow.begin(), lastRow.end(), -1);
+    for (int r = 0; r < totalPx; r++) {
+        int lastCol = -1;
+        for (int c = 0; c < totalPx; c++) {
+            int16_t h = samples[(size_t)r * totalPx + c];
+            if (h != DEM_TILE_VOID) {
+                lastCol = c;
+                lastRow[c] = r;
+                lastValue[c] = h;
+                continue;
+            }
+            if (lastCol >= 0) {
+                float w = 1.0f / (c - lastCol);
+                sum[k] += w * samples[(size_t)r * totalPx + lastCol];
+                weight[k] += w;
+            }
+            if (lastRow[c] >= 0) {
+                float w = 1.0f / (r - lastRow[c]);
+                sum[k] += w * lastValue[c];
+                weight[k] += w;
+            }
+            k++;
+        }
+    }
+
+    // Backward pass, for the south and east neighbours. The voids are
+    // visited in reverse order, so k counts down.
+    std::fill(lastRow.begin(), lastRow.end(), -1);
+    for (int r = totalPx - 1; r >= 0; r--) {
+        int lastCol = -1;
+        for (int c = totalPx - 1; c >= 0; c--) {
+            int16_t h = samples[(size_t)r * totalPx + c];
+            if (h != DEM_TILE_VOID) {
+                lastCol = c;
+                lastRow[c] = r;
+                lastValue[c] = h;
+                continue;
+            }
+            k--;
+            if (lastCol >= 0) {
+                float w = 1.0f / (lastCol - c);
+                sum[k] += w * samples[(size_t)r * totalPx + lastCol];
+                weight[k] += w;
+            }
+            if (lastRow[c] >= 0) {
+                float w = 1.0f / (lastRow[c] - r);
+                sum[k] += w * lastValue[c];
+                weight[k] += w;
+            }
+        }
+    }
+
+    // Only now write the filled samples, so that no fill feeds another.
+    k = 0;
+    for (size_t i = 0; i < n; i++)
+        if (samples[i] == DEM_TILE_VOID) {
+            samples[i] = weight[k] > 0 ? (int16_t)floor(sum[k] / weight[k] + 0.5f) : 0;
+            k++;
+        }
+    return voids;
+}
+
+/** ConvertSrtmTile
+ * DESCRIPTION:
+ *      Converts a single .hgt tile into a .dem tile.
+ * ARGUMENTS:
+ *      const std::string& source, destination
+ *          The paths of the .hgt tile and of the .dem tile to write.
+ *      int lat, lon
+ *          The south west corner of the tile in degrees.
+ * RETURNS:
+ *      true if the tile was converted.
+ */
+bool ConvertSrtmTile(const std::string& source, const std::string& destination, int lat, int lon) {
+    FILE* in = fopen(source.c_str(), "rb");
+    if (in == NULL)
+        return false;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    // SRTM tiles are square, so the size gives the resolution.
+    int totalPx = (int)round(sqrt(size / 2.0));
+    if (totalPx < 2 || (long)totalPx * totalPx * 2 != size) {
+        fclose(in);
+        return false;
+    }
+    size_t n = (size_t)totalPx * totalPx;
+    std::vector<unsigned char> raw(n * 2);
+    if (fread(raw.data(), 1, n * 2, in) != n * 2) {
+        fclose(in);
+        return false;
+    }
+    fclose(in);
+
+    std::vector<int16_t> samples(n);
+    for (size_t i = 0; i < n; i++)
+        samples[i] = (int16_t)((raw[2*i] << 8) | raw[2*i + 1]);
+    FillVoids(samples.data(), totalPx);
+
+    dem_tile_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DEM_TILE_MAGIC, 4);
+    header.version = DEM_TILE_VERSION;
+    header.sampleType = DEM_TILE_SAMPLE_INT16;
+    header.headerSize = sizeof(header);
+    header.lat = lat;
+    header.lon = lon;
+    header.totalPx = totalPx;
+    header.secondsPerPx = 3600 / (totalPx - 1);
+    // Keys caches built from the tile without reading its samples again.
+    header.checksum = MapCache::Hash(samples.data(), n * sizeof(int16_t), MapCache::hashSeed);
+
+    FILE* out = fopen(destination.c_str(), "wb");
+    if (out == NULL)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(samples.data(), sizeof(int16_t), n, out) == n;
+    fclose(out);
+    return ok;
+}
+
+/** ConvertSrtmFolder
+ * DESCRIPTION:
+ *      Converts every .hgt tile of a folder into a .dem tile with the same
+ *      name in the destination folder. This only needs to be done once
+ *      per SRTM folder.
+ * ARGUMENTS:
+ *      const std::string& source
+ *          The SRTM folder.
+ *      const std::string& destination
+ *          The folder to write the .dem tiles to. Created if necessary.
+ *      bool verbose
+ *          Print every converted tile.
+ * RETURNS:
+ *      The number of tiles converted, or -1 if a folder could not be opened.
+ */
+int ConvertSrtmFolder(const std::string& source, const std::string& destination, bool verbose) {
+    DIR* dir = opendir(source.c_str());
+    if (dir == NULL) {
+        cout << "Error opening " << source << endl;
+        return -1;
+    }
+    mkdir(destination.c_str(), 0755);
+
+    int converted = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char ns, ew;
+        int lat, lon;
+        char ext[8];
+        if (sscanf(entry->d_name, "%c%2d%c%3d.%3s", &ns, &lat, &ew, &lon, ext) != 5 ||
+            strcmp(ext, "hgt") != 0)
+            continue;
+        lat = (ns == 'S' || ns == 's') ? -lat : lat;
+        lon = (ew == 'W' || ew == 'w') ? -lon : lon;
+
+        std::string name(entry->d_name);
+        name = name.substr(0, name.size() - 3) + "dem";
+        if (!ConvertSrtmTile(source + "/" + entry->d_name, destination + "/" + name, lat, lon)) {
+            cout << "Error converting " << entry->d_name << endl;
+            continue;
+        }
+        converted++;
+        if (verbose)
+            cout << "  " << entry->d_name << " -> " << name << endl;
+    }
+    closedir(dir);
+    return converted;
+}
@@ -20,163 +20,461 @@
 
 #include "dem_parser/elevation_reader.h"
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+    #include <immintrin.h>
+#endif
+
 #define D_TO_R M_PI / 180.0f
 #define R_TO_D 180.0f / M_PI
 
-ElevationReader::ElevationReader(){
-    srtmFd = NULL;
+template <class Geometry>
+SrtmTileReader<Geometry>::SrtmTileReader(){
     srtmLat = 255; //default never valid
     srtmLon = 255;
     srtmTile = NULL;
-
+    nativeTile = NULL;
+    extension = "hgt";
+    required = true;
 }
 
-ElevationReader::ElevationReader(options_t* O){
-    Options = O;
-    srtmFd = NULL;
-    srtmLat = 255; //default never valid
+/** SrtmTileReader::SetFolder
+ * DESCRIPTION:
+ *      Sets where the tiles are read from.
+ * ARGUMENTS:
+ *      const std::string& folder
+ *          The folder containing the tiles.
+ *      const char* extension
+ *          "hgt" for SRTM tiles or "dem" for pre-decoded tiles.
+ *      bool required
+ *          If true, a missing tile is a fatal error. Otherwise GetElevation
+ *          returns false for points on missing tiles.
+ */
+template <class Geometry>
+void SrtmTileReader<Geometry>::SetFolder(const std::string& f, const char* ext, bool req){
+    folder = f;
+    extension = ext;
+    required = req;
+    srtmLat = 255;
     srtmLon = 255;
-    srtmTile = NULL;
-    strcpy(folder, Options->DEM_PARSER_SRTM_FOLDER.c_str());
 }
 
-ElevationReader::~ElevationReader(){
-    srtmClose();
+/** Returns the path of the tile with the given south west corner */
+template <class Geometry>
+std::string SrtmTileReader<Geometry>::TileFilename(int latDec, int lonDec){
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s/%c%02d%c%03d.%s", folder.c_str(), 
+				latDec>0?'N':'S', abs(latDec), 
+				lonDec>0?'E':'W', abs(lonDec), extension);
+    return filename;
 }
 
-/** Prepares corresponding file if not opened */
-void ElevationReader::LoadTileInMemory(int latDec, int lonDec){
+/** Fetches the corresponding tile from the shared tile cache if it is not the current one */
+template <class Geometry>
+bool SrtmTileReader<Geometry>::LoadTileInMemory(int latDec, int lonDec){
     if(srtmLat != latDec || srtmLon != lonDec) {
         srtmLat = latDec;
         srtmLon = lonDec;
         
-        if(srtmFd != NULL){
-            fclose(srtmFd);
-        }
-        
-        char filename[1024];
-        sprintf(filename, "%s/%c%02d%c%03d.hgt", folder, 
-					latDec>0?'N':'S', abs(latDec), 
-					lonDec>0?'E':'W', abs(lonDec));
-					
-        srtmFd = fopen(filename, "r");
-        
-        if(srtmFd == NULL) {
-            printf("Error opening %s\n",  filename);
-            exit(1);
-        }
-        
-#if !SRTMSLIM
-        if(srtmTile == NULL){
-            srtmTile = (unsigned char*) malloc(totalPx * totalPx * 2); //allocate only once
-
-        }
-        
-        //read the whole tile
-        fread(srtmTile, 1, (2 * totalPx * totalPx), srtmFd);
-#endif
+        tile = TileCache::Instance().Acquire(TileFilename(latDec, lonDec), latDec, totalPx, required);
+        srtmTile = tile ? tile->data : NULL;
+        nativeTile = (tile && tile->format == TileFormatNative) ? (const int16_t*)tile->data : NULL;
     }
-}
-
-void ElevationReader::srtmClose() {
-    if(srtmFd != NULL){
-        fclose(srtmFd);
-    }
-    
-#if !SRTMSLIM
-    if(srtmTile != NULL){
-        free(srtmTile);
-    }
-#endif
+    return srtmTile != NULL;
 }
 
 /** Pixel idx from left bottom corner (0-1200) */
-void ElevationReader::ReadHeightFromTile(int y, int x, int* height){
+template <class Geometry>
+void SrtmTileReader<Geometry>::ReadHeightFromTile(int y, int x, int* height){
     int row = (totalPx-1) - y;
     int col = x;
     int pos = (row * totalPx + col) * 2;
     
-#if SRTMSLIM
-    
-    //seek and read 2 bytes short
-    unsigned char buff[2];// = {0xFF, 0xFB}; //-5 (bigendian)
-    fseek(srtmFd, pos, SEEK_SET);
-    fread(&buff, 2, 1, srtmFd);
-    
-#else
-    
     //set correct buff pointer
-    unsigned char * buff = & srtmTile[pos];
-    
-#endif
+    const unsigned char * buff = & srtmTile[pos];
     
-    //solve endianity (using int16_t)
-    int16_t hgt = 0 | (buff[0] << 8) | (buff[1] << 0);
-    
-    if(hgt == -32768) {
-        hgt = prevHeight;
-    }
-    prevHeight = (int) hgt;
-    *height = (int) hgt;
+    //solve endianity (using int16_t). Voids were filled by the tile cache.
+    *height = (int16_t)((buff[0] << 8) | (buff[1] << 0));
 }       
 
-/** Returns interpolated height from four nearest points */
+/** SrtmTileReader::PyramidLevel
+ * DESCRIPTION:
+ *      Returns the coarsest pyramid level whose sample spacing does not
+ *      exceed a ground footprint. Level k has a spacing of 2^k samples.
+ * ARGUMENTS:
+ *      float footprint
+ *          The size of the area a point stands for in meters.
+ */
+template <class Geometry>
+int SrtmTileReader<Geometry>::PyramidLevel(float footprint){
+    // Sample spacing along a meridian.
+    const float spacing = secondsPerPx * 30.87f;
+    int level = 0;
+    while (level < ElevationReader::pyramidLevels && spacing * (2 << level) <= footprint)
+        level++;
+    return level;
+}
 
-/** ElevationReader::GetElevation
+/** SrtmTileReader::GetElevation
  * DESCRIPTION:
  *      Reads the elevation at a specific point on the earth.
  * ARGUMENTS:
  *      double lat, lon
  *          The lattitude and longitude of the point in degrees.
+ *      float* elevation
+ *          Pointer to the elevation. This will be overwritten.
+ *      float footprint
+ *          The size of the area the point stands for in meters, used to
+ *          choose the pyramid level. 0 reads the full resolution.
  * RETURNS:
- *      a float, representing the elevation.
+ *      false if the tile containing the point is not available.
  */
-float ElevationReader::GetElevation(float lat, float lon){
-    if (!Options->DEM_PARSER_DISABLE_ELEVATION) {
-        int latDec = (int)floor(lat);
-        int lonDec = (int)floor(lon);
+template <class Geometry>
+bool SrtmTileReader<Geometry>::GetElevation(float lat, float lon, float* elevation, float footprint){
+    return Sample(lat, lon, PyramidLevel(footprint), false, elevation);
+}
 
-        float secondsLat = (lat-latDec) * 60 * 60;
-        float secondsLon = (lon-lonDec) * 60 * 60;
-        
-        LoadTileInMemory(latDec, lonDec);
-        //X coresponds to x/y values,
-        //everything easter/norhter (< S) is rounded to X.
-        //
-        //  y   ^
-        //  3   |       |   S
-        //      +-------+-------
-        //  0   |   X   |
-        //      +-------+-------->
-        // (sec)    0        3   x  (lon)
-        
-        //both values are 0-1199 (1200 reserved for interpolating)
-        int y = secondsLat/secondsPerPx;
-        int x = secondsLon/secondsPerPx;
-        
-        //get norther and easter points
-        int height[4];
+/** SrtmTileReader::GetMaxElevation
+ * DESCRIPTION:
+ *      Reads the highest sample around a point, from the max reduction of
+ *      the pyramid level chosen for the footprint. Unlike GetElevation,
+ *      the result never underestimates the terrain, which makes it safe
+ *      for horizon tests. The max reduction of a tile is
+ *      built the first time it is read.
+ * ARGUMENTS:
+ *      See GetElevation.
+ * RETURNS:
+ *      false if the tile containing the point is not available.
+ */
+template <class Geometry>
+bool SrtmTileReader<Geometry>::GetMaxElevation(float lat, float lon, float* elevation, float footprint){
+    return Sample(lat, lon, PyramidLevel(footprint), true, elevation);
+}
+
+/** SrtmTileReader::Sample
+ * DESCRIPTION:
+ *      Reads the four samples around a point from a pyramid level, and
+ *      either interpolates them or returns the highest one. Levels that
+ *      were not built for the tile fall back to the finest one available.
+ * ARGUMENTS:
+ *      double lat, lon
+ *          The lattitude and longitude of the point in degrees.
+ *      int level
+ *          The pyramid level, 0 for the full resolution.
+ *      bool max
+ *          Return the highest of the four samples instead of interpolating.
+ *      float* elevation
+ *          Pointer to the elevation. This will be overwritten.
+ * RETURNS:
+ *      false if the tile containing the point is not available.
+ */
+template <class Geometry>
+bool SrtmTileReader<Geometry>::Sample(float lat, float lon, int level, bool max, float* elevation){
+    int latDec = (int)floor(lat);
+    int lonDec = (int)floor(lon);
+
+    float secondsLat = (lat-latDec) * 60 * 60;
+    float secondsLon = (lon-lonDec) * 60 * 60;
+    
+    if (!LoadTileInMemory(latDec, lonDec))
+        return false;
+    if (level > (int)tile->levels.size())
+        level = tile->levels.size();
+    if (max && level > 0)
+        TileCache::Instance().BuildMaxLevels(tile);
+    //X coresponds to x/y values,
+    //everything easter/norhter (< S) is rounded to X.
+    //
+    //  y   ^
+    //  3   |       |   S
+    //      +-------+-------
+    //  0   |   X   |
+    //      +-------+-------->
+    // (sec)    0        3   x  (lon)
+    
+    //both values are 0-(totalPx-2) (totalPx-1 reserved for interpolating)
+    int spp = secondsPerPx << level;
+    int y = secondsLat/spp;
+    int x = secondsLon/spp;
+    
+    //get norther and easter points
+    int height[4];
+    if (level > 0) {
+        const pyramid_level_t& l = tile->levels[level - 1];
+        const int16_t* south = (max ? l.max.data() : l.mean.data()) + ((l.totalPx-1) - y) * l.totalPx + x;
+        const int16_t* north = south - l.totalPx;
+        height[0] = north[0];
+        height[1] = north[1];
+        height[2] = south[0];
+        height[3] = south[1];
+    } else if (nativeTile != NULL) {
+        // Pre-decoded tiles need no byte swapping.
+        const int16_t* south = &nativeTile[((totalPx-1) - y) * totalPx + x];
+        const int16_t* north = south - totalPx;
+        height[0] = north[0];
+        height[1] = north[1];
+        height[2] = south[0];
+        height[3] = south[1];
+    } else {
         ReadHeightFromTile(y,   x, &height[2]);
         ReadHeightFromTile(y+1, x, &height[0]);
         ReadHeightFromTile(y,   x+1, &height[3]);
         ReadHeightFromTile(y+1, x+1, &height[1]);
+    }
 
-        //ratio where X lays
-        float dy = fmod(secondsLat, secondsPerPx) / secondsPerPx;
-        float dx = fmod(secondsLon, secondsPerPx) / secondsPerPx;
-        
-        // Bilinear interpolation
-        // h0------------h1
-        // |
-        // |--dx-- .
-        // |       |
-        // |      dy
-        // |       |
-        // h2------------h3   
-        return  height[0] * dy * (1 - dx) +
-                height[1] * dy * (dx) +
-                height[2] * (1 - dy) * (1 - dx) +
-                height[3] * (1 - dy) * dx;
+    if (max) {
+        *elevation = fmax(fmax(height[0], height[1]), fmax(height[2], height[3]));
+        return true;
+    }
+
+    //ratio where X lays
+    float dy = fmod(secondsLat, spp) / spp;
+    float dx = fmod(secondsLon, spp) / spp;
+    
+    // Bilinear interpolation
+    // h0------------h1
+    // |
+    // |--dx-- .
+    // |       |
+    // |      dy
+    // |       |
+    // h2------------h3   
+    *elevation = height[0] * dy * (1 - dx) +
+                 height[1] * dy * (dx) +
+                 height[2] * (1 - dy) * (1 - dx) +
+                 height[3] * (1 - dy) * dx;
+    return true;
+}
+
+/** SrtmTileReader::GetElevationBatch
+ * DESCRIPTION:
+ *      Reads the elevations of many points at once. Consecutive points
+ *      on the same tile are grouped into runs, and each run is
+ *      interpolated with SIMD gathers where the CPU supports them.
+ *      Points should be spatially coherent (e.g. a map row) for the runs
+ *      to be long.
+ * ARGUMENTS:
+ *      const float* lat, lon
+ *          The lattitudes and longitudes of the points in degrees.
+ *      float* out
+ *          The elevations. This will be overwritten.
+ *      size_t n
+ *          The number of points.
+ *      const float* footprint
+ *          The footprints of the points in meters, see GetElevation.
+ *          May be NULL to read the full resolution.
+ * RETURNS:
+ *      The number of points read. This is less than n if a point lies on
+ *      a tile that is not available, in which case it is the index of
+ *      that point.
+ */
+template <class Geometry>
+size_t SrtmTileReader<Geometry>::GetElevationBatch(const float* lat, const float* lon, float* out, size_t n, const float* footprint){
+    size_t i = 0;
+    while (i < n) {
+        int latDec = (int)floor(lat[i]);
+        int lonDec = (int)floor(lon[i]);
+        if (!LoadTileInMemory(latDec, lonDec))
+            return i;
+        int level = footprint ? PyramidLevel(footprint[i]) : 0;
+        size_t j = i + 1;
+        while (j < n && (int)floor(lat[j]) == latDec && (int)floor(lon[j]) == lonDec &&
+               (footprint == NULL || PyramidLevel(footprint[j]) == level))
+            j++;
+        InterpolateRun(lat + i, lon + i, out + i, j - i, latDec, lonDec, level);
+        i = j;
+    }
+    return n;
+}
+
+/** SrtmTileReader::InterpolateRun
+ * DESCRIPTION:
+ *      Interpolates a run of points that all lie on the current tile and
+ *      use the same pyramid level, with the same arithmetic as Sample.
+ *      Each 32-bit gather fetches a sample together with its eastern
+ *      neighbour.
+ */
+template <class Geometry>
+void SrtmTileReader<Geometry>::InterpolateRun(const float* lat, const float* lon, float* out, size_t n, int latDec, int lonDec, int level){
+    if (level > (int)tile->levels.size())
+        level = tile->levels.size();
+    // The tile or pyramid level to read, and its geometry.
+    const void* samples = srtmTile;
+    bool swapped = nativeTile == NULL;
+    int px = totalPx;
+    int spp = secondsPerPx << level;
+    if (level > 0) {
+        samples = tile->levels[level - 1].mean.data();
+        swapped = false;
+        px = tile->levels[level - 1].totalPx;
+    }
+    size_t i = 0;
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+    // The masked forms, over every lane and from zero, rather than the
+    // plain ones whose undefined pass-through GCC reports as uninitialised.
+    const __mmask16 allLanes = 0xFFFF;
+    const __m512 vLatDec = _mm512_set1_ps((float)latDec);
+    const __m512 vLonDec = _mm512_set1_ps((float)lonDec);
+    const __m512 v60 = _mm512_set1_ps(60.0f);
+    const __m512 vOne = _mm512_set1_ps(1.0f);
+    const __m512 vSpp = _mm512_set1_ps((float)spp);
+    const __m512i vTotalPx = _mm512_set1_epi32(px);
+    const __m512i vLastRow = _mm512_set1_epi32(px - 1);
+    // Swaps the bytes of each 16-bit sample.
+    const __m512i swap = _mm512_set_epi8(
+        14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1, 14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1,
+        14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1, 14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1);
+    for (; i + 16 <= n; i += 16) {
+        __m512 secondsLat = _mm512_mul_ps(_mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(lat + i), vLatDec), v60), v60);
+        __m512 secondsLon = _mm512_mul_ps(_mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(lon + i), vLonDec), v60), v60);
+        __m512i y = _mm512_maskz_cvttps_epi32(allLanes, _mm512_div_ps(secondsLat, vSpp));
+        __m512i x = _mm512_maskz_cvttps_epi32(allLanes, _mm512_div_ps(secondsLon, vSpp));
+        __m512 dy = _mm512_div_ps(_mm512_sub_ps(secondsLat, _mm512_mul_ps(_mm512_maskz_cvtepi32_ps(allLanes, y), vSpp)), vSpp);
+        __m512 dx = _mm512_div_ps(_mm512_sub_ps(secondsLon, _mm512_mul_ps(_mm512_maskz_cvtepi32_ps(allLanes, x), vSpp)), vSpp);
+
+        // Rows run from north to south.
+        __m512i south = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_sub_epi32(vLastRow, y), vTotalPx), x);
+        __m512i north = _mm512_sub_epi32(south, vTotalPx);
+        __m512i s = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), allLanes, south, samples, 2);
+        __m512i nn = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), allLanes, north, samples, 2);
+        if (swapped) {
+            s = _mm512_shuffle_epi8(s, swap);
+            nn = _mm512_shuffle_epi8(nn, swap);
+        }
+        __m512i h0 = _mm512_maskz_srai_epi32(allLanes, _mm512_maskz_slli_epi32(allLanes, nn, 16), 16);
+        __m512i h1 = _mm512_maskz_srai_epi32(allLanes, nn, 16);
+        __m512i h2 = _mm512_maskz_srai_epi32(allLanes, _mm512_maskz_slli_epi32(allLanes, s, 16), 16);
+        __m512i h3 = _mm512_maskz_srai_epi32(allLanes, s, 16);
+
+        __m512 ndx = _mm512_sub_ps(vOne, dx);
+        __m512 ndy = _mm512_sub_ps(vOne, dy);
+        __m512 r = _mm512_mul_ps(_mm512_mul_ps(_mm512_maskz_cvtepi32_ps(allLanes, h0), dy), ndx);
+        r = _mm512_add_ps(r, _mm512_mul_ps(_mm512_mul_ps(_mm512_maskz_cvtepi32_ps(allLanes, h1), dy), dx));
+        r = _mm512_add_ps(r, _mm512_mul_ps(_mm512_mul_ps(_mm512_maskz_cvtepi32_ps(allLanes, h2), ndy), ndx));
+        r = _mm512_add_ps(r, _mm512_mul_ps(_mm512_mul_ps(_mm512_maskz_cvtepi32_ps(allLanes, h3), ndy), dx));
+        _mm512_storeu_ps(out + i, r);
+    }
+#elif defined(__AVX2__)
+    const __m256 vLatDec = _mm256_set1_ps((float)latDec);
+    const __m256 vLonDec = _mm256_set1_ps((float)lonDec);
+    const __m256 v60 = _mm256_set1_ps(60.0f);
+    const __m256 vOne = _mm256_set1_ps(1.0f);
+    const __m256 vSpp = _mm256_set1_ps((float)spp);
+    const __m256i vTotalPx = _mm256_set1_epi32(px);
+    const __m256i vLastRow = _mm256_set1_epi32(px - 1);
+    // Swaps the bytes of each 16-bit sample.
+    const __m256i swap = _mm256_set_epi8(
+        14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1, 14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1);
+    for (; i + 8 <= n; i += 8) {
+        __m256 secondsLat = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(lat + i), vLatDec), v60), v60);
+        __m256 secondsLon = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(lon + i), vLonDec), v60), v60);
+        __m256i y = _mm256_cvttps_epi32(_mm256_div_ps(secondsLat, vSpp));
+        __m256i x = _mm256_cvttps_epi32(_mm256_div_ps(secondsLon, vSpp));
+        __m256 dy = _mm256_div_ps(_mm256_sub_ps(secondsLat, _mm256_mul_ps(_mm256_cvtepi32_ps(y), vSpp)), vSpp);
+        __m256 dx = _mm256_div_ps(_mm256_sub_ps(secondsLon, _mm256_mul_ps(_mm256_cvtepi32_ps(x), vSpp)), vSpp);
+
+        // Rows run from north to south.
+        __m256i south = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(vLastRow, y), vTotalPx), x);
+        __m256i north = _mm256_sub_epi32(south, vTotalPx);
+        __m256i s = _mm256_i32gather_epi32((const int*)samples, south, 2);
+        __m256i nn = _mm256_i32gather_epi32((const int*)samples, north, 2);
+        if (swapped) {
+            s = _mm256_shuffle_epi8(s, swap);
+            nn = _mm256_shuffle_epi8(nn, swap);
+        }
+        __m256i h0 = _mm256_srai_epi32(_mm256_slli_epi32(nn, 16), 16);
+        __m256i h1 = _mm256_srai_epi32(nn, 16);
+        __m256i h2 = _mm256_srai_epi32(_mm256_slli_epi32(s, 16), 16);
+        __m256i h3 = _mm256_srai_epi32(s, 16);
+
+        __m256 ndx = _mm256_sub_ps(vOne, dx);
+        __m256 ndy = _mm256_sub_ps(vOne, dy);
+        __m256 r = _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(h0), dy), ndx);
+        r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(h1), dy), dx));
+        r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(h2), ndy), ndx));
+        r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(h3), ndy), dx));
+        _mm256_storeu_ps(out + i, r);
+    }
+#else
+    (void)latDec;
+    (void)lonDec;
+    (void)samples;
+    (void)swapped;
+    (void)px;
+    (void)spp;
+#endif
+    for (; i < n; i++)
+        Sample(lat[i], lon[i], level, false, &out[i]);
+}
+
+/** SrtmTileReader::ListTiles
+ * DESCRIPTION:
+ *      Lists the tiles covering an area, from east to west.
+ * ARGUMENTS:
+ *      double latMin, latMax, lonMin, lonMax
+ *          The bounds of the area in degrees.
+ *      std::vector<TilePrefetcher::request_t>* tiles
+ *          The list to append the tiles to.
+ */
+template <class Geometry>
+void SrtmTileReader<Geometry>::ListTiles(double latMin, double latMax, double lonMin, double lonMax,
+                                         std::vector<TilePrefetcher::request_t>* tiles){
+    for (int lonDec = (int)floor(lonMax); lonDec >= (int)floor(lonMin); lonDec--)
+        for (int latDec = (int)floor(latMin); latDec <= (int)floor(latMax); latDec++) {
+            TilePrefetcher::request_t r;
+            r.filename = TileFilename(latDec, lonDec);
+            r.latDec = latDec;
+            r.totalPx = totalPx;
+            tiles->push_back(r);
+        }
+}
+
+template class SrtmTileReader<Srtm1>;
+template class SrtmTileReader<Srtm3>;
+
+ElevationReader::ElevationReader(){
+    Options = NULL;
+    srtm1Enabled = false;
+}
+
+ElevationReader::ElevationReader(options_t* O){
+    Options = O;
+    // Prefer the pre-decoded tiles if they have been generated.
+    if (Options->DEM_PARSER_DEM_CACHE_FOLDER != "") {
+        srtm3.SetFolder(Options->DEM_PARSER_DEM_CACHE_FOLDER, "dem", true);
+        srtm1.SetFolder(Options->DEM_PARSER_DEM_CACHE_FOLDER + "/srtm1", "dem", false);
+    } else {
+        srtm3.SetFolder(Options->DEM_PARSER_SRTM_FOLDER, "hgt", true);
+        srtm1.SetFolder(Options->DEM_PARSER_SRTM1_FOLDER, "hgt", false);
+    }
+    srtm1Enabled = Options->DEM_PARSER_SRTM1_FOLDER != "" && Options->DEM_PARSER_SRTM1_RANGE > 0;
+}
+
+ElevationReader::~ElevationReader(){
+}
+
+/** ElevationReader::GetElevation
+ * DESCRIPTION:
+ *      Reads the elevation at a specific point on the earth.
+ * ARGUMENTS:
+ *      double lat, lon
+ *          The lattitude and longitude of the point in degrees.
+ *      float range
+ *          The distance of the point from the radar in meters. 1 arc second
+ *          tiles are used if it is within DEM_PARSER_SRTM1_RANGE.
+ *      float footprint
+ *          The size of the area the point stands for in meters, used to
+ *          choose the pyramid level. 0 reads the full resolution.
+ * RETURNS:
+ *      a float, representing the elevation.
+ */
+float ElevationReader::GetElevation(float lat, float lon, float range, float footprint){
+    if (!Options->DEM_PARSER_DISABLE_ELEVATION) {
+        float elevation;
+        if (srtm1Enabled && range <= Options->DEM_PARSER_SRTM1_RANGE && 
+            srtm1.GetElevation(lat, lon, &elevation, footprint))
+            return elevation;
+        srtm3.GetElevation(lat, lon, &elevation, footprint);
+        return elevation;
     } else {
         double tx = 3.141592/180.0;
         double d = GetDistance(lat*tx, lon*tx, 38.52*tx, -98.10*tx);
@@ -185,6 +483,109 @@ float ElevationReader::GetElevation(float lat, float lon){
     }
 }
 
+/** ElevationReader::GetMaxElevation
+ * DESCRIPTION:
+ *      Reads the highest terrain around a point, from the max reduction of
+ *      the pyramid. Use it where underestimating the terrain would let a
+ *      ray through, e.g. horizon tests.
+ * ARGUMENTS:
+ *      See GetElevation.
+ * RETURNS:
+ *      a float, representing the elevation.
+ */
+float ElevationReader::GetMaxElevation(float lat, float lon, float range, float footprint){
+    if (Options->DEM_PARSER_DISABLE_ELEVATION)
+        return 1;
+    float elevation;
+    if (srtm1Enabled && range <= Options->DEM_PARSER_SRTM1_RANGE && 
+        srtm1.GetMaxElevation(lat, lon, &elevation, footprint))
+        return elevation;
+    srtm3.GetMaxElevation(lat, lon, &elevation, footprint);
+    return elevation;
+}
+
+/** ElevationReader::GetElevationBatch
+ * DESCRIPTION:
+ *      Reads the elevations of many points at once, e.g. a map row.
+ * ARGUMENTS:
+ *      const float* lat, lon
+ *          The lattitudes and longitudes of the points in degrees.
+ *      float* out
+ *          The elevations. This will be overwritten.
+ *      size_t n
+ *          The number of points.
+ *      const float* range
+ *          The distances of the points from the radar in meters, used to
+ *          choose the tile resolution as in GetElevation. May be NULL.
+ *      const float* footprint
+ *          The footprints of the points in meters, used to choose the
+ *          pyramid level as in GetElevation. May be NULL.
+ */
+void ElevationReader::GetElevationBatch(const float* lat, const float* lon, float* out, size_t n, 
+                                        const float* range, const float* footprint){
+    if (Options->DEM_PARSER_DISABLE_ELEVATION) {
+        for (size_t i = 0; i < n; i++)
+            out[i] = 1;
+        return;
+    }
+    if (!srtm1Enabled || range == NULL) {
+        srtm3.GetElevationBatch(lat, lon, out, n, footprint);
+        return;
+    }
+    size_t i = 0;
+    while (i < n) {
+        // Find the run of points that use the same resolution.
+        bool fine = range[i] <= Options->DEM_PARSER_SRTM1_RANGE;
+        size_t j = i + 1;
+        while (j < n && (range[j] <= Options->DEM_PARSER_SRTM1_RANGE) == fine)
+            j++;
+        const float* f = footprint ? footprint + i : NULL;
+        if (!fine) {
+            srtm3.GetElevationBatch(lat + i, lon + i, out + i, j - i, f);
+            i = j;
+            continue;
+        }
+        i += srtm1.GetElevationBatch(lat + i, lon + i, out + i, j - i, f);
+        // A 1 arc second tile is missing, use a 3 arc second one for this point.
+        if (i < j) {
+            srtm3.GetElevation(lat[i], lon[i], &out[i], footprint ? footprint[i] : 0);
+            i++;
+        }
+    }
+}
+
+/** ElevationReader::ListTiles
+ * DESCRIPTION:
+ *      Lists the tiles GetElevation will read for points in an area.
+ * ARGUMENTS:
+ *      double latMin, latMax, lonMin, lonMax
+ *          The bounds of the area in degrees.
+ *      float range
+ *          The smallest distance from the radar of the points in the area,
+ *          used to choose the tile resolution as in GetElevation.
+ *      std::vector<TilePrefetcher::request_t>* tiles
+ *          The list to append the tiles to.
+ */
+void ElevationReader::ListTiles(double latMin, double latMax, double lonMin, double lonMax, float range,
+                                std::vector<TilePrefetcher::request_t>* tiles){
+    if (Options->DEM_PARSER_DISABLE_ELEVATION)
+        return;
+    if (srtm1Enabled && range <= Options->DEM_PARSER_SRTM1_RANGE)
+        srtm1.ListTiles(latMin, latMax, lonMin, lonMax, tiles);
+    else
+        srtm3.ListTiles(latMin, latMax, lonMin, lonMax, tiles);
+}
+
+/** ElevationReader::Covers
+ * DESCRIPTION:
+ *      SRTM tiles are looked up by name, so every area is covered. Missing
+ *      tiles are reported when they are read.
+ */
+bool ElevationReader::Covers(double latMin, double latMax, double lonMin, double lonMax){
+    (void)latMin; (void)latMax; (void)lonMin; (void)lonMax;
+    return true;
+}
+
 /** ElevationReader::GetDistance
  * DESCRIPTION:
  *      Gets the distance along the Earth's surface between two points
@@ -283,7 +684,7 @@ void ElevationReader::WalkDistance(double lat, double lon, double az, double s,
     {
         sigmaM = 2*sigma1 + SIGMA[0]; //ACTUALLY TWO SIGMA-M
         d_sigma = B*sin(SIGMA[0])*(cos(sigmaM)+B/4*(cos(SIGMA[0])*
-                    (-1+2*pow(cos(2*SIGMA[0]),2)) -B/6*cos(sigmaM)*
+                    (-1+2*pow(cos(sigmaM),2)) -B/6*cos(sigmaM)*
                     (-3+4*pow(sin(SIGMA[0]),2))*(-3+4*pow(cos(sigmaM),2))));
 
         SIGMA[1] = SIGMA[0];
@@ -300,6 +701,6 @@ void ElevationReader::WalkDistance(double lat, double lon, double az, double s,
 
 	d_w = atan2((sin(SIGMA[1])*sin(az)),(cos(beta1)*cos(SIGMA[1]) - sin(beta1)* sin(SIGMA[1])*cos(az)));
 	C 	= f/16*pow(cos(Aeq),2)*(4+f*(4-3*pow(cos(Aeq),2)));
-	d_lon = d_w - (1-C)*f*sin(az)*(SIGMA[1] + C*sin(SIGMA[1])*(cos(sigmaM)+C*cos(SIGMA[1])*(-1+2*pow(cos(sigmaM),2))));
+	d_lon = d_w - (1-C)*f*sin(Aeq)*(SIGMA[1] + C*sin(SIGMA[1])*(cos(sigmaM)+C*cos(SIGMA[1])*(-1+2*pow(cos(sigmaM),2))));
 	*lon_out = (lon + d_lon) * R_TO_D;
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "dem_parser/dem_parser.h"
+#include <math.h>
+#include <algorithm>
+#include <iostream>
+
+using std::cout;
+using std::endl;
+
+// Cells per tile of a ray. The fields of a tile and the samples behind
+// them stay within a few kilobytes, in the L1 and L2 caches.
+static const int rayTileCells = 256;
+
+RayTile::RayTile() {
+    ray = first = n = 0;
+    horizon = 0;
+    before = 0;
+}
+
+RayTile::~RayTile() {
+}
+
+/** ElevationMap::beginFused
+ * DESCRIPTION:
+ *      Sets the map up to be produced a tile of a ray at a time by
+ *      nextRayTile, in place of populateMap. No map is allocated.
+ */
+void ElevationMap::beginFused() {
+    setupMap();
+    if (Options->PROG_VERBOSE) {
+        cout << "Fused mode: rays in tiles of " << rayTileCells << " cells." << endl;
+        if (Options->DEM_PARSER_EXPORT_ELEVATION_MAP || Options->DEM_PARSER_EXPORT_AZIMUTH_ANGLE
+            || Options->DEM_PARSER_EXPORT_ELEVATION_ANGLE || Options->DEM_PARSER_EXPORT_GRAZING_ANGLE
+            || Options->DEM_PARSER_EXPORT_SHADOWING)
+            cout << "Warning: the map is not exported in the fused mode." << endl;
+    }
+}
+
+/** ElevationMap::endFused
+ * DESCRIPTION:
+ *      Releases the tiles once every ray has been produced.
+ */
+void ElevationMap::endFused() {
+    finishMap();
+}
+
+/** ElevationMap::beginRay
+ * DESCRIPTION:
+ *      Starts a ray of the polar grid, to be read with nextRayTile.
+ * ARGUMENTS:
+ *      RayTile* tile
+ *          The tile of the calling thread.
+ *      int ray
+ *          The ray, as a row of the polar grid.
+ */
+void ElevationMap::beginRay(RayTile* tile, int ray) {
+    if (tile->r.empty()) {
+        tile->kernel = kernel;
+        size_t room = rayTileCells + 1;
+        tile->r.resize(room);
+        tile->az.resize(room);
+        tile->el.resize(room);
+        tile->grazing.resize(room);
+        tile->shadowed.resize(room);
+        tile->lat.resize(room);
+        tile->lon.resize(room);
+        tile->range.resize(room);
+        tile->height.resize(room);
+        tile->footprint.resize(room);
+    }
+    tile->ray = ray;
+    tile->first = 0;
+    tile->n = 0;
+    tile->horizon = 0;
+    tile->geodesic.Init(originLat, originLon, 360.0 * ray / mapSizeX);
+}
+
+/** ElevationMap::nextRayTile
+ * DESCRIPTION:
+ *      Produces the next tile of a ray: samples the elevations, which
+ *      include one cell past the tile for the slope at its end, then
+ *      calculates the spherical coordinates, the shadowing and the
+ *      grazing angles of its cells. The results are those of the polar
+ *      map, see populatePartial, calculateShadowingAlongRay and
+ *      populateGrazingAnglePolar: only the elevation of the last cell of
+ *      the previous tile and the horizon are carried along the ray.
+ * ARGUMENTS:
+ *      RayTile* tile
+ *          The tile, started with beginRay.
+ * RETURNS:
+ *      bool
+ *          False once the whole ray has been produced.
+ */
+bool ElevationMap::nextRayTile(RayTile* tile) {
+    int j0 = tile->first + tile->n;
+    if (j0 >= mapSizeY)
+        return false;
+    int n = std::min(rayTileCells, mapSizeY - j0);
+    int sampled = std::min(n + 1, mapSizeY - j0);
+    float rangeBin = Options->SIMULATOR_WAVE_SPEED * Options->SIMULATOR_RANGE_BIN_PERIOD / 2;
+    float azimuthBin = 2 * M_PI / Options->SIMULATOR_AZIMUTH_ANGLE_COUNT;
+    float* height = tile->height.data();
+    for (int k = 0; k < sampled; k++) {
+        tile->range[k] = (j0 + k + 0.5) * deltaDistance;
+        tile->geodesic.Point(tile->range[k], &tile->lat[k], &tile->lon[k]);
+        tile->footprint[k] = fmax(deltaDistance, fmin(rangeBin, tile->range[k] * azimuthBin));
+    }
+    reader()->GetElevationBatch(tile->lat.data(), tile->lon.data(), height, sampled, tile->range.data(),
+                                 Options->DEM_PARSER_PYRAMID ? tile->footprint.data() : NULL);
+    tile->kernel.Cells(tile->lat.data(), tile->lon.data(), height, n,
+                       tile->r.data(), tile->az.data(), tile->el.data());
+
+    bool shadowing = Options->SIMULATOR_SHADOWING_ENABLED;
+    for (int k = 0; k < n; k++) {
+        int j = j0 + k;
+        float el = tile->el[k];
+        // Derivative with range, one sided at both ends of the ray.
+        int near = j > 0 ? j - 1 : j;
+        int far = j < mapSizeY - 1 ? j + 1 : j;
+        float hNear = near == j ? height[k] : k > 0 ? height[k - 1] : tile->before;
+        float hFar = far == j ? height[k] : height[k + 1];
+        double slope = far > near ? (hFar - hNear) / ((far - near) * deltaDistance) : 0;
+        tile->grazing[k] = atan(slope) - el;
+
+        tile->shadowed[k] = 0;
+        if (!shadowing)
+            continue;
+        if (j == 0)
+            tile->horizon = el;
+        else {
+            if ((tile->horizon - 5 * 3.141592 / 180.0) > el)
+                tile->shadowed[k] = 1;
+            if (el > tile->horizon)
+                tile->horizon = el;
+        }
+    }
+    tile->before = height[n - 1];
+    tile->first = j0;
+    tile->n = n;
+    return true;
+}
@@ -0,0 +1,177 @@
+#include <math.h>
+
+#include "dem_parser/geodesic_grid.h"
+#include "dem_parser/elevation_reader.h"
+
+// Third flattening of the ellipsoid, and the radius of the rectifying
+// sphere, A = a / (1 + n) * (1 + n^2/4 + n^4/64).
+static const double n = (ElevationReader::a - ElevationReader::b) / (ElevationReader::a + ElevationReader::b);
+static const double n2 = n * n;
+static const double rectifyingRadius = ElevationReader::a / (1 + n) * (1 + n2 / 4 + n2 * n2 / 64);
+
+/** GeodesicGrid::Build
+ * DESCRIPTION:
+ *      Solves the east/west walk of every column of the map.
+ * ARGUMENTS:
+ *      double originLat, originLon
+ *          The origin of the map in degrees.
+ *      int originX, originY
+ *          The cell of the origin.
+ *      int sizeX
+ *          The number of columns.
+ *      double delta
+ *          The distance between cells in meters.
+ */
+void GeodesicGrid::Build(double originLat, double originLon, int originX, int originY, int sizeX, double delta) {
+    this->originY = originY;
+    this->delta = delta;
+    columnLat.resize(sizeX);
+    columnLon.resize(sizeX);
+    columnArc.resize(sizeX);
+    for (int x = 0; x < sizeX; x++) {
+        double lat = originLat;
+        double lon = originLon;
+        if (x != originX)
+            ElevationReader::WalkDistance(  originLat,
+                                            originLon,
+                                            x < originX ? 90 : 270,
+                                            fabs(x - originX) * delta,
+                                            &lat,
+                                            &lon );
+        columnLat[x] = lat;
+        columnLon[x] = lon;
+        columnArc[x] = MeridianArc(lat * M_PI / 180.0);
+    }
+}
+
+/** GeodesicGrid::LatLon
+ * DESCRIPTION:
+ *      Returns the latitude and longitude of a cell.
+ * ARGUMENTS:
+ *      int x, y
+ *          The cell. x must be within the columns given to Build.
+ *      float* lat, lon
+ *          Pointers to the latitude and longitude in degrees. These will
+ *          be overwritten.
+ */
+void GeodesicGrid::LatLon(int x, int y, float* lat, float* lon) const {
+    if (y == originY) {
+        *lat = (float)columnLat[x];
+    } else {
+        double arc = columnArc[x] + (y - originY) * delta;
+        *lat = (float)(MeridianLatitude(arc) * 180.0 / M_PI);
+    }
+    *lon = (float)columnLon[x];
+}
+
+/** GeodesicGrid::MeridianArc
+ * DESCRIPTION:
+ *      Returns the distance along a meridian from the equator to a
+ *      latitude, in meters: the rectifying latitude times the radius of
+ *      the rectifying sphere.
+ * ARGUMENTS:
+ *      double lat
+ *          The latitude in radians.
+ */
+double GeodesicGrid::MeridianArc(double lat) {
+    const double n3 = n2 * n, n4 = n2 * n2;
+    return rectifyingRadius * ( lat
+                                - (3 * n / 2 - 9 * n3 / 16) * sin(2 * lat)
+                                + (15 * n2 / 16 - 15 * n4 / 32) * sin(4 * lat)
+                                - (35 * n3 / 48) * sin(6 * lat)
+                                + (315 * n4 / 512) * sin(8 * lat) );
+}
+
+/** GeodesicGrid::MeridianLatitude
+ * DESCRIPTION:
+ *      Inverse of MeridianArc: returns the latitude, in radians, at a
+ *      distance along a meridian from the equator. The multiple angle
+ *      sines are built from one sin/cos pair.
+ * ARGUMENTS:
+ *      double arc
+ *          The distance in meters, negative south of the equator.
+ */
+double GeodesicGrid::MeridianLatitude(double arc) {
+    const double n3 = n2 * n, n4 = n2 * n2;
+    double mu = arc / rectifyingRadius;
+    double s2 = sin(2 * mu);
+    double c2 = cos(2 * mu);
+    // sin(2k mu) = 2 cos(2 mu) sin(2(k-1) mu) - sin(2(k-2) mu)
+    double s4 = 2 * c2 * s2;
+    double s6 = 2 * c2 * s4 - s2;
+    double s8 = 2 * c2 * s6 - s4;
+    return mu + (3 * n / 2 - 27 * n3 / 32) * s2
+              + (21 * n2 / 16 - 55 * n4 / 32) * s4
+              + (151 * n3 / 96) * s6
+              + (1097 * n4 / 512) * s8;
+}
+
+/** GeodesicRay::Init
+ * DESCRIPTION:
+ *      Solves the terms of a ray that do not depend on the distance.
+ * ARGUMENTS:
+ *      double originLat, originLon
+ *          The origin of the ray in degrees.
+ *      double azimuth
+ *          The initial bearing of the ray in degrees, clockwise from
+ *          north.
+ */
+void GeodesicRay::Init(double originLat, double originLon, double azimuth) {
+    const double a = ElevationReader::a, b = ElevationReader::b;
+    const double f = (a - b) / a;
+    double lat = originLat * M_PI / 180.0;
+    double az = azimuth * M_PI / 180.0;
+    lon0 = originLon * M_PI / 180.0;
+    sinAz = sin(az);
+    cosAz = cos(az);
+    double beta1 = atan((1 - f) * tan(lat));
+    sinBeta1 = sin(beta1);
+    cosBeta1 = cos(beta1);
+    sinAeq = cosBeta1 * sinAz;
+    cos2Aeq = 1 - sinAeq * sinAeq;
+    double u2 = cos2Aeq * (a * a - b * b) / (b * b);
+    sigma1 = atan2(tan(beta1), cosAz);
+    A = 1 + u2 / 16384 * (4096 + u2 * (-768 + u2 * (320 - 175 * u2)));
+    B = u2 / 1024 * (256 + u2 * (-128 + u2 * (74 - 47 * u2)));
+    C = f / 16 * cos2Aeq * (4 + f * (4 - 3 * cos2Aeq));
+    dSigma = 0;
+}
+
+/** GeodesicRay::Point
+ * DESCRIPTION:
+ *      Returns the point at a distance along the ray.
+ * ARGUMENTS:
+ *      double s
+ *          The distance from the origin in meters.
+ *      float* lat, lon
+ *          Pointers to the latitude and longitude in degrees. These will
+ *          be overwritten.
+ */
+void GeodesicRay::Point(double s, float* lat, float* lon) {
+    const double a = ElevationReader::a, b = ElevationReader::b;
+    const double f = (a - b) / a;
+    double base = s / (b * A);
+    double sigma = base + dSigma;
+    double twoSigmaM = 0;
+    for (int i = 0; i < 10; i++) {
+        twoSigmaM = 2 * sigma1 + sigma;
+        double c2m = cos(twoSigmaM);
+        double sinS = sin(sigma), cosS = cos(sigma);
+        dSigma = B * sinS * (c2m + B / 4 * (cosS * (-1 + 2 * c2m * c2m)
+                 - B / 6 * c2m * (-3 + 4 * sinS * sinS) * (-3 + 4 * c2m * c2m)));
+        double next = base + dSigma;
+        bool done = fabs(next - sigma) < 1e-12;
+        sigma = next;
+        if (done)
+            break;
+    }
+    double sinS = sin(sigma), cosS = cos(sigma);
+    double c2m = cos(twoSigmaM);
+    double x = sinBeta1 * sinS - cosBeta1 * cosS * cosAz;
+    double phi = atan2(sinBeta1 * cosS + cosBeta1 * sinS * cosAz,
+                       (1 - f) * sqrt(sinAeq * sinAeq + x * x));
+    double w = atan2(sinS * sinAz, cosBeta1 * cosS - sinBeta1 * sinS * cosAz);
+    double dLon = w - (1 - C) * f * sinAeq * (sigma + C * sinS * (c2m + C * cosS * (-1 + 2 * c2m * c2m)));
+    *lat = (float)(phi * 180.0 / M_PI);
+    *lon = (float)((lon0 + dLon) * 180.0 / M_PI);
+}
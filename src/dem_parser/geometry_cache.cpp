@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#if defined(__unix__) || defined(__APPLE__)
+    #define GEOMETRY_CACHE_MMAP 1
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "dem_parser/geometry_cache.h"
+#include "dem_parser/map_arena.h"
+
+GeometryCache::GeometryCache() {
+    base = NULL;
+    length = 0;
+    writable = false;
+    header = NULL;
+}
+
+GeometryCache::~GeometryCache() {
+    Close();
+}
+
+/** GeometryCache::Filename
+ * DESCRIPTION:
+ *      Returns the path of the .geom file for a key.
+ */
+std::string GeometryCache::Filename(const std::string& folder, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.geom", (unsigned long long)key);
+    return folder + "/" + name;
+}
+
+/** GeometryCache::PlaneBytes
+ * DESCRIPTION:
+ *      Returns the size of a plane of a file, before padding.
+ * ARGUMENTS:
+ *      const geometry_cache_header_t& layout
+ *          The header of the file.
+ *      Plane_t p
+ *          The plane. PlaneCount gives the size of the whole file.
+ */
+size_t GeometryCache::PlaneBytes(const geometry_cache_header_t& layout, Plane_t p) {
+    size_t fieldBytes = layout.compact ? sizeof(uint16_t) : sizeof(float);
+    switch (p) {
+        case PlaneShadowed:     return layout.cells * sizeof(uint8_t);
+        case PlaneHeights:      return (size_t)layout.sizeX * layout.stride * sizeof(float);
+        case PlaneCount:        return offset(layout, PlaneCount);
+        default:                return layout.cells * fieldBytes;
+    }
+}
+
+/** GeometryCache::offset
+ * DESCRIPTION:
+ *      Returns the offset of a plane in a file.
+ */
+size_t GeometryCache::offset(const geometry_cache_header_t& layout, int p) {
+    size_t at = sizeof(geometry_cache_header_t);
+    for (int k = 0; k < p; k++)
+        at += MapArena::Padded(PlaneBytes(layout, (Plane_t)k));
+    return at;
+}
+
+/** GeometryCache::Open
+ * DESCRIPTION:
+ *      Maps the .geom file for a key, if it exists and is complete.
+ * ARGUMENTS:
+ *      const std::string& folder
+ *          The folder holding the .geom files.
+ *      uint64_t key
+ *          The key of the planes.
+ *      int x, y
+ *          The size of the map in cells.
+ * RETURNS:
+ *      true if the planes were found.
+ */
+bool GeometryCache::Open(const std::string& folder, uint64_t key, int x, int y) {
+    Close();
+#ifdef GEOMETRY_CACHE_MMAP
+    std::string filename = Filename(folder, key);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    geometry_cache_header_t h;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        memcmp(h.magic, GEOMETRY_CACHE_MAGIC, 4) != 0 || h.version != GEOMETRY_CACHE_VERSION ||
+        h.key != key || h.sizeX != x || h.sizeY != y ||
+        (size_t)st.st_size != PlaneBytes(h, PlaneCount)) {
+        close(fd);
+        return false;
+    }
+    // Private and writable, so that the map can still be modified
+    // without touching the file.
+    void* mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+    base = (unsigned char*)mapping;
+    length = st.st_size;
+    writable = false;
+    header = (geometry_cache_header_t*)mapping;
+    path = filename;
+    return true;
+#else
+    (void)folder; (void)key; (void)x; (void)y;
+    return false;
+#endif
+}
+
+/** GeometryCache::Create
+ * DESCRIPTION:
+ *      Creates and maps a temporary .geom file to be filled in. The file
+ *      only becomes visible to other runs once Commit() is called.
+ * ARGUMENTS:
+ *      const std::string& folder
+ *          The folder holding the .geom files. It is created if
+ *          necessary.
+ *      const geometry_cache_header_t& layout
+ *          The key and the layout of the planes. The magic and version
+ *          are set here.
+ * RETURNS:
+ *      true if the file could be created.
+ */
+bool GeometryCache::Create(const std::string& folder, const geometry_cache_header_t& layout) {
+    Close();
+#ifdef GEOMETRY_CACHE_MMAP
+    mkdir(folder.c_str(), 0755);
+    std::string filename = Filename(folder, layout.key);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+    std::string tmp = filename + suffix;
+
+    size_t bytes = PlaneBytes(layout, PlaneCount);
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, bytes) != 0) {
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    void* mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    base = (unsigned char*)mapping;
+    length = bytes;
+    writable = true;
+    header = (geometry_cache_header_t*)mapping;
+    *header = layout;
+    memset(header->magic, 0, 4);
+    header->version = GEOMETRY_CACHE_VERSION;
+    path = filename;
+    tmpPath = tmp;
+    return true;
+#else
+    (void)folder; (void)layout;
+    return false;
+#endif
+}
+
+/** GeometryCache::Commit
+ * DESCRIPTION:
+ *      Marks a file created by Create() as complete, moves it into place
+ *      and unmaps it.
+ * RETURNS:
+ *      true if the planes were saved.
+ */
+bool GeometryCache::Commit() {
+#ifdef GEOMETRY_CACHE_MMAP
+    if (!writable)
+        return false;
+    memcpy(header->magic, GEOMETRY_CACHE_MAGIC, 4);
+    writable = false;
+    bool saved = rename(tmpPath.c_str(), path.c_str()) == 0;
+    if (!saved)
+        unlink(tmpPath.c_str());
+    Close();
+    return saved;
+#else
+    return false;
+#endif
+}
+
+/** GeometryCache::Close
+ * DESCRIPTION:
+ *      Unmaps the file. A file that was created but not committed is
+ *      deleted.
+ */
+void GeometryCache::Close() {
+#ifdef GEOMETRY_CACHE_MMAP
+    if (base == NULL)
+        return;
+    munmap(base, length);
+    if (writable)
+        unlink(tmpPath.c_str());
+#endif
+    base = NULL;
+    length = 0;
+    header = NULL;
+    writable = false;
+}
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define MAP_ARENA_MMAP 1
+    #include <sys/mman.h>
+    #include <unistd.h>
+#elif defined(_WIN32)
+    #include <malloc.h>
+#endif
+
+#include "dem_parser/map_arena.h"
+#include "numa_topology.h"
+
+using std::cout;
+using std::endl;
+
+// Huge pages are 2 MB on x86-64 and most arm64 kernels. Mappings that use
+// them must be a whole number of pages.
+static const size_t hugePageSize = 2 * 1024 * 1024;
+
+MapArena::MapArena() {
+    base = NULL;
+    length = 0;
+    used = 0;
+    backing = BackingNone;
+}
+
+MapArena::~MapArena() {
+    Release();
+}
+
+/** MapArena::Allocate
+ * DESCRIPTION:
+ *      Reserves the arena, releasing any previous one. Nothing is written
+ *      to it, so the pages are backed by the threads that first fill
+ *      them.
+ * ARGUMENTS:
+ *      size_t bytes
+ *          The size of the arena: the sum of the Padded sizes of its
+ *          blocks.
+ *      bool hugePages
+ *          Back the arena with huge pages where possible.
+ */
+void MapArena::Allocate(size_t bytes, bool hugePages) {
+    Release();
+    length = bytes;
+#ifdef MAP_ARENA_MMAP
+    void* mapping = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugePages) {
+        size_t rounded = (bytes + hugePageSize - 1) & ~(hugePageSize - 1);
+        mapping = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mapping != MAP_FAILED) {
+            length = rounded;
+            backing = BackingHuge;
+        }
+    }
+#endif
+    if (mapping == MAP_FAILED) {
+        mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        backing = BackingPages;
+#ifdef MADV_HUGEPAGE
+        // No reserved huge pages: let the kernel promote the arena instead.
+        if (mapping != MAP_FAILED && hugePages && madvise(mapping, length, MADV_HUGEPAGE) == 0)
+            backing = BackingTransparent;
+#endif
+    }
+    base = mapping == MAP_FAILED ? NULL : (char*)mapping;
+#else
+    (void)hugePages;
+    void* block = NULL;
+#ifdef _WIN32
+    block = _aligned_malloc(length, 64);
+#else
+    if (posix_memalign(&block, 64, length) != 0)
+        block = NULL;
+#endif
+    base = (char*)block;
+    backing = BackingHeap;
+#endif
+    if (base == NULL) {
+        cout << "Error: could not allocate " << bytes << " bytes for the map." << endl;
+        exit(1);
+    }
+    used = 0;
+}
+
+/** MapArena::Release
+ * DESCRIPTION:
+ *      Frees the arena. Every block carved from it becomes invalid.
+ */
+void MapArena::Release() {
+    if (base == NULL)
+        return;
+#ifdef MAP_ARENA_MMAP
+    munmap(base, length);
+#elif defined(_WIN32)
+    _aligned_free(base);
+#else
+    free(base);
+#endif
+    base = NULL;
+    length = 0;
+    used = 0;
+    backing = BackingNone;
+    blockOffsets.clear();
+    blockSizes.clear();
+}
+
+/** MapArena::Carve
+ * DESCRIPTION:
+ *      Returns the next block of the arena. Exits if the arena is too
+ *      small, which is a sizing error of the caller.
+ * ARGUMENTS:
+ *      size_t bytes
+ *          The size of the block.
+ */
+void* MapArena::Carve(size_t bytes) {
+    size_t padded = Padded(bytes);
+    if (base == NULL || used + padded > length) {
+        cout << "Error: the map arena is too small." << endl;
+        exit(1);
+    }
+    void* block = base + used;
+    blockOffsets.push_back(used);
+    blockSizes.push_back(bytes);
+    used += padded;
+    return block;
+}
+
+/** MapArena::Spread
+ * DESCRIPTION:
+ *      Gives each block a preferred node per stripe. The blocks are the
+ *      planes of the map, made of rows of equal size, so a stripe is a
+ *      group of rows. Stripes are cut on page boundaries, and a page
+ *      shared by two stripes goes to the first.
+ * ARGUMENTS:
+ *      const std::vector<double>& starts
+ *          The start of the stripe of each node, as a fraction of the
+ *          rows, from 0 and increasing. One node leaves the arena as it
+ *          is.
+ */
+void MapArena::Spread(const std::vector<double>& starts) {
+#ifdef MAP_ARENA_MMAP
+    int nodes = starts.size();
+    if (nodes < 2 || base == NULL)
+        return;
+    size_t page = backing == BackingHuge ? hugePageSize : (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t b = 0; b < blockOffsets.size(); b++) {
+        size_t start = blockOffsets[b], size = blockSizes[b];
+        size_t from = start & ~(page - 1);
+        for (int k = 0; k < nodes; k++) {
+            size_t to = k == nodes - 1 ? start + size : (start + (size_t)(size * starts[k + 1])) & ~(page - 1);
+            if (to > from && !NumaTopology::Bind(base + from, to - from, k)) {
+                cout << "Warning: could not place the map on NUMA node " << k << "." << endl;
+                return;
+            }
+            from = std::max(from, to);
+        }
+    }
+#else
+    (void)starts;
+#endif
+}
+
+/** MapArena::Interleave
+ * DESCRIPTION:
+ *      Spreads the pages of a block round-robin over every node, in place
+ *      of Spread, for a plane whose writers do not follow its rows.
+ * ARGUMENTS:
+ *      const void* block
+ *          The block, as returned by Carve.
+ */
+void MapArena::Interleave(const void* block) {
+#ifdef MAP_ARENA_MMAP
+    if (base == NULL || NumaTopology::Instance().Nodes() < 2)
+        return;
+    size_t page = backing == BackingHuge ? hugePageSize : (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t b = 0; b < blockOffsets.size(); b++) {
+        if (base + blockOffsets[b] != block)
+            continue;
+        // Pages shared with the neighbouring blocks keep their stripe.
+        size_t from = (blockOffsets[b] + page - 1) & ~(page - 1);
+        size_t to = (blockOffsets[b] + blockSizes[b]) & ~(page - 1);
+        if (to > from && !NumaTopology::Interleave(base + from, to - from))
+            cout << "Warning: could not interleave the map over the NUMA nodes." << endl;
+        return;
+    }
+#else
+    (void)block;
+#endif
+}
+
+/** MapArena::Resident
+ * DESCRIPTION:
+ *      Counts the bytes of the arena backed by each node so far.
+ */
+void MapArena::Resident(std::vector<size_t>* perNode) const {
+    perNode->assign(NumaTopology::Instance().Nodes(), 0);
+    if (base != NULL && backing != BackingHeap)
+        NumaTopology::Instance().Resident(base, length, perNode);
+}
+
+const char* MapArena::Backing() const {
+    switch (backing) {
+        case BackingHuge:           return "huge pages";
+        case BackingTransparent:    return "transparent huge pages";
+        default:                    return "pages";
+    }
+}
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <vector>
+#include <sys/stat.h>
+#if defined(__unix__) || defined(__APPLE__)
+    #define MAP_CACHE_MMAP 1
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "dem_parser/map_cache.h"
+#include "dem_parser/dem_tile.h"
+
+// Bytes read at once when computing the checksum of a file.
+static const size_t checksumChunk = 1 << 20;
+
+typedef struct checksum_entry_t {
+    int64_t     size, mtime;
+    uint64_t    inode;
+    int64_t     ctime;
+    uint64_t    checksum;
+} checksum_entry_t;
+
+/** SameFile
+ * DESCRIPTION:
+ *      Returns true if a file is still the one an index entry was recorded
+ *      for. Copies that keep the modification time (cp -p, rsync -t) make a
+ *      new inode or change time, neither of which can be set back.
+ */
+static bool SameFile(const checksum_entry_t& e, const struct stat& st) {
+    return e.size == (int64_t)st.st_size && e.mtime == (int64_t)st.st_mtime &&
+           e.inode == (uint64_t)st.st_ino && e.ctime == (int64_t)st.st_ctime;
+}
+
+MapCache::MapCache() {
+    base = NULL;
+    length = 0;
+    writable = false;
+    header = NULL;
+    sizeX = 0;
+    sizeY = 0;
+}
+
+MapCache::~MapCache() {
+    Close();
+}
+
+/** MapCache::Filename
+ * DESCRIPTION:
+ *      Returns the path of the .grid file for a key.
+ */
+std::string MapCache::Filename(const std::string& folder, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.grid", (unsigned long long)key);
+    return folder + "/" + name;
+}
+
+/** MapCache::Open
+ * DESCRIPTION:
+ *      Maps the .grid file for a key read-only, if it exists and is
+ *      complete.
+ * ARGUMENTS:
+ *      const std::string& folder
+ *          The folder holding the .grid files.
+ *      uint64_t key
+ *          The key of the grid, see Hash.
+ *      int x, y
+ *          The size of the map in cells.
+ * RETURNS:
+ *      true if the grid was found.
+ */
+bool MapCache::Open(const std::string& folder, uint64_t key, int x, int y) {
+    Close();
+#ifdef MAP_CACHE_MMAP
+    std::string filename = Filename(folder, key);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    size_t expected = sizeof(map_cache_header_t) + 3 * (size_t)x * y * sizeof(float);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != expected) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(NULL, expected, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    const map_cache_header_t* h = (const map_cache_header_t*)mapping;
+    if (memcmp(h->magic, MAP_CACHE_MAGIC, 4) != 0 || h->version != MAP_CACHE_VERSION ||
+        h->key != key || h->sizeX != x || h->sizeY != y) {
+        munmap(mapping, expected);
+        return false;
+    }
+    base = (unsigned char*)mapping;
+    length = expected;
+    writable = false;
+    header = (map_cache_header_t*)mapping;
+    sizeX = x;
+    sizeY = y;
+    path = filename;
+    return true;
+#else
+    (void)folder; (void)key; (void)x; (void)y;
+    return false;
+#endif
+}
+
+/** MapCache::Create
+ * DESCRIPTION:
+ *      Creates and maps a temporary .grid file to be filled in. The file
+ *      only becomes visible to other runs once Commit() is called.
+ * ARGUMENTS:
+ *      See Open. The folder is created if necessary.
+ * RETURNS:
+ *      true if the file could be created.
+ */
+bool MapCache::Create(const std::string& folder, uint64_t key, int x, int y) {
+    Close();
+#ifdef MAP_CACHE_MMAP
+    mkdir(folder.c_str(), 0755);
+    std::string filename = Filename(folder, key);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+    std::string tmp = filename + suffix;
+
+    size_t bytes = sizeof(map_cache_header_t) + 3 * (size_t)x * y * sizeof(float);
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, bytes) != 0) {
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    void* mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    base = (unsigned char*)mapping;
+    length = bytes;
+    writable = true;
+    header = (map_cache_header_t*)mapping;
+    header->version = MAP_CACHE_VERSION;
+    header->key = key;
+    header->sizeX = x;
+    header->sizeY = y;
+    sizeX = x;
+    sizeY = y;
+    path = filename;
+    tmpPath = tmp;
+    return true;
+#else
+    (void)folder; (void)key; (void)x; (void)y;
+    return false;
+#endif
+}
+
+/** MapCache::Commit
+ * DESCRIPTION:
+ *      Marks a grid created by Create() as complete and moves it into
+ *      place. The mapping stays valid.
+ * ARGUMENTS:
+ *      float originElevation
+ *          The ground elevation at the origin.
+ * RETURNS:
+ *      true if the grid was saved.
+ */
+bool MapCache::Commit(float originElevation) {
+#ifdef MAP_CACHE_MMAP
+    if (!writable)
+        return false;
+    header->originElevation = originElevation;
+    memcpy(header->magic, MAP_CACHE_MAGIC, 4);
+    writable = false;
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return true;
+#else
+    (void)originElevation;
+    return false;
+#endif
+}
+
+/** MapCache::Close
+ * DESCRIPTION:
+ *      Unmaps the grid. A grid that was created but not committed is
+ *      deleted.
+ */
+void MapCache::Close() {
+#ifdef MAP_CACHE_MMAP
+    if (base == NULL)
+        return;
+    munmap(base, length);
+    if (writable)
+        unlink(tmpPath.c_str());
+#endif
+    base = NULL;
+    header = NULL;
+    writable = false;
+}
+
+/** MapCache::Hash
+ * DESCRIPTION:
+ *      Adds a block of bytes to a 64-bit FNV-1a hash.
+ * ARGUMENTS:
+ *      const void* data
+ *          The bytes to hash.
+ *      size_t bytes
+ *          The number of bytes.
+ *      uint64_t hash
+ *          The hash so far, hashSeed to start a new one.
+ */
+uint64_t MapCache::Hash(const void* data, size_t bytes, uint64_t hash) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < bytes; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/** ReadDemChecksum
+ * DESCRIPTION:
+ *      Reads the checksum recorded in the header of a .dem tile.
+ * RETURNS:
+ *      false if the file is not a .dem tile or has no checksum.
+ */
+static bool ReadDemChecksum(const std::string& filename, uint64_t* checksum) {
+    if (filename.size() <= 4 || filename.compare(filename.size() - 4, 4, ".dem") != 0)
+        return false;
+    FILE* fd = fopen(filename.c_str(), "rb");
+    if (fd == NULL)
+        return false;
+    dem_tile_header_t header;
+    bool ok = fread(&header, sizeof(header), 1, fd) == 1 &&
+              memcmp(header.magic, DEM_TILE_MAGIC, 4) == 0 && header.checksum != 0;
+    fclose(fd);
+    *checksum = header.checksum;
+    return ok;
+}
+
+/** ChecksumFile
+ * DESCRIPTION:
+ *      Hashes the whole contents of a file, see MapCache::Hash.
+ * RETURNS:
+ *      false if the file cannot be read.
+ */
+static bool ChecksumFile(const std::string& filename, uint64_t* checksum) {
+    FILE* fd = fopen(filename.c_str(), "rb");
+    if (fd == NULL)
+        return false;
+    std::vector<unsigned char> chunk(checksumChunk);
+    uint64_t hash = MapCache::hashSeed;
+    size_t n;
+    while ((n = fread(chunk.data(), 1, chunk.size(), fd)) > 0)
+        hash = MapCache::Hash(chunk.data(), n, hash);
+    bool ok = !ferror(fd);
+    fclose(fd);
+    *checksum = hash;
+    return ok;
+}
+
+/** ChecksumIndex
+ * DESCRIPTION:
+ *      Returns the checksums recorded in the "checksums" file of a cache
+ *      folder, by path. The file is read once per process.
+ */
+static std::map<std::string, checksum_entry_t>& ChecksumIndex(const std::string& folder) {
+    static std::map<std::string, std::map<std::string, checksum_entry_t> > indexes;
+    std::map<std::string, std::map<std::string, checksum_entry_t> >::iterator it = indexes.find(folder);
+    if (it != indexes.end())
+        return it->second;
+    std::map<std::string, checksum_entry_t>& index = indexes[folder];
+    FILE* fd = fopen((folder + "/checksums").c_str(), "r");
+    if (fd == NULL)
+        return index;
+    long long size, mtime, ctime;
+    unsigned long long inode, checksum;
+    char line[4200], path[4096];
+    // Later lines override earlier ones for the same path. Lines in any
+    // other format are skipped.
+    while (fgets(line, sizeof(line), fd) != NULL)
+        if (sscanf(line, "%lld %lld %llu %lld %llx %4095[^\n]", &size, &mtime, &inode, &ctime, &checksum, path) == 6) {
+            checksum_entry_t e = { size, mtime, inode, ctime, checksum };
+            index[path] = e;
+        }
+    fclose(fd);
+    return index;
+}
+
+/** MapCache::HashFile
+ * DESCRIPTION:
+ *      Adds the name and the checksum of the contents of a file to a hash.
+ *      The checksum is read from the header of a .dem tile, or from the
+ *      index of the cache folder if the size, modification time, inode and
+ *      change time of the file have not changed since it was recorded. Otherwise the file is
+ *      read and its checksum added to the index. Missing files only add
+ *      their name, so that a tile appearing later changes the hash.
+ * ARGUMENTS:
+ *      const std::string& folder
+ *          The cache folder holding the index of checksums.
+ *      const std::string& filename
+ *          The file to hash.
+ *      uint64_t hash
+ *          The hash so far.
+ */
+uint64_t MapCache::HashFile(const std::string& folder, const std::string& filename, uint64_t hash) {
+    hash = Hash(filename.data(), filename.size(), hash);
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return hash;
+    uint64_t checksum;
+    if (!ReadDemChecksum(filename, &checksum)) {
+        std::map<std::string, checksum_entry_t>& index = ChecksumIndex(folder);
+        std::map<std::string, checksum_entry_t>::iterator it = index.find(filename);
+        if (it != index.end() && SameFile(it->second, st)) {
+            checksum = it->second.checksum;
+        } else {
+            if (!ChecksumFile(filename, &checksum)) {
+                printf("Error reading %s\n", filename.c_str());
+                exit(1);
+            }
+            checksum_entry_t e = { (int64_t)st.st_size, (int64_t)st.st_mtime, (uint64_t)st.st_ino, 
+                                   (int64_t)st.st_ctime, checksum };
+            index[filename] = e;
+            // One short append per line, so that concurrent runs do not
+            // interleave their lines.
+            FILE* fd = fopen((folder + "/checksums").c_str(), "a");
+            if (fd != NULL) {
+                fprintf(fd, "%lld %lld %llu %lld %016llx %s\n", (long long)e.size, (long long)e.mtime,
+                        (unsigned long long)e.inode, (long long)e.ctime, (unsigned long long)checksum, 
+                        filename.c_str());
+                fclose(fd);
+            }
+        }
+    }
+    return Hash(&checksum, sizeof(checksum), hash);
+}
@@ -1,6 +1,8 @@
 #include "dem_parser/dem_parser.h"
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <vector>
 
 using std::cout;
 using std::endl;
@@ -16,6 +18,16 @@ using std::ios;
  */
 void ElevationMap::exportMap() {
     uint8_t fileVersion = 0x10;
+    // Writes a plane by rows, whatever its layout and profile, a span of
+    // contiguous cells at a time.
+    std::vector<float> buffer(rowSpan());
+    auto writePlane = [&](ofstream& out, const float* (ElevationMap::*row)(int, int, int, float*) const) {
+        for (int i = 0; i < mapSizeX; i++)
+            for (int j = 0; j < mapSizeY; j += rowSpan()) {
+                int n = std::min(rowSpan(), mapSizeY - j);
+                out.write(reinterpret_cast<const char*>((this->*row)(i, j, n, buffer.data())), n * sizeof(float));
+            }
+    };
 
     /* Export for Elevation Map */
     if (Options->DEM_PARSER_EXPORT_ELEVATION_MAP) {
@@ -24,11 +36,14 @@ void ElevationMap::exportMap() {
             elevationMapExport.write(reinterpret_cast<char*>(&fileVersion), sizeof(fileVersion));
             elevationMapExport.write(reinterpret_cast<char*>(&mapSizeX), sizeof(mapSizeX));
             elevationMapExport.write(reinterpret_cast<char*>(&mapSizeY), sizeof(mapSizeY));
-            for (int i = 0; i < mapSizeX; i++)
+            std::vector<float> heights(mapSizeY);
+            for (int i = 0; i < mapSizeX; i++) {
                 for (int j = 0; j < mapSizeY; j++)
-                    elevationMapExport.write(   reinterpret_cast<char*>(&elevation_map[i][j]),
-                                                sizeof(elevation_map[i][j])
-                                            );
+                    heights[j] = heightAt(i, j);
+                elevationMapExport.write(   reinterpret_cast<char*>(heights.data()),
+                                            mapSizeY * sizeof(float)
+                                        );
+            }
             elevationMapExport.close();
             if (Options->PROG_VERBOSE)
                 cout << "  Elevation map exported sucessfully to elevation_map.bin" << endl;
@@ -43,11 +58,7 @@ void ElevationMap::exportMap() {
             grazingAngleExport.write(reinterpret_cast<char*>(&fileVersion), sizeof(fileVersion));
             grazingAngleExport.write(reinterpret_cast<char*>(&mapSizeX), sizeof(mapSizeX));
             grazingAngleExport.write(reinterpret_cast<char*>(&mapSizeY), sizeof(mapSizeY));
-            for (int i = 0; i < mapSizeX; i++)
-                for (int j = 0; j < mapSizeY; j++)
-                    grazingAngleExport.write(   reinterpret_cast<char*>(&map[i][j].grazing),
-                                                sizeof(map[i][j].grazing)
-                                            );
+            writePlane(grazingAngleExport, &ElevationMap::grazingRow);
             grazingAngleExport.close();
             if (Options->PROG_VERBOSE)
                 cout << "  Grazing angles exported sucessfully to grazing_angle.bin" << endl;
@@ -62,11 +73,7 @@ void ElevationMap::exportMap() {
             azAngleExport.write(reinterpret_cast<char*>(&fileVersion), sizeof(fileVersion));
             azAngleExport.write(reinterpret_cast<char*>(&mapSizeX), sizeof(mapSizeX));
             azAngleExport.write(reinterpret_cast<char*>(&mapSizeY), sizeof(mapSizeY));
-            for (int i = 0; i < mapSizeX; i++)
-                for (int j = 0; j < mapSizeY; j++)
-                    azAngleExport.write(   reinterpret_cast<char*>(&map[i][j].az),
-                                                sizeof(map[i][j].az)
-                                            );
+            writePlane(azAngleExport, &ElevationMap::azimuthRow);
             azAngleExport.close();
             if (Options->PROG_VERBOSE)
                 cout << "  Azimuth angles exported sucessfully to azimuth_angle.bin" << endl;
@@ -81,11 +88,7 @@ void ElevationMap::exportMap() {
             elAngleExport.write(reinterpret_cast<char*>(&fileVersion), sizeof(fileVersion));
             elAngleExport.write(reinterpret_cast<char*>(&mapSizeX), sizeof(mapSizeX));
             elAngleExport.write(reinterpret_cast<char*>(&mapSizeY), sizeof(mapSizeY));
-            for (int i = 0; i < mapSizeX; i++)
-                for (int j = 0; j < mapSizeY; j++)
-                    elAngleExport.write(   reinterpret_cast<char*>(&map[i][j].el),
-                                                sizeof(map[i][j].el)
-                                            );
+            writePlane(elAngleExport, &ElevationMap::elevationRow);
             elAngleExport.close();
             if (Options->PROG_VERBOSE)
                 cout << "  Elevation angles exported sucessfully to elevation_angle.bin" << endl;
@@ -101,10 +104,10 @@ void ElevationMap::exportMap() {
             shadowingExport.write(reinterpret_cast<char*>(&mapSizeX), sizeof(mapSizeX));
             shadowingExport.write(reinterpret_cast<char*>(&mapSizeY), sizeof(mapSizeY));
             for (int i = 0; i < mapSizeX; i++)
-                for (int j = 0; j < mapSizeY; j++)
-                    shadowingExport.write(   reinterpret_cast<char*>(&map[i][j].shadowed),
-                                                sizeof(map[i][j].shadowed)
-                                            );
+                for (int j = 0; j < mapSizeY; j += rowSpan())
+                    shadowingExport.write(  reinterpret_cast<const char*>(shadowedRow(i, j)),
+                                            std::min(rowSpan(), mapSizeY - j) * sizeof(uint8_t)
+                                        );
             shadowingExport.close();
             if (Options->PROG_VERBOSE)
                 cout << "  Shadowing exported sucessfully to shadowing.bin" << endl;
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define MOSAIC_MMAP 1
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "dem_parser/mosaic_reader.h"
+#include "dem_parser/elevation_reader.h"
+
+using std::cout;
+using std::endl;
+
+/** MosaicReader::MosaicReader
+ * DESCRIPTION:
+ *      Maps a mosaic and validates its header. Exits if the file cannot
+ *      be read, as a missing SRTM tile does.
+ * ARGUMENTS:
+ *      const std::string& filename
+ *          The path of the mosaic.
+ */
+MosaicReader::MosaicReader(const std::string& filename) {
+    FILE* fd = fopen(filename.c_str(), "rb");
+    if (fd == NULL || fread(&header, sizeof(header), 1, fd) != 1) {
+        printf("Error opening %s\n", filename.c_str());
+        exit(1);
+    }
+    if (memcmp(header.magic, DEM_MOSAIC_MAGIC, 4) != 0 ||
+        header.version != DEM_MOSAIC_VERSION ||
+        header.sampleType > DEM_MOSAIC_SAMPLE_FLOAT ||
+        header.width < 2 || header.height < 2 ||
+        header.latStep <= 0 || header.lonStep <= 0) {
+        printf("Error reading %s: not a DEM mosaic\n", filename.c_str());
+        exit(1);
+    }
+    size_t sampleSize = header.sampleType == DEM_MOSAIC_SAMPLE_FLOAT ? sizeof(float) : sizeof(int16_t);
+    length = header.headerSize + (size_t)header.width * header.height * sampleSize;
+    fseek(fd, 0, SEEK_END);
+    if ((size_t)ftell(fd) < length) {
+        printf("Error reading %s: truncated mosaic\n", filename.c_str());
+        exit(1);
+    }
+#ifdef MOSAIC_MMAP
+    fclose(fd);
+    int fdes = open(filename.c_str(), O_RDONLY);
+    void* mapping = fdes < 0 ? MAP_FAILED : mmap(NULL, length, PROT_READ, MAP_SHARED, fdes, 0);
+    if (fdes >= 0)
+        close(fdes);
+    if (mapping == MAP_FAILED) {
+        printf("Error mapping %s\n", filename.c_str());
+        exit(1);
+    }
+    base = (const unsigned char*)mapping;
+#else
+    unsigned char* buffer = (unsigned char*)malloc(length);
+    fseek(fd, 0, SEEK_SET);
+    if (fread(buffer, 1, length, fd) != length) {
+        printf("Error reading %s\n", filename.c_str());
+        exit(1);
+    }
+    fclose(fd);
+    base = buffer;
+#endif
+    samples = base + header.headerSize;
+    rowMax = header.height - 1;
+    colMax = header.width - 1;
+}
+
+MosaicReader::~MosaicReader() {
+#ifdef MOSAIC_MMAP
+    munmap((void*)base, length);
+#else
+    free((void*)base);
+#endif
+}
+
+/** MosaicReader::Interpolate
+ * DESCRIPTION:
+ *      Reads the elevations of many points. The row and column of each
+ *      point are clamped to the raster with min/max, so the loop has no
+ *      branches and the compiler is free to vectorize it.
+ * ARGUMENTS:
+ *      const float* lat, lon
+ *          The lattitudes and longitudes of the points in degrees.
+ *      float* out
+ *          The elevations. This will be overwritten.
+ *      size_t n
+ *          The number of points.
+ *      T
+ *          The sample type of the raster.
+ *      Max
+ *          Return the highest of the four samples around each point
+ *          instead of interpolating them.
+ */
+template <typename T, bool Max>
+void MosaicReader::Interpolate(const float* lat, const float* lon, float* out, size_t n) {
+    const T* data = (const T*)samples;
+    const int width = header.width;
+    const int lastRow = header.height - 2;
+    const int lastCol = header.width - 2;
+    // The offsets are taken in double, as the corner of the raster is
+    // generally not representable as a float.
+    const double north = header.north;
+    const double west = header.west;
+    const float rowsPerDegree = 1.0 / header.latStep;
+    const float colsPerDegree = 1.0 / header.lonStep;
+    for (size_t i = 0; i < n; i++) {
+        float r = fminf(fmaxf((float)(north - lat[i]) * rowsPerDegree, 0.0f), rowMax);
+        float c = fminf(fmaxf((float)(lon[i] - west) * colsPerDegree, 0.0f), colMax);
+        int r0 = std::min((int)r, lastRow);
+        int c0 = std::min((int)c, lastCol);
+        float dy = r - r0;
+        float dx = c - c0;
+
+        // h0 h1 on the northern row, h2 h3 on the southern one.
+        const T* p = data + (size_t)r0 * width + c0;
+        float h0 = p[0], h1 = p[1], h2 = p[width], h3 = p[width + 1];
+        if (Max)
+            out[i] = fmaxf(fmaxf(h0, h1), fmaxf(h2, h3));
+        else
+            out[i] = h0 * (1 - dy) * (1 - dx) +
+                     h1 * (1 - dy) * dx +
+                     h2 * dy * (1 - dx) +
+                     h3 * dy * dx;
+    }
+}
+
+/** MosaicReader::Read
+ * DESCRIPTION:
+ *      Dispatches to the kernel for the sample type of the raster.
+ */
+void MosaicReader::Read(const float* lat, const float* lon, float* out, size_t n, bool max) {
+    if (header.sampleType == DEM_MOSAIC_SAMPLE_FLOAT) {
+        if (max)
+            Interpolate<float, true>(lat, lon, out, n);
+        else
+            Interpolate<float, false>(lat, lon, out, n);
+    } else {
+        if (max)
+            Interpolate<int16_t, true>(lat, lon, out, n);
+        else
+            Interpolate<int16_t, false>(lat, lon, out, n);
+    }
+}
+
+float MosaicReader::GetElevation(float lat, float lon, float range, float footprint) {
+    (void)range; (void)footprint;
+    float elevation;
+    Read(&lat, &lon, &elevation, 1, false);
+    return elevation;
+}
+
+float MosaicReader::GetMaxElevation(float lat, float lon, float range, float footprint) {
+    (void)range; (void)footprint;
+    float elevation;
+    Read(&lat, &lon, &elevation, 1, true);
+    return elevation;
+}
+
+void MosaicReader::GetElevationBatch(const float* lat, const float* lon, float* out, size_t n,
+                                     const float* range, const float* footprint) {
+    (void)range; (void)footprint;
+    Read(lat, lon, out, n, false);
+}
+
+/** MosaicReader::ListTiles
+ * DESCRIPTION:
+ *      The mosaic is mapped when the reader is created, so there is
+ *      nothing to prefetch.
+ */
+void MosaicReader::ListTiles(double latMin, double latMax, double lonMin, double lonMax, float range,
+                             std::vector<TilePrefetcher::request_t>* tiles) {
+    (void)latMin; (void)latMax; (void)lonMin; (void)lonMax; (void)range; (void)tiles;
+}
+
+/** MosaicReader::Covers
+ * DESCRIPTION:
+ *      Returns false if part of an area lies outside the raster.
+ */
+bool MosaicReader::Covers(double latMin, double latMax, double lonMin, double lonMax) {
+    double south = header.north - (header.height - 1) * header.latStep;
+    double east = header.west + (header.width - 1) * header.lonStep;
+    return latMin >= south && latMax <= header.north && lonMin >= header.west && lonMax <= east;
+}
+
+/** BuildMosaic
+ * DESCRIPTION:
+ *      Writes an int16 mosaic of the SRTM tiles around the site. The
+ *      raster lies on the 3 arc second SRTM grid, so every sample is a
+ *      sample of the tiles, and covers the map of SIMULATOR_RADIUS around
+ *      the origin with a small margin.
+ * ARGUMENTS:
+ *      options_t* Options
+ *          The program options: the origin, radius and SRTM folders.
+ *      const std::string& filename
+ *          The path of the mosaic to write.
+ * RETURNS:
+ *      true if the mosaic was written.
+ */
+bool BuildMosaic(options_t* Options, const std::string& filename) {
+    const int pxPerDegree = 3600 / Srtm3::secondsPerPx;
+    double lat = Options->SIMULATOR_ORIGIN_LAT;
+    double lon = Options->SIMULATOR_ORIGIN_LON;
+    // The map is a square around the origin, so cover its corners.
+    double radius = Options->SIMULATOR_RADIUS * sqrt(2.0);
+    double dLat = radius / 110574.0 + 0.01;
+    double dLon = radius / (111320.0 * cos((fabs(lat) + dLat) * M_PI / 180.0)) + 0.01;
+
+    dem_mosaic_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DEM_MOSAIC_MAGIC, 4);
+    header.version = DEM_MOSAIC_VERSION;
+    header.sampleType = DEM_MOSAIC_SAMPLE_INT16;
+    header.headerSize = sizeof(header);
+    int northPx = (int)ceil((lat + dLat) * pxPerDegree);
+    int southPx = (int)floor((lat - dLat) * pxPerDegree);
+    int westPx = (int)floor((lon - dLon) * pxPerDegree);
+    int eastPx = (int)ceil((lon + dLon) * pxPerDegree);
+    header.north = (double)northPx / pxPerDegree;
+    header.west = (double)westPx / pxPerDegree;
+    header.latStep = 1.0 / pxPerDegree;
+    header.lonStep = 1.0 / pxPerDegree;
+    header.height = northPx - southPx + 1;
+    header.width = eastPx - westPx + 1;
+
+    FILE* out = fopen(filename.c_str(), "wb");
+    if (out == NULL)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    // Read whole rows from the 3 arc second tiles.
+    options_t srtm = *Options;
+    srtm.DEM_PARSER_SRTM1_FOLDER = "";
+    ElevationReader reader(&srtm);
+    std::vector<float> lats(header.width), lons(header.width), heights(header.width);
+    std::vector<int16_t> row(header.width);
+    for (int c = 0; c < header.width; c++)
+        lons[c] = (float)((double)(westPx + c) / pxPerDegree);
+    for (int r = 0; ok && r < header.height; r++) {
+        std::fill(lats.begin(), lats.end(), (float)((double)(northPx - r) / pxPerDegree));
+        reader.GetElevationBatch(lats.data(), lons.data(), heights.data(), header.width);
+        for (int c = 0; c < header.width; c++)
+            row[c] = (int16_t)floor(heights[c] + 0.5f);
+        ok = fwrite(row.data(), sizeof(int16_t), header.width, out) == (size_t)header.width;
+    }
+    fclose(out);
+    if (Options->PROG_VERBOSE)
+        cout << "Mosaic of " << header.width << "x" << header.height << " samples written to "
+             << filename << endl;
+    return ok;
+}
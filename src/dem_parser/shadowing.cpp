@@ -4,29 +4,103 @@
 
 #include "dem_parser/dem_parser.h"
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 #include <math.h>
 #include <stdlib.h>
-#include <thread>
+#include <chrono>
+#include <iostream>
+#include "thread_pool.h"
 using std::vector;
+using std::cout;
+using std::endl;
+using std::chrono::steady_clock;
+using std::chrono::duration;
 
 void ElevationMap::calculateShadowing() {
-    std::thread* threads = new std::thread[threadCount];
-    float mapDelta = float(mapSizeX-1)/float(threadCount);
-    threads[0] = std::thread(   &ElevationMap::calculateShadowingPartial,
-                                this,
-                                0, 
-                                int(mapDelta)
-                            );
-                            
-    for (int i = 1; i < threadCount; i++)
-        threads[i] = std::thread(   &ElevationMap::calculateShadowingPartial,
-                                    this,
-                                    int(mapDelta*i)+1,
-                                    int(mapDelta*(i+1))
-                                );
-    for (int i = 0; i < threadCount; i++)
-        threads[i].join();
+    // Rays of the polar grid already test each cell once, against every
+    // cell in front of it: the engines only apply to Cartesian maps.
+    if (!polar && Options->DEM_PARSER_SHADOWING_BENCHMARK)
+        benchmarkShadowing();
+    else if (!polar && Options->DEM_PARSER_SHADOWING_ENGINE == 1)
+        calculateShadowingSweep();
+    else
+        calculateShadowingLines();
+}
+
+/** ElevationMap::benchmarkShadowing
+ * DESCRIPTION:
+ *      Shadows the map with both engines, and prints their times and how
+ *      many cells each shadowed that the other did not. The map is left
+ *      shadowed by the selected engine.
+ */
+void ElevationMap::benchmarkShadowing() {
+    vector<uint8_t> unshadowed(planes.shadowed, planes.shadowed + planes.cells);
+    steady_clock::time_point start = steady_clock::now();
+    calculateShadowingLines();
+    double linesTime = duration<double>(steady_clock::now() - start).count();
+    vector<uint8_t> lines(planes.shadowed, planes.shadowed + planes.cells);
+
+    std::copy(unshadowed.begin(), unshadowed.end(), planes.shadowed);
+    start = steady_clock::now();
+    calculateShadowingSweep();
+    double sweepTime = duration<double>(steady_clock::now() - start).count();
+
+    size_t both = 0, linesOnly = 0, sweepOnly = 0;
+    for (size_t c = 0; c < planes.cells; c++) {
+        bool a = lines[c] == 0x01, b = planes.shadowed[c] == 0x01;
+        both += a && b;
+        linesOnly += a && !b;
+        sweepOnly += b && !a;
+    }
+    cout << "Shadowing engines: lines " << linesTime << " s, sweep " << sweepTime << " s. Cells shadowed: "
+         << both << " by both, " << linesOnly << " by the lines only, " << sweepOnly << " by the sweep only." << endl;
+    if (Options->DEM_PARSER_SHADOWING_ENGINE == 0)
+        std::copy(lines.begin(), lines.end(), planes.shadowed);
+}
+
+/** ElevationMap::calculateShadowingLines
+ * DESCRIPTION:
+ *      Shadows the map along lines cast from the origin to every cell of
+ *      its edges, or along the rays of a polar map.
+ */
+void ElevationMap::calculateShadowingLines() {
+    // The polar grid is shadowed one ray at a time.
+    void (ElevationMap::*partial)(int, int) = polar ? &ElevationMap::calculateShadowingPolar
+                                                    : &ElevationMap::calculateShadowingPartial;
+    // Cartesian lines are cast to each edge, rays only for the rows held.
+    int first = polar ? rowBegin : 0;
+    int last = polar ? rowEnd : mapSizeX - 1;
+    auto body = [this, partial](int start, int end) { (this->*partial)(start, end); };
+    if (polar) {
+        ThreadPool::Instance().ParallelFor(first, last, 16, body);
+        return;
+    }
+    // A line stops where it leaves the radius, which is closer to the
+    // origin towards the corners of the map.
+    vector<double> weight(mapSizeX);
+    for (int i = 0; i < mapSizeX; i++)
+        weight[i] = lineCells(i - mapOriginX, -mapOriginY) + lineCells(i - mapOriginX, mapSizeY - 1 - mapOriginY)
+                  + lineCells(-mapOriginX, i - mapOriginY) + lineCells(mapSizeX - 1 - mapOriginX, i - mapOriginY);
+    ThreadPool::Instance().WeightedFor(first, last, weight, body);
+}
+
+/** ElevationMap::lineCells
+ * DESCRIPTION:
+ *      Estimates the number of cells of a line cast from the origin
+ *      before it leaves the radius.
+ * ARGUMENTS:
+ *      int dx, dy
+ *          The end of the line, from the origin.
+ */
+double ElevationMap::lineCells(int dx, int dy) const {
+    double major = std::max(abs(dx), abs(dy));
+    double minor = std::min(abs(dx), abs(dy));
+    if (major == 0)
+        return 0;
+    // Each step along the major axis moves 1 + minor / (2 major) cells
+    // of alpha max plus beta min distance.
+    return std::min(major, mapRangeMax / (1 + minor / (2 * major)));
 }
 
 void ElevationMap::calculateShadowingPartial(int start, int end) {
@@ -41,21 +115,22 @@ void ElevationMap::calculateShadowingPartial(int start, int end) {
 void ElevationMap::calculateShadowingAlongLine(int x1, int y1) {
     int x0 = mapOriginX;
     int y0 = mapOriginY;
-    vector<chunk_t*> list;
+    // Cells of the line, as indices into the map planes.
+    vector<size_t> list;
     int deltax = x1 - x0;
     int deltay = y1 - y0;
    
     // Lines lies only on the Y axis.
     if (deltax == 0) {
         for (int y = y0; y != y1; y += (deltay > 0 ? 1 : -1))
-            list.push_back(&map[x0][y]);
-        list.push_back(&map[x1][y1]);
+            list.push_back(cell(x0, y));
+        list.push_back(cell(x1, y1));
     }
     // Line lies only on the X axis.
     else if (deltay == 0) {
         for (int x = x0; x != x1; x += (deltax > 0 ? 1 : -1))
-            list.push_back(&map[x][y0]);
-        list.push_back(&map[x1][y1]);
+            list.push_back(cell(x, y0));
+        list.push_back(cell(x1, y1));
     }
     // Otherwise, use Bresenham's line algorithm
     else {
@@ -66,34 +141,57 @@ void ElevationMap::calculateShadowingAlongLine(int x1, int y1) {
         int err = (dx>dy ? dx : -dy)/2, e2;
  
         for(;;) {
-            list.push_back(&map[x0][y0]);
+            list.push_back(cell(x0, y0));
             if (x0==x1 && y0==y1) break;
             e2 = err;
             if (e2 >-dx) { err -= dy; x0 += sx; }
             if (e2 < dy) { err += dx; y0 += sy; }
             // Check if the chunk is out of range.
-            if (map[x0][y0].shadowed & (0x01 << 1))
+            if (planes.shadowed[cell(x0, y0)] & (0x01 << 1))
                 break;
         } 
     }
     
     
-    int end = list.size() - 1;
-	for (int i = 0; i <= end; i++) {
-        // Find max between 0 and end.
-		int max_i = end;
-		for (int k = 0; k <= end; k++) 
-			if (list[k]->el > list[max_i]->el)
-				max_i = k;
+    // A single outward pass, as along a polar ray: a cell is shadowed if
+    // the highest elevation angle between the origin and the cell is more
+    // than 5 degrees above its own.
+    double max_el = elevationAt(list[0]);
+    for (size_t j = 1; j < list.size(); j++) {
+        float el = elevationAt(list[j]);
+        if ((max_el - 5 * 3.141592 / 180.0) > el)
+            planes.shadowed[list[j]] |= (0x01);
+        if (el > max_el)
+            max_el = el;
+    }
+}
 
-        double max_el = list[max_i]->el;
-        // Shadow all chunks from max_i to end.
-		for (int j = max_i+1; j <= end; j++) {
-			if ((max_el - 5 * 3.141592 / 180.0) > list[j]->el)
-                list[j]->shadowed |= (0x01);
-        }
-		end = max_i - 1;
-	}
+void ElevationMap::calculateShadowingPolar(int start, int end) {
+    for (int i = start; i <= end; i++)
+        calculateShadowingAlongRay(i);
+}
+
+/** ElevationMap::calculateShadowingAlongRay
+ * DESCRIPTION:
+ *      Shadows the cells of a ray of the polar grid. The ray is already
+ *      ordered by range, so a single scan keeps the highest elevation
+ *      angle seen between the radar and each cell, and shadows the cell if
+ *      it lies more than 5 degrees below it, as the Cartesian lines do.
+ * ARGUMENTS:
+ *      int x
+ *          The ray.
+ */
+void ElevationMap::calculateShadowingAlongRay(int x) {
+    size_t c = cell(x, 0);
+    uint8_t* shadowed = planes.shadowed + c;
+    double max_el = elevationAt(c);
+    for (int j = 1; j < mapSizeY; j++) {
+        float el = elevationAt(c + j);
+        if ((max_el - 5 * 3.141592 / 180.0) > el)
+            shadowed[j] |= (0x01);
+        if (el > max_el)
+            max_el = el;
+    }
 }
 
 #ifdef DEBUG_SHADOWING
@@ -0,0 +1,155 @@
+#include <math.h>
+
+#include "dem_parser/spherical_kernel.h"
+#include "dem_parser/elevation_reader.h"
+
+static const double a2 = ElevationReader::a * ElevationReader::a;
+static const double b2 = ElevationReader::b * ElevationReader::b;
+
+/** RotatedSinCos
+ * DESCRIPTION:
+ *      Returns the sine and cosine of ref + d from those of ref, with
+ *      degree 11 and 12 Taylor series of d. Exact to 1e-16 for |d| up to
+ *      20 degrees.
+ */
+static inline void RotatedSinCos(double d, double sinRef, double cosRef, double* s, double* c) {
+    double d2 = d * d;
+    double sd = d * (1 - d2 / 6 * (1 - d2 / 20 * (1 - d2 / 42 * (1 - d2 / 72 * (1 - d2 / 110)))));
+    double cd = 1 - d2 / 2 * (1 - d2 / 12 * (1 - d2 / 30 * (1 - d2 / 56 * (1 - d2 / 90 * (1 - d2 / 132)))));
+    *s = sinRef * cd + cosRef * sd;
+    *c = cosRef * cd - sinRef * sd;
+}
+
+/** Angles
+ * DESCRIPTION:
+ *      Converts local cartesian coordinates to range, azimuth and
+ *      elevation. The arrays must not overlap, which lets the compiler
+ *      vectorize the loop without checking.
+ */
+static void Angles(const float* __restrict x, const float* __restrict y, const float* __restrict z, size_t n,
+                   float* __restrict r, float* __restrict az, float* __restrict el) {
+    for (size_t k = 0; k < n; k++) {
+        float ground2 = x[k] * x[k] + y[k] * y[k];
+        r[k] = sqrtf(ground2 + z[k] * z[k]);
+        el[k] = SphericalKernel::Atan2(z[k], sqrtf(ground2));
+        az[k] = SphericalKernel::Atan2(x[k], y[k]);
+    }
+}
+
+/** SphericalKernel::Init
+ * DESCRIPTION:
+ *      Sets the frame of the radar.
+ * ARGUMENTS:
+ *      double originLat, originLon
+ *          The position of the radar in degrees. Latitudes and longitudes
+ *          are expanded around it.
+ *      const ThreeVector& origin
+ *          The ECEF position of the radar.
+ *      const ThreeVector axis[3]
+ *          The x, y and z unit vectors of the local frame of the radar.
+ */
+void SphericalKernel::Init(double originLat, double originLon, const ThreeVector& origin, const ThreeVector axis[3]) {
+    refLat = originLat * M_PI / 180.0;
+    sinRef = sin(refLat);
+    cosRef = cos(refLat);
+    refLon = originLon * M_PI / 180.0;
+    sinRefLon = sin(refLon);
+    cosRefLon = cos(refLon);
+    for (int k = 0; k < 3; k++) {
+        this->axis[k][0] = axis[k].x;
+        this->axis[k][1] = axis[k].y;
+        this->axis[k][2] = axis[k].z;
+        originDot[k] = origin.x * axis[k].x + origin.y * axis[k].y + origin.z * axis[k].z;
+    }
+}
+
+/** SphericalKernel::Row
+ * DESCRIPTION:
+ *      Calculates the range, azimuth and elevation of the cells of a row.
+ * ARGUMENTS:
+ *      double lon
+ *          The longitude of every cell of the row, in degrees.
+ *      const float* lat, h
+ *          The latitudes in degrees and heights in meters of the cells.
+ *      size_t n
+ *          The number of cells.
+ *      float* r, az, el
+ *          The range in meters and the azimuth and elevation angles in
+ *          radians. These will be overwritten.
+ */
+void SphericalKernel::Row(double lon, const float* lat, const float* h, size_t n,
+                          float* r, float* az, float* el) {
+    if (x.size() < n) {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+    }
+    // Per row: the east/west part of the ECEF position, (cos lon, sin lon),
+    // projected on each axis.
+    double lonRad = lon * M_PI / 180.0;
+    double cl = cos(lonRad), sl = sin(lonRad);
+    const double xh = cl * axis[0][0] + sl * axis[0][1], xv = axis[0][2], xo = originDot[0];
+    const double yh = cl * axis[1][0] + sl * axis[1][1], yv = axis[1][2], yo = originDot[1];
+    const double zh = cl * axis[2][0] + sl * axis[2][1], zv = axis[2][2], zo = originDot[2];
+    const double sr = sinRef, cr = cosRef, ref = refLat;
+    float* px = x.data();
+    float* py = y.data();
+    float* pz = z.data();
+    for (size_t k = 0; k < n; k++) {
+        // sin and cos of the latitude, rotated from the origin's.
+        double s, c;
+        RotatedSinCos(lat[k] * (M_PI / 180.0) - ref, sr, cr, &s, &c);
+        // Same ECEF position as calculateECEF.
+        double N = a2 / sqrt(a2 * c * c + b2 * s * s);
+        double horizontal = (N + h[k]) * c;
+        double vertical = (b2 / a2 * N + h[k]) * s;
+        px[k] = (float)(horizontal * xh + vertical * xv - xo);
+        py[k] = (float)(horizontal * yh + vertical * yv - yo);
+        pz[k] = (float)(horizontal * zh + vertical * zv - zo);
+    }
+    Angles(px, py, pz, n, r, az, el);
+}
+
+/** SphericalKernel::Cells
+ * DESCRIPTION:
+ *      Calculates the range, azimuth and elevation of cells that do not
+ *      share a longitude, such as the rays of the polar grid. The sine and
+ *      cosine of the longitude are rotated from the origin's like the
+ *      latitude's.
+ * ARGUMENTS:
+ *      const float* lat, lon, h
+ *          The latitudes and longitudes in degrees and heights in meters
+ *          of the cells.
+ *      size_t n
+ *          The number of cells.
+ *      float* r, az, el
+ *          The range in meters and the azimuth and elevation angles in
+ *          radians. These will be overwritten.
+ */
+void SphericalKernel::Cells(const float* lat, const float* lon, const float* h, size_t n,
+                            float* r, float* az, float* el) {
+    if (x.size() < n) {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+    }
+    const double sr = sinRef, cr = cosRef, ref = refLat;
+    const double srl = sinRefLon, crl = cosRefLon, refL = refLon;
+    float* px = x.data();
+    float* py = y.data();
+    float* pz = z.data();
+    for (size_t k = 0; k < n; k++) {
+        double s, c, sl, cl;
+        RotatedSinCos(lat[k] * (M_PI / 180.0) - ref, sr, cr, &s, &c);
+        RotatedSinCos(lon[k] * (M_PI / 180.0) - refL, srl, crl, &sl, &cl);
+        double N = a2 / sqrt(a2 * c * c + b2 * s * s);
+        double horizontal = (N + h[k]) * c;
+        double vertical = (b2 / a2 * N + h[k]) * s;
+        // The ECEF position is (horizontal cl, horizontal sl, vertical).
+        double ex = horizontal * cl, ey = horizontal * sl;
+        px[k] = (float)(ex * axis[0][0] + ey * axis[0][1] + vertical * axis[0][2] - originDot[0]);
+        py[k] = (float)(ex * axis[1][0] + ey * axis[1][1] + vertical * axis[1][2] - originDot[1]);
+        pz[k] = (float)(ex * axis[2][0] + ey * axis[2][1] + vertical * axis[2][2] - originDot[2]);
+    }
+    Angles(px, py, pz, n, r, az, el);
+}
@@ -6,8 +6,10 @@ using namespace std;
 #endif
 
 #include "dem_parser/dem_parser.h"
+#include "thread_pool.h"
 #include <math.h>
-#include <thread>
+#include <vector>
+#include <algorithm>
 
 // This is the inverse matrix described in the final design.
 // It is used to calculate the polynomial coefficients.
@@ -69,66 +71,98 @@ double ElevationMap::calculateDirectionalDerivative(float* h, float az){
 }
 
 void ElevationMap::populateGrazingAngle() {
-    float mapDelta = float(mapSizeX-1 -2)/float(threadCount);
-    std::thread threads[threadCount];   
-    
-    threads[0] = std::thread(&ElevationMap::populateGrazingAnglePartial, this, 1, int(mapDelta)+1);
-    for (int i = 1; i < threadCount; i++) 
-        threads[i] = std::thread(   &ElevationMap::populateGrazingAnglePartial,this, 
-                                    int(mapDelta*(i))+2,
-                                    int(mapDelta*(i+1)+1)
-                                    );
-    for (int i = 0; i < threadCount; i++)
-        threads[i].join();
+    ThreadPool& pool = ThreadPool::Instance();
+    if (polar) {
+        // Rays are independent.
+        pool.ParallelFor(rowBegin, rowEnd, 16, [this](int start, int end) {
+            populateGrazingAnglePolar(start, end);
+        });
+        return;
+    }
+    // Tiles of rows aligned on the tiles of the tiled layout. The stencil
+    // skips the edge rows, averaged below.
+    pool.ParallelFor(0, mapSizeX - 1, MAP_TILE_SIZE, [this](int start, int end) {
+        populateGrazingAnglePartial(std::max(start, 1), std::min(end, mapSizeX - 2));
+    });
 
     // Calculate the terrain slope on the edges using a simple moving average.
+    auto g = [this](int x, int y) { return grazingAt(cell(x, y)); };
+    auto set = [this](int x, int y, float grazing) { setGrazing(cell(x, y), grazing); };
     for (int i = 1; i < mapSizeX - 1; i++){
-        map[i][0].grazing = 1.0/3.0 * ( map[i][1].grazing + 
-                                        map[i-1][1].grazing + 
-                                        map[i + 1][1].grazing );
-        map[i][mapSizeY-1].grazing = 1.0/3.0 * (    map[i][mapSizeY-2].grazing + 
-                                                    map[i-1][mapSizeY-2].grazing + 
-                                                    map[i + 1][mapSizeY-2].grazing );
-        map[0][i].grazing = 1.0/3.0 * ( map[1][i].grazing + 
-                                        map[1][i-1].grazing + 
-                                        map[1][i+1].grazing );
-        map[mapSizeX-1][i].grazing = 1.0/3.0 * (    map[mapSizeX-2][i].grazing + 
-                                                    map[mapSizeX-2][i+1].grazing + 
-                                                    map[mapSizeX-2][i-1].grazing );
+        set(i, 0, 1.0/3.0 * ( g(i, 1) + 
+                              g(i-1, 1) +
+                              g(i + 1, 1) ));
+        set(i, mapSizeY-1, 1.0/3.0 * (    g(i, mapSizeY-2) + 
+                                          g(i-1, mapSizeY-2) +
+                                          g(i + 1, mapSizeY-2) ));
+        set(0, i, 1.0/3.0 * ( g(1, i) + 
+                              g(1, i-1) +
+                              g(1, i+1) ));
+        set(mapSizeX-1, i, 1.0/3.0 * (    g(mapSizeX-2, i) + 
+                                          g(mapSizeX-2, i+1) +
+                                          g(mapSizeX-2, i-1) ));
         
 
     }
     // Calculate the terrain slope of the corners using SMA.
-    map[0][0].grazing = 1.0/3.0 * ( map[1][0].grazing + 
-                                    map[1][1].grazing + 
-                                    map[0][1].grazing
-                                  );
+    set(0, 0, 1.0/3.0 * ( g(1, 0) + 
+                          g(1, 1) +
+                          g(0, 1)
+                        ));
 
-    map[mapSizeX-1][0].grazing = 1.0/3.0 * (    map[mapSizeX-2][0].grazing + 
-                                                map[mapSizeX-2][1].grazing + 
-                                                map[mapSizeX-1][1].grazing
-                                            );
+    set(mapSizeX-1, 0, 1.0/3.0 * (    g(mapSizeX-2, 0) + 
+                                      g(mapSizeX-2, 1) +
+                                      g(mapSizeX-1, 1)
+                                    ));
 
-    map[0][mapSizeY-1].grazing = 1.0/3.0 * (    map[0][mapSizeY-2].grazing + 
-                                                map[1][mapSizeY-2].grazing + 
-                                                map[1][mapSizeY-1].grazing
-                                            );
-    map[mapSizeX-1][mapSizeY-1].grazing = 1.0/3.0 * (   map[mapSizeX-1][mapSizeY-2].grazing + 
-                                                        map[mapSizeX-2][mapSizeY-2].grazing + 
-                                                        map[mapSizeX-2][mapSizeY-1].grazing
-                                            );
+    set(0, mapSizeY-1, 1.0/3.0 * (    g(0, mapSizeY-2) + 
+                                      g(1, mapSizeY-2) +
+                                      g(1, mapSizeY-1)
+                                    ));
+    set(mapSizeX-1, mapSizeY-1, 1.0/3.0 * (   g(mapSizeX-1, mapSizeY-2) + 
+                                              g(mapSizeX-2, mapSizeY-2) +
+                                              g(mapSizeX-2, mapSizeY-1)
+                                            ));
 }
 
 void ElevationMap::populateGrazingAnglePartial(int start, int end) {
-    // Calculate the elevation slope on the map.
-    for (int i = start; i <= end; i++)
-        for (int j = 1; j < mapSizeX - 1; j++) {
-            float h[9];
-            for (int k = 0; k < 9; k++) 
-                h[k] = elevation_map[i + (k%3 - 1)][j + (k/3 - 1)];
-            map[i][j].grazing = atan(   calculateDirectionalDerivative((float*)h, 
-                                        map[i][j].az)) - map[i][j].el;
+    // Calculate the elevation slope on the map, a block of rows and
+    // columns at a time so that the tiles of the tiled layout are
+    // finished one by one.
+    int span = rowSpan();
+    for (int i0 = start; i0 <= end; i0 += span)
+        for (int j0 = 0; j0 < mapSizeY; j0 += span)
+            for (int i = i0; i <= std::min(i0 + span - 1, end); i++)
+                for (int j = std::max(j0, 1); j < std::min(j0 + span, mapSizeY - 1); j++) {
+                    float h[9];
+                    for (int k = 0; k < 9; k++) 
+                        h[k] = heightAt(i + (k%3 - 1), j + (k/3 - 1));
+                    size_t c = cell(i, j);
+                    setGrazing(c, atan( calculateDirectionalDerivative((float*)h, 
+                                        azimuthAt(c))) - elevationAt(c));
+                }
+}
+
+/** ElevationMap::populateGrazingAnglePolar
+ * DESCRIPTION:
+ *      Calculates the grazing angle along rays of the polar grid. Along a
+ *      ray, the directional derivative towards the radar's azimuth is the
+ *      derivative with range, taken from the neighbouring cells (one
+ *      sided at both ends of the ray).
+ * ARGUMENTS:
+ *      int start, end
+ *          The first and last rays.
+ */
+void ElevationMap::populateGrazingAnglePolar(int start, int end) {
+    for (int i = start; i <= end; i++) {
+        size_t c = cell(i, 0);
+        for (int j = 0; j < mapSizeY; j++) {
+            int near = j > 0 ? j - 1 : j;
+            int far = j < mapSizeY - 1 ? j + 1 : j;
+            double slope = far > near ? (heightAt(i, far) - heightAt(i, near)) / ((far - near) * deltaDistance) : 0;
+            setGrazing(c + j, atan(slope) - elevationAt(c + j));
         }
+    }
 }
 
 #ifdef DEBUG_TERRAIN_SLOPE 
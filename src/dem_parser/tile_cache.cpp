@@ -0,0 +1,588 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define TILE_CACHE_MMAP 1
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "dem_parser/tile_cache.h"
+#include "dem_parser/dem_tile.h"
+
+SrtmTile::SrtmTile() {
+    totalPx = 0;
+    bytes = 0;
+    data = NULL;
+    offset = 0;
+    mapped = false;
+    format = TileFormatHgt;
+    checkedRows[0] = checkedRows[1] = 0;
+}
+
+SrtmTile::~SrtmTile() {
+    if (data == NULL)
+        return;
+#ifdef TILE_CACHE_MMAP
+    if (mapped) {
+        munmap(data - offset, bytes + offset);
+        return;
+    }
+#endif
+    free(data);
+}
+
+/** SrtmTile::Decode
+ * DESCRIPTION:
+ *      Copies the full resolution samples of the tile as native int16.
+ */
+void SrtmTile::Decode(std::vector<int16_t>* samples) const {
+    size_t n = (size_t)totalPx * totalPx;
+    samples->resize(n);
+    if (format == TileFormatNative)
+        memcpy(samples->data(), data, n * sizeof(int16_t));
+    else
+        for (size_t i = 0; i < n; i++)
+            (*samples)[i] = (int16_t)((data[2*i] << 8) | data[2*i + 1]);
+}
+
+/** SrtmTile::BuildPyramid
+ * DESCRIPTION:
+ *      Builds the mean of the reduced resolution levels of the tile. Each
+ *      level halves the resolution of the previous one, with a 3x3 tent
+ *      filter. The maximum is built on demand, see BuildMaxPyramid. The
+ *      tile must not have voids.
+ * ARGUMENTS:
+ *      int levelCount
+ *          The number of levels to build. Fewer are built if the tile size
+ *          cannot be halved that many times.
+ */
+void SrtmTile::BuildPyramid(int levelCount) {
+    std::vector<int16_t> base;
+    Decode(&base);
+
+    levels.clear();
+    levels.reserve(levelCount);
+    const int16_t* src = base.data();
+    int srcPx = totalPx;
+    for (int k = 1; k <= levelCount && (srcPx - 1) % 2 == 0; k++) {
+        levels.push_back(pyramid_level_t());
+        pyramid_level_t& level = levels.back();
+        int px = (srcPx - 1) / 2 + 1;
+        level.totalPx = px;
+        level.mean.resize((size_t)px * px);
+        for (int r = 0; r < px; r++)
+            for (int c = 0; c < px; c++) {
+                int sum = 0, weight = 0;
+                for (int dr = -1; dr <= 1; dr++)
+                    for (int dc = -1; dc <= 1; dc++) {
+                        int sr = 2*r + dr, sc = 2*c + dc;
+                        if (sr < 0 || sc < 0 || sr >= srcPx || sc >= srcPx)
+                            continue;
+                        int w = (2 - abs(dr)) * (2 - abs(dc));
+                        sum += w * src[(size_t)sr * srcPx + sc];
+                        weight += w;
+                    }
+                level.mean[(size_t)r * px + c] = (int16_t)floor((double)sum / weight + 0.5);
+            }
+        src = level.mean.data();
+        srcPx = px;
+    }
+}
+
+/** SrtmTile::BuildMaxPyramid
+ * DESCRIPTION:
+ *      Builds the maximum of every level of the pyramid over a 3x3 window
+ *      of the previous one, so that the maximum of a level is never lower
+ *      than the terrain it covers. The tile itself is not changed.
+ * ARGUMENTS:
+ *      std::vector<std::vector<int16_t> >* max
+ *          The maximum of each level, in the order of levels. This will
+ *          be overwritten.
+ */
+void SrtmTile::BuildMaxPyramid(std::vector<std::vector<int16_t> >* max) const {
+    std::vector<int16_t> base;
+    Decode(&base);
+
+    max->assign(levels.size(), std::vector<int16_t>());
+    const int16_t* src = base.data();
+    int srcPx = totalPx;
+    for (size_t k = 0; k < levels.size(); k++) {
+        int px = levels[k].totalPx;
+        std::vector<int16_t>& level = (*max)[k];
+        level.resize((size_t)px * px);
+        for (int r = 0; r < px; r++)
+            for (int c = 0; c < px; c++) {
+                int m = INT16_MIN;
+                for (int sr = std::max(2*r - 1, 0); sr <= std::min(2*r + 1, srcPx - 1); sr++)
+                    for (int sc = std::max(2*c - 1, 0); sc <= std::min(2*c + 1, srcPx - 1); sc++)
+                        m = std::max(m, (int)src[(size_t)sr * srcPx + sc]);
+                level[(size_t)r * px + c] = (int16_t)m;
+            }
+        src = level.data();
+        srcPx = px;
+    }
+}
+
+/** SrtmTile::MemoryUsage
+ * DESCRIPTION:
+ *      Returns the number of bytes held by the tile and its pyramid. The
+ *      maximum counts once it has been built.
+ */
+size_t SrtmTile::MemoryUsage() const {
+    size_t total = bytes;
+    for (size_t k = 0; k < levels.size(); k++)
+        total += (levels[k].mean.size() + levels[k].max.size()) * sizeof(int16_t);
+    return total;
+}
+
+/** FillHgtVoids
+ * DESCRIPTION:
+ *      Fills the voids of a .hgt tile read into the heap, in place, see
+ *      FillVoids. Mapped .hgt tiles are filled by MapTile instead.
+ */
+static void FillHgtVoids(SrtmTile* tile) {
+    size_t n = (size_t)tile->totalPx * tile->totalPx;
+    unsigned char* data = tile->data;
+    size_t i = 0;
+    while (i < n && !(data[2*i] == 0x80 && data[2*i + 1] == 0x00))
+        i++;
+    if (i == n)
+        return;
+
+    std::vector<int16_t> samples(n);
+    for (i = 0; i < n; i++)
+        samples[i] = (int16_t)((data[2*i] << 8) | data[2*i + 1]);
+    std::vector<int16_t> filled(samples);
+    FillVoids(filled.data(), tile->totalPx);
+    for (i = 0; i < n; i++)
+        if (samples[i] == DEM_TILE_VOID) {
+            data[2*i] = (uint16_t)filled[i] >> 8;
+            data[2*i + 1] = (uint16_t)filled[i] & 0xFF;
+        }
+}
+
+TileCache::TileCache() {
+    loads = 0;
+    hits = 0;
+    evictions = 0;
+    budget = (size_t)1024 * 1024 * 1024;
+    bytesInUse = 0;
+    memoryMapped = false;
+    pyramidLevels = 0;
+    footprintLat[0] = -90;
+    footprintLat[1] = 90;
+}
+
+/** TileCache::Instance
+ * DESCRIPTION:
+ *      Returns the cache shared by the whole process.
+ */
+TileCache& TileCache::Instance() {
+    static TileCache cache;
+    return cache;
+}
+
+/** TileCache::Acquire
+ * DESCRIPTION:
+ *      Returns a handle to a tile, loading it from disk if it is not
+ *      already cached. If another thread is loading the same tile, this
+ *      call waits for it instead of reading the file a second time.
+ * ARGUMENTS:
+ *      const std::string& filename
+ *          The path of the tile. This is also the key of the cache entry.
+ *      int latDec
+ *          The latitude of the southern edge of the tile.
+ *      int totalPx
+ *          The number of samples per row and column of the tile.
+ *      bool required
+ *          If true, a missing tile is a fatal error.
+ * RETURNS:
+ *      A reference counted handle to the tile. The tile will not be
+ *      evicted while the handle is held. An empty handle if the tile does
+ *      not exist and is not required.
+ */
+TileCache::TileHandle TileCache::Acquire(const std::string& filename, int latDec, int totalPx, bool required) {
+    std::unique_lock<std::mutex> guard(lock);
+
+    // The rows of the tile the current run reads, north row first. The
+    // pyramid reads the whole tile.
+    size_t rows[2] = {0, (size_t)totalPx};
+    double north = fmin(footprintLat[1], latDec + 1);
+    double south = fmax(footprintLat[0], latDec);
+    if (pyramidLevels == 0 && south <= north) {
+        double pxPerDegree = totalPx - 1;
+        rows[0] = (size_t)floor((latDec + 1 - north) * pxPerDegree);
+        rows[1] = std::min((size_t)ceil((latDec + 1 - south) * pxPerDegree) + 1, (size_t)totalPx);
+    }
+
+    std::map<std::string, entry_t>::iterator it;
+    while ((it = entries.find(filename)) != entries.end()) {
+        if (it->second.loading) {
+            loaded.wait(guard);
+            continue;
+        }
+        if (!it->second.tile && required) {
+            printf("Error opening %s\n", filename.c_str());
+            exit(1);
+        }
+        const SrtmTile* cached = it->second.tile.get();
+        if (cached == NULL || (rows[0] >= cached->checkedRows[0] && rows[1] <= cached->checkedRows[1])) {
+            hits++;
+            lru.splice(lru.begin(), lru, it->second.lruPosition);
+            return it->second.tile;
+        }
+
+        // A mapped .hgt tile loaded for another footprint may have voids
+        // in rows it has not checked. Readers still holding it keep it.
+        bytesInUse -= cached->MemoryUsage();
+        lru.erase(it->second.lruPosition);
+        entries.erase(it);
+        break;
+    }
+
+    // Reserve the entry so that other readers wait for this load.
+    entry_t& e = entries[filename];
+    e.loading = true;
+    lru.push_front(filename);
+    e.lruPosition = lru.begin();
+
+    bool mapTile = memoryMapped;
+    int levels = pyramidLevels;
+    guard.unlock();
+    SrtmTile* tile = mapTile ? MapTile(filename, totalPx, rows[0], rows[1]) 
+                             : LoadTile(filename, totalPx);
+    if (tile == NULL && required) {
+        printf("Error opening %s\n", filename.c_str());
+        exit(1);
+    }
+    if (tile != NULL && tile->format == TileFormatHgt && !tile->mapped)
+        FillHgtVoids(tile);
+    if (tile != NULL && levels > 0)
+        tile->BuildPyramid(levels);
+    guard.lock();
+
+    // Missing tiles are remembered as empty entries.
+    e.tile.reset(tile);
+    e.loading = false;
+    bytesInUse += tile ? tile->MemoryUsage() : 0;
+    loads++;
+    TileHandle handle = e.tile;
+    evict();
+    loaded.notify_all();
+    return handle;
+}
+
+/** TileCache::BuildMaxLevels
+ * DESCRIPTION:
+ *      Builds the maximum of the pyramid of a tile the first time a reader
+ *      asks for it, see SrtmTile::BuildMaxPyramid. Tiles nobody reads the
+ *      maximum of never pay for it. The maximum counts against the budget
+ *      from then on.
+ * ARGUMENTS:
+ *      const TileHandle& handle
+ *          A tile handed out by Acquire.
+ */
+void TileCache::BuildMaxLevels(const TileHandle& handle) {
+    // Every tile is created by the cache, which may change it.
+    SrtmTile* tile = const_cast<SrtmTile*>(handle.get());
+    std::call_once(tile->maxBuilt, [this, tile]() {
+        std::vector<std::vector<int16_t> > max;
+        tile->BuildMaxPyramid(&max);
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t k = 0; k < max.size(); k++) {
+            bytesInUse += max[k].size() * sizeof(int16_t);
+            tile->levels[k].max.swap(max[k]);
+        }
+    });
+}
+
+/** IsDemTile
+ * DESCRIPTION:
+ *      Returns true if the file is a pre-decoded .dem tile, false if it
+ *      is a raw .hgt tile.
+ */
+static bool IsDemTile(const std::string& filename) {
+    return filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".dem") == 0;
+}
+
+/** CheckDemHeader
+ * DESCRIPTION:
+ *      Validates the header of a .dem tile and exits if it does not match
+ *      the expected tile geometry. Readers size the file and its mapping
+ *      from the fixed header, so any other header size is rejected.
+ * RETURNS:
+ *      The offset of the first sample in bytes.
+ */
+static size_t CheckDemHeader(const dem_tile_header_t* header, const std::string& filename, int totalPx) {
+    if (memcmp(header->magic, DEM_TILE_MAGIC, 4) == 0 && header->version != DEM_TILE_VERSION) {
+        printf("Error reading %s: DEM tile version %d, expected %d. Rebuild the cache with --build-dem-cache.\n", 
+               filename.c_str(), header->version, DEM_TILE_VERSION);
+        exit(1);
+    }
+    if (memcmp(header->magic, DEM_TILE_MAGIC, 4) != 0 || 
+        header->version != DEM_TILE_VERSION ||
+        header->sampleType != DEM_TILE_SAMPLE_INT16 ||
+        header->headerSize != sizeof(dem_tile_header_t) ||
+        header->totalPx != totalPx) {
+        printf("Error reading %s: not a %dx%d DEM tile\n", filename.c_str(), totalPx, totalPx);
+        exit(1);
+    }
+    return header->headerSize;
+}
+
+/** TileCache::LoadTile
+ * DESCRIPTION:
+ *      Reads a whole tile from disk. Returns NULL if the tile does not exist.
+ */
+SrtmTile* TileCache::LoadTile(const std::string& filename, int totalPx) {
+    FILE* fd = fopen(filename.c_str(), "rb");
+    if (fd == NULL)
+        return NULL;
+
+    SrtmTile* tile = new SrtmTile();
+    tile->totalPx = totalPx;
+    tile->bytes = (size_t)totalPx * totalPx * 2;
+    if (IsDemTile(filename)) {
+        dem_tile_header_t header;
+        if (fread(&header, sizeof(header), 1, fd) != 1) {
+            printf("Error reading %s\n", filename.c_str());
+            exit(1);
+        }
+        fseek(fd, CheckDemHeader(&header, filename, totalPx), SEEK_SET);
+        tile->format = TileFormatNative;
+    }
+    tile->checkedRows[1] = totalPx;
+    tile->data = (unsigned char*) malloc(tile->bytes);
+    if (fread(tile->data, 1, tile->bytes, fd) != tile->bytes) {
+        printf("Error reading %s\n", filename.c_str());
+        exit(1);
+    }
+    fclose(fd);
+    return tile;
+}
+
+#ifdef TILE_CACHE_MMAP
+/** PatchHgtVoids
+ * DESCRIPTION:
+ *      Fills the voids of a .hgt tile mapped read-only from its file,
+ *      without writing the file or its shared pages: every page of the
+ *      mapping that holds a void is replaced by a private copy with the
+ *      voids filled, see FillVoids. The other pages stay shared with the
+ *      page cache.
+ */
+static void PatchHgtVoids(SrtmTile* tile) {
+    size_t n = (size_t)tile->totalPx * tile->totalPx;
+    const unsigned char* data = tile->data;
+    std::vector<int16_t> samples(n);
+    for (size_t i = 0; i < n; i++)
+        samples[i] = (int16_t)((data[2*i] << 8) | data[2*i + 1]);
+    std::vector<int16_t> filled(samples);
+    FillVoids(filled.data(), tile->totalPx);
+
+    // Samples never straddle a page, the mapping starts at offset 0.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (tile->bytes + page - 1) / page;
+    std::vector<unsigned char> copy;
+    size_t p = 0;
+    while (p < pages) {
+        size_t first = p;
+        while (p < pages) {
+            size_t end = std::min((p + 1) * page, tile->bytes) / 2;
+            bool hasVoid = false;
+            for (size_t i = p * page / 2; i < end && !hasVoid; i++)
+                hasVoid = samples[i] == DEM_TILE_VOID;
+            if (!hasVoid)
+                break;
+            p++;
+        }
+        if (p == first) {
+            p++;
+            continue;
+        }
+
+        // Pages [first, p) hold voids.
+        unsigned char* start = tile->data + first * page;
+        size_t length = (p - first) * page;
+        size_t valid = std::min(p * page, tile->bytes) - first * page;
+        copy.assign(start, start + valid);
+        for (size_t i = first * page / 2; i < first * page / 2 + valid / 2; i++)
+            if (samples[i] == DEM_TILE_VOID) {
+                copy[2*i - first * page] = (uint16_t)filled[i] >> 8;
+                copy[2*i - first * page + 1] = (uint16_t)filled[i] & 0xFF;
+            }
+        if (mmap(start, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            printf("Error mapping the filled voids of a tile\n");
+            exit(1);
+        }
+        memcpy(start, copy.data(), valid);
+        mprotect(start, length, PROT_READ);
+    }
+    tile->checkedRows[0] = 0;
+    tile->checkedRows[1] = tile->totalPx;
+}
+#endif
+
+/** TileCache::MapTile
+ * DESCRIPTION:
+ *      Maps a tile read-only into memory. The pages are shared with the
+ *      kernel page cache, so every thread and every simulator process on
+ *      the machine reading the same tile uses the same physical memory.
+ *      The voids of a .dem tile were filled when it was converted, so its
+ *      pages are never read before they are needed. A .hgt tile is checked
+ *      for voids in the rows the run reads only; if it has any, they are
+ *      filled by PatchHgtVoids. Returns NULL if the tile does not exist.
+ * ARGUMENTS:
+ *      const std::string& filename
+ *          The path of the tile.
+ *      int totalPx
+ *          The number of samples per row and column of the tile.
+ *      size_t firstRow, lastRow
+ *          The rows [firstRow, lastRow) the current run will read, north
+ *          row first. Readahead is requested for these rows only.
+ */
+SrtmTile* TileCache::MapTile(const std::string& filename, int totalPx, size_t firstRow, size_t lastRow) {
+#ifdef TILE_CACHE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    bool dem = IsDemTile(filename);
+    size_t bytes = (size_t)totalPx * totalPx * 2;
+    size_t length = dem ? bytes + sizeof(dem_tile_header_t) : bytes;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < length) {
+        printf("Error reading %s\n", filename.c_str());
+        exit(1);
+    }
+    void* base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Error mapping %s\n", filename.c_str());
+        exit(1);
+    }
+    size_t offset = dem ? CheckDemHeader((const dem_tile_header_t*)base, filename, totalPx) : 0;
+    unsigned char* data = (unsigned char*)base + offset;
+
+    size_t rowBytes = (size_t)totalPx * 2;
+    if (firstRow < lastRow) {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t start = (offset + firstRow * rowBytes) / page * page;
+        size_t end = offset + lastRow * rowBytes;
+        madvise((char*)base + start, end - start, MADV_WILLNEED);
+    }
+
+    SrtmTile* tile = new SrtmTile();
+    tile->totalPx = totalPx;
+    tile->bytes = bytes;
+    tile->data = data;
+    tile->offset = offset;
+    tile->mapped = true;
+    tile->format = dem ? TileFormatNative : TileFormatHgt;
+    tile->checkedRows[0] = dem ? 0 : firstRow;
+    tile->checkedRows[1] = dem ? totalPx : lastRow;
+    if (!dem) {
+        const unsigned char* row = data + firstRow * rowBytes;
+        const unsigned char* end = data + lastRow * rowBytes;
+        for (; row < end; row += 2)
+            if (row[0] == 0x80 && row[1] == 0x00) {
+                PatchHgtVoids(tile);
+                break;
+            }
+    }
+    return tile;
+#else
+    (void)firstRow;
+    (void)lastRow;
+    return LoadTile(filename, totalPx);
+#endif
+}
+
+/** TileCache::evict
+ * DESCRIPTION:
+ *      Releases the least recently used tiles that are no longer held by
+ *      any reader until the cache fits in its budget. Must be called with
+ *      the lock held.
+ */
+void TileCache::evict() {
+    std::list<std::string>::iterator it = lru.end();
+    while (bytesInUse > budget && it != lru.begin()) {
+        --it;
+        std::map<std::string, entry_t>::iterator e = entries.find(*it);
+        if (e->second.loading || e->second.tile.use_count() > 1)
+            continue;
+        bytesInUse -= e->second.tile ? e->second.tile->MemoryUsage() : 0;
+        entries.erase(e);
+        it = lru.erase(it);
+        evictions++;
+    }
+}
+
+/** TileCache::SetBudget
+ * DESCRIPTION:
+ *      Sets the number of bytes the cache may hold before it starts
+ *      releasing unused tiles.
+ */
+void TileCache::SetBudget(size_t bytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    budget = bytes;
+    evict();
+}
+
+size_t TileCache::Budget() {
+    std::lock_guard<std::mutex> guard(lock);
+    return budget;
+}
+
+/** TileCache::SetMemoryMapped
+ * DESCRIPTION:
+ *      Selects whether tiles loaded from now on are mapped from their
+ *      files instead of being copied into the heap.
+ */
+void TileCache::SetMemoryMapped(bool enabled) {
+    std::lock_guard<std::mutex> guard(lock);
+    memoryMapped = enabled;
+}
+
+/** TileCache::SetPyramidLevels
+ * DESCRIPTION:
+ *      Sets the number of reduced resolution levels built for tiles
+ *      loaded from now on. 0 disables the pyramid.
+ */
+void TileCache::SetPyramidLevels(int levels) {
+    std::lock_guard<std::mutex> guard(lock);
+    pyramidLevels = levels;
+}
+
+/** TileCache::SetFootprint
+ * DESCRIPTION:
+ *      Sets the range of latitudes the current run will read. Mapped
+ *      tiles request readahead for the rows in this range only, and
+ *      mapped .hgt tiles are checked for voids in these rows only.
+ */
+void TileCache::SetFootprint(double latMin, double latMax) {
+    std::lock_guard<std::mutex> guard(lock);
+    footprintLat[0] = latMin;
+    footprintLat[1] = latMax;
+}
+
+size_t TileCache::BytesInUse() {
+    std::lock_guard<std::mutex> guard(lock);
+    return bytesInUse;
+}
+
+/** TileCache::Clear
+ * DESCRIPTION:
+ *      Releases every tile that is not currently held by a reader.
+ */
+void TileCache::Clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t b = budget;
+    budget = 0;
+    evict();
+    budget = b;
+}
@@ -0,0 +1,68 @@
+#include "dem_parser/tile_prefetcher.h"
+
+TilePrefetcher::TilePrefetcher() {
+    next = 0;
+}
+
+TilePrefetcher::~TilePrefetcher() {
+    Release();
+}
+
+/** TilePrefetcher::Start
+ * DESCRIPTION:
+ *      Starts loading tiles in the background, in the order given.
+ * ARGUMENTS:
+ *      const std::vector<request_t>& requests
+ *          The tiles to load. Missing tiles are not an error here; they
+ *          are reported when a reader actually needs them.
+ *      int threadCount
+ *          The number of I/O threads.
+ *      size_t byteLimit
+ *          The maximum number of bytes to prefetch. Tiles past this limit
+ *          are left to be loaded on demand.
+ */
+void TilePrefetcher::Start(const std::vector<request_t>& requests, int threadCount, size_t byteLimit) {
+    Release();
+    size_t bytes = 0;
+    for (size_t i = 0; i < requests.size(); i++) {
+        bytes += (size_t)requests[i].totalPx * requests[i].totalPx * 2;
+        if (bytes > byteLimit)
+            break;
+        queue.push_back(requests[i]);
+    }
+    handles.resize(queue.size());
+    next = 0;
+    for (int i = 0; i < threadCount && i < (int)queue.size(); i++)
+        threads.push_back(std::thread(&TilePrefetcher::Worker, this));
+}
+
+/** TilePrefetcher::Worker
+ * DESCRIPTION:
+ *      Loads queued tiles until the queue is empty.
+ */
+void TilePrefetcher::Worker() {
+    TileCache& cache = TileCache::Instance();
+    for (size_t i = next++; i < queue.size(); i = next++)
+        handles[i] = cache.Acquire(queue[i].filename, queue[i].latDec, queue[i].totalPx, false);
+}
+
+/** TilePrefetcher::Wait
+ * DESCRIPTION:
+ *      Waits for every queued tile to be loaded.
+ */
+void TilePrefetcher::Wait() {
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    threads.clear();
+}
+
+/** TilePrefetcher::Release
+ * DESCRIPTION:
+ *      Waits for the background loads, then drops the handles to the
+ *      prefetched tiles, allowing the cache to evict them again.
+ */
+void TilePrefetcher::Release() {
+    Wait();
+    handles.clear();
+    queue.clear();
+}
@@ -0,0 +1,333 @@
+#include "dem_parser/dem_parser.h"
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "thread_pool.h"
+using std::vector;
+
+// Runs of sectors of the sweep per thread, so that threads can steal them,
+// and cells per sector at most, which bounds the events held at once.
+static const int sweepSectors = 16;
+static const double sectorCells = 16384;
+// Events per bucket of angle when ordering the events of a sector.
+static const size_t eventsPerBucket = 4;
+// Cells of a ring a ray meets at once. The ray crosses the band of ring k,
+// from Chebyshev distance k - 1/2 to k + 1/2, while its other coordinate
+// changes by at most 1/2 + 1/2: it meets at most two cells along a side of
+// the ring, and three where it passes a corner. A cell that leaves at the
+// angle another enters is still held when it enters, which makes four.
+// Should rounding ever put one more in a ring, the slots grow.
+static const int ringSlots = 4;
+
+// The events of a cell: the ray reaches it, passes through its center and
+// leaves it. Events at the same angle are taken in this order, so that a
+// cell touched by the ray at a corner is in front of the cells behind it.
+enum sweep_event_type_t { SweepEnter = 0, SweepCenter = 1, SweepExit = 2 };
+
+typedef struct sweep_event_t {
+    double angle;
+    // The kind of event in the top bits, and the ring.
+    uint32_t typeRing;
+    // The position of the cell along the ring.
+    uint32_t t;
+    bool operator<(const sweep_event_t& e) const {
+        return angle != e.angle ? angle < e.angle : (typeRing >> 30) < (e.typeRing >> 30);
+    }
+} sweep_event_t;
+
+// Ring bits of typeRing.
+static const uint32_t ringMask = (1u << 30) - 1;
+
+/* Returns the cell at position t of ring k, from the origin. Positions run
+ * counterclockwise from (k, 0) and back to it at t = 8k. */
+static void RingCell(int k, int t, int* x, int* y) {
+    if (t <= k)          { *x = k;          *y = t; }
+    else if (t <= 3 * k) { *x = 2 * k - t;  *y = k; }
+    else if (t <= 5 * k) { *x = -k;         *y = 4 * k - t; }
+    else if (t <= 7 * k) { *x = t - 6 * k;  *y = -k; }
+    else                 { *x = k;          *y = t - 8 * k; }
+}
+
+/* Returns the angle of an event of the cell at position t of ring k, as
+ * a diamond angle: from 0 to 4 counterclockwise from the +x axis, in the
+ * same order as the angle but without trigonometry. It is in [0, 4) but
+ * for the cell straddling angle 0: it enters at a negative angle at t = 0,
+ * and comes back past 4 at t = 8k. Along a ring, each kind of event is in
+ * increasing order. */
+static double EventAngle(int k, int t, int type) {
+    int x, y;
+    RingCell(k, t, &x, &y);
+    double sx = (x > 0) - (x < 0), sy = (y > 0) - (y < 0);
+    double ax = x, ay = y;
+    // The cell is entered and left at the corners of its silhouette; on
+    // the axes, at the corners nearest to the origin.
+    if (type == SweepEnter) {
+        ax += y ? 0.5 * sy : -0.5 * sx;
+        ay += x ? -0.5 * sx : -0.5 * sy;
+    } else if (type == SweepExit) {
+        ax += y ? -0.5 * sy : -0.5 * sx;
+        ay += x ? 0.5 * sx : -0.5 * sy;
+    }
+    double angle = ay / (fabs(ax) + fabs(ay));
+    if (ax < 0)
+        angle = 2 - angle;
+    else if (ay < 0)
+        angle += 4;
+    if (t == 0 && type == SweepEnter)
+        angle -= 4;
+    else if (t == 8 * k && type != SweepEnter)
+        angle += 4;
+    return angle;
+}
+
+/* Returns the first position of ring k whose event of a type is at or past
+ * an angle, or 8k + 1 if there is none. */
+static int FirstEvent(int k, int type, double angle) {
+    int low = 0, high = 8 * k + 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (EventAngle(k, mid, type) < angle)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/** ElevationMap::calculateShadowingSweep
+ * DESCRIPTION:
+ *      Shadows a Cartesian map with a radial sweep viewshed, after Van
+ *      Kreveld: a ray turns around the radar, and a cell is shadowed if
+ *      the highest elevation angle of the cells the ray meets between the
+ *      radar and the cell's center is more than 5 degrees above its own,
+ *      the test of calculateShadowingAlongLine. Every cell is tested, and
+ *      against every cell in front of it rather than those of a Bresenham
+ *      line.
+ *
+ *      Cells are grouped in square rings around the radar. A ray meets
+ *      the cells of a ring after those of the rings inside it, so the
+ *      cells in front of a center are those of the inner rings met by the
+ *      ray. The cells met are kept per ring, under a max tree over rings
+ *      answering the highest of the inner rings. Each cell is visited three
+ *      times: when the ray reaches it, passes its center and leaves it.
+ *
+ *      The sweep is cut into sectors of angle, small enough for their
+ *      events to be sorted in cache, and the sectors into a few runs per
+ *      thread of the pool. A run starts with the cells met by its first
+ *      ray, found by bisection along each ring, then carries them and the
+ *      position reached along each ring from one sector to the next, so
+ *      that setting a run up costs the same whatever the radius.
+ */
+void ElevationMap::calculateShadowingSweep() {
+    int rings = std::max(std::max(mapOriginX, mapSizeX - 1 - mapOriginX),
+                         std::max(mapOriginY, mapSizeY - 1 - mapOriginY));
+    // Rings past the radius hold no cell in range.
+    rings = std::min(rings, mapRangeMax + 1);
+    int runs = ThreadPool::Instance().Size() * sweepSectors;
+    int sectors = std::max(runs, (int)ceil(M_PI * rings * rings / sectorCells));
+    ThreadPool::Instance().ParallelFor(0, sectors - 1, (sectors + runs - 1) / runs,
+                                       [this, rings, sectors](int start, int end) {
+        calculateShadowingSectors(rings, sectors, start, end);
+    });
+}
+
+/** ElevationMap::calculateShadowingSectors
+ * DESCRIPTION:
+ *      Sweeps the centers of cells of a run of sectors, see
+ *      calculateShadowingSweep.
+ * ARGUMENTS:
+ *      int rings
+ *          The outermost ring.
+ *      int sectors
+ *          The number of sectors of the sweep. Sector s holds the centers
+ *          from diamond angle 4 s / sectors up to, but not at, that of
+ *          sector s + 1, see EventAngle.
+ *      int start, end
+ *          The first and last sectors of the run.
+ */
+void ElevationMap::calculateShadowingSectors(int rings, int sectors, int start, int end) {
+    int size = 1;
+    while (size < rings + 1)
+        size <<= 1;
+    // Max tree of the elevation angles of the cells met, per ring. The
+    // origin is always met.
+    vector<float> tree(2 * size, -HUGE_VALF);
+    // Cells of each ring met by the ray, slots per ring.
+    int slots = ringSlots;
+    vector<size_t> slotCells((size_t)(rings + 1) * slots);
+    vector<float> slotEl((size_t)(rings + 1) * slots);
+    vector<int> slotCount(rings + 1, 0);
+    // The next position of each kind of event along each ring.
+    vector<int> cursor(3 * (size_t)(rings + 1));
+    // The rings with events in each sector of the run, by the sector of
+    // their next event.
+    vector<vector<int> > due(end - start + 1);
+
+    auto bound = [sectors](int s) { return 4.0 * s / sectors; };
+    auto setRing = [&](int k, float el) {
+        size_t i = size + k;
+        tree[i] = el;
+        for (i >>= 1; i > 0; i >>= 1)
+            tree[i] = std::max(tree[2 * i], tree[2 * i + 1]);
+    };
+    // Highest elevation angle of rings 0 to k - 1.
+    auto innerMax = [&](int k) {
+        float best = -HUGE_VALF;
+        for (size_t l = size, r = size + k; l < r; l >>= 1, r >>= 1) {
+            if (l & 1)
+                best = std::max(best, tree[l++]);
+            if (r & 1)
+                best = std::max(best, tree[--r]);
+        }
+        return best;
+    };
+    // The map cell at position t of ring k, or false if outside the map
+    // or out of range.
+    auto ringMapCell = [&](int k, int t, size_t* c) {
+        int x, y;
+        RingCell(k, t, &x, &y);
+        x += mapOriginX;
+        y += mapOriginY;
+        if (x < 0 || x >= mapSizeX || y < 0 || y >= mapSizeY)
+            return false;
+        *c = cell(x, y);
+        return !(planes.shadowed[*c] & (0x01 << 1));
+    };
+    // Doubles the slots of every ring.
+    auto grow = [&]() {
+        vector<size_t> cells((size_t)(rings + 1) * 2 * slots);
+        vector<float> el((size_t)(rings + 1) * 2 * slots);
+        for (size_t k = 0; k <= (size_t)rings; k++)
+            for (int i = 0; i < slotCount[k]; i++) {
+                cells[k * 2 * slots + i] = slotCells[k * slots + i];
+                el[k * 2 * slots + i] = slotEl[k * slots + i];
+            }
+        slotCells.swap(cells);
+        slotEl.swap(el);
+        slots *= 2;
+    };
+    auto enter = [&](int k, size_t c) {
+        int& n = slotCount[k];
+        if (n == slots)
+            grow();
+        float el = elevationAt(c);
+        slotCells[(size_t)k * slots + n] = c;
+        slotEl[(size_t)k * slots + n] = el;
+        n++;
+        if (el > tree[size + k])
+            setRing(k, el);
+    };
+    auto leave = [&](int k, size_t c) {
+        int& n = slotCount[k];
+        size_t* cells = &slotCells[(size_t)k * slots];
+        float* el = &slotEl[(size_t)k * slots];
+        float best = -HUGE_VALF;
+        for (int i = 0; i < n; i++) {
+            if (cells[i] == c) {
+                cells[i] = cells[--n];
+                el[i] = el[n];
+                i--;
+                continue;
+            }
+            best = std::max(best, el[i]);
+        }
+        setRing(k, best);
+    };
+    // Queues ring k in the sector of the run holding its next event, if
+    // any.
+    auto schedule = [&](int k) {
+        double next = HUGE_VAL;
+        for (int type = 0; type < 3; type++)
+            if (cursor[3 * k + type] <= 8 * k)
+                next = std::min(next, EventAngle(k, cursor[3 * k + type], type));
+        if (next >= bound(end + 1))
+            return;
+        int s = std::max(start, std::min(end, (int)(next * sectors / 4)));
+        while (s < end && next >= bound(s + 1))
+            s++;
+        while (s > start && next < bound(s))
+            s--;
+        due[s - start].push_back(k);
+    };
+
+    // The events of the sector, in the order of the sweep.
+    vector<sweep_event_t> events, sorted;
+    vector<uint32_t> bucketStart, fill;
+    // Adds the events of a kind of ring k before an angle, and moves the
+    // ring on past them.
+    auto add = [&](int k, int type, double last) {
+        size_t c;
+        int& t = cursor[3 * k + type];
+        for (; t <= 8 * k; t++) {
+            double angle = EventAngle(k, t, type);
+            if (angle >= last)
+                return;
+            if (ringMapCell(k, t, &c)) {
+                sweep_event_t e = { angle, (uint32_t)type << 30 | (uint32_t)k, (uint32_t)t };
+                events.push_back(e);
+            }
+        }
+    };
+
+    setRing(0, elevationAt(cell(mapOriginX, mapOriginY)));
+    double first = bound(start);
+    for (int k = 1; k <= rings; k++) {
+        // The cells met by the first ray have entered and not left.
+        int entered = FirstEvent(k, SweepEnter, first);
+        int left = FirstEvent(k, SweepExit, first);
+        size_t c;
+        for (int t = left; t < entered; t++)
+            if (ringMapCell(k, t, &c))
+                enter(k, c);
+        cursor[3 * k + SweepEnter] = entered;
+        cursor[3 * k + SweepCenter] = FirstEvent(k, SweepCenter, first);
+        cursor[3 * k + SweepExit] = left;
+        schedule(k);
+    }
+
+    for (int s = start; s <= end; s++) {
+        double from = bound(s), last = bound(s + 1);
+        events.clear();
+        vector<int> ringsDue;
+        ringsDue.swap(due[s - start]);
+        for (size_t r = 0; r < ringsDue.size(); r++) {
+            int k = ringsDue[r];
+            add(k, SweepEnter, last);
+            add(k, SweepCenter, last);
+            add(k, SweepExit, last);
+            schedule(k);
+        }
+        // Partition the events by angle into buckets of a few events,
+        // which leaves only the buckets to sort: the events of a sector
+        // are spread evenly over its angle.
+        size_t buckets = events.size() / eventsPerBucket + 1;
+        double scale = buckets / (last - from);
+        auto bucketOf = [&](double angle) {
+            return std::min(buckets - 1, (size_t)std::max(0.0, (angle - from) * scale));
+        };
+        bucketStart.assign(buckets + 1, 0);
+        sorted.resize(events.size());
+        for (size_t i = 0; i < events.size(); i++)
+            bucketStart[bucketOf(events[i].angle) + 1]++;
+        for (size_t b = 0; b < buckets; b++)
+            bucketStart[b + 1] += bucketStart[b];
+        fill.assign(bucketStart.begin(), bucketStart.end() - 1);
+        for (size_t i = 0; i < events.size(); i++)
+            sorted[fill[bucketOf(events[i].angle)]++] = events[i];
+        for (size_t b = 0; b < buckets; b++)
+            std::sort(sorted.begin() + bucketStart[b], sorted.begin() + bucketStart[b + 1]);
+        events.swap(sorted);
+
+        for (size_t i = 0; i < events.size(); i++) {
+            int type = events[i].typeRing >> 30, k = events[i].typeRing & ringMask;
+            size_t c = 0;
+            ringMapCell(k, events[i].t, &c);
+            if (type == SweepEnter)
+                enter(k, c);
+            else if (type == SweepExit)
+                leave(k, c);
+            else if ((innerMax(k) - 5 * 3.141592 / 180.0) > elevationAt(c))
+                planes.shadowed[c] |= (0x01);
+        }
+    }
+}
@@ -6,11 +6,13 @@ using std::cout;
 using std::endl;
 
 #include <fstream>
-#include <thread>
+#include <vector>
+#include <algorithm>
 #include "echo_sim/echo_sim.h"
 #include "echo_sim/clutter_coefficient.h"
 #include "echo_sim/antenna_pattern.h"
 #include "options.h"
+#include "thread_pool.h"
 
 
 EchoSimulator::EchoSimulator(options_t* O){
@@ -28,68 +30,294 @@ EchoSimulator::EchoSimulator(options_t* O){
 }
 
 void EchoSimulator::PopulateAttenTable() {
+    if (map->isStreaming()) {
+        PopulateAttenTableStreaming();
+        return;
+    }
+    if (map->isFused()) {
+        PopulateAttenTableFused();
+        return;
+    }
     map->populateMap();
     AllocateAttenTable();
     if (Options->PROG_VERBOSE)
        cout << "Power table allocated." << endl; 
-    int threadCount = Options->SIMULATOR_THREAD_COUNT;
-    std::thread threads[threadCount];
-    float mapDelta = float(map->mapSizeX-1)/float(threadCount);
-    threads[0] = std::thread(&EchoSimulator::PopulateAttenTablePartial, this, 0, int(mapDelta));
-    for (int i = 1; i < threadCount; i++) 
-        threads[i] = std::thread(   &EchoSimulator::PopulateAttenTablePartial,this, 
-                                    int(mapDelta*i)+1,
-                                    int(mapDelta*(i+1))
-                                    );
-    for (int i = 0; i < threadCount; i++)
-        threads[i].join();
+    // The rows of a polar map are rays, summed per azimuth bin before the
+    // antenna pattern: split the bins rather than the rows.
+    if (map->isPolar()) {
+        int raysPerBin = std::max(1, map->mapSizeX / azimuthCount);
+        PopulateAttenTableThreads(&EchoSimulator::PopulateAttenTablePolar, 0,
+                                  (map->mapSizeX + raysPerBin - 1) / raysPerBin - 1);
+    } else {
+        // Only the cells that are visible and within the radius add
+        // echoes, and there are fewer of them in the rows far from the
+        // radar.
+        std::vector<double> weight(map->mapSizeX);
+        for (int i = 0; i < map->mapSizeX; i++)
+            weight[i] = map->visibleCells(i) + 1;
+        PopulateAttenTableThreads(&EchoSimulator::PopulateAttenTablePartial, 0, map->mapSizeX - 1, &weight);
+    }
+    if (Options->PROG_VERBOSE)
+        ThreadPool::Instance().Report("Echoes");
+}
+
+/** EchoSimulator::PopulateAttenTableStreaming
+ * DESCRIPTION:
+ *      Adds the echoes of a streamed map, a wedge at a time: each wedge
+ *      is accumulated before the map moves on to the next one. Wedges
+ *      are made of whole azimuth bins.
+ */
+void EchoSimulator::PopulateAttenTableStreaming() {
+    map->beginStream();
+    AllocateAttenTable();
+    if (Options->PROG_VERBOSE)
+       cout << "Power table allocated." << endl; 
+    int raysPerBin = std::max(1, map->mapSizeX / azimuthCount);
+    int first, last;
+    while (map->nextWedge(&first, &last))
+        PopulateAttenTableThreads(&EchoSimulator::PopulateAttenTablePolar, first / raysPerBin, last / raysPerBin);
+    if (Options->PROG_VERBOSE)
+        ThreadPool::Instance().Report("Map and echoes");
+}
+
+/** EchoSimulator::PopulateAttenTableThreads
+ * DESCRIPTION:
+ *      Splits rows of the map, or azimuth bins of a polar map, between the
+ *      threads of the pool, a few at a time.
+ * ARGUMENTS:
+ *      void (EchoSimulator::*partial)(int, int)
+ *          The function accumulating a range of rows.
+ *      int first, last
+ *          The first and last rows.
+ *      const std::vector<double>* weight
+ *          The work of each row from first, to cut the rows into tiles
+ *          of equal work, or NULL for tiles of equal rows.
+ */
+void EchoSimulator::PopulateAttenTableThreads(void (EchoSimulator::*partial)(int, int), int first, int last,
+                                              const std::vector<double>* weight) {
+    auto body = [this, partial](int start, int end) { (this->*partial)(start, end); };
+    if (weight)
+        ThreadPool::Instance().WeightedFor(first, last, *weight, body);
+    else
+        ThreadPool::Instance().ParallelFor(first, last, 4, body);
 }
 
 
 void EchoSimulator::PopulateAttenTablePartial(int start, int end) {
-    for (int j = start; j <= end; j++) {
-        for (int i = 0; i < map->mapSizeX; i++) {
-            
-            chunk_t chunk = map->getMap(i,j);
-            if (chunk.shadowed == 0) { 
-                float time1 = chunk.r*2.0/Options->SIMULATOR_WAVE_SPEED;
-                int RangeBinStart = time1/rangeBinPeriod;
-                int RangeBinEnd = (time1 + pulseInterval)/rangeBinPeriod;
-                // Isotropic Power = Radar equation without antenna gains.
-                double IsotropicPower = ERP;
+    // Walk the map a row at a time, reading only the planes used here,
+    // in spans of contiguous cells.
+    int span = map->rowSpan();
+    // Room for the spans of a compact map, converted to float.
+    std::vector<float> buffers(4 * span);
+    for (int i = start; i <= end; i++) {
+        for (int j0 = 0; j0 < map->mapSizeY; j0 += span) {
+            int n = std::min(span, map->mapSizeY - j0);
+            const float* r = map->rangeRow(i, j0, n, &buffers[0]);
+            const float* az = map->azimuthRow(i, j0, n, &buffers[span]);
+            const float* el = map->elevationRow(i, j0, n, &buffers[2 * span]);
+            const uint8_t* shadowed = map->shadowedRow(i, j0);
+            const float* grazing = map->grazingRow(i, j0, n, &buffers[3 * span]);
+            for (int k = 0; k < n; k++) {
+                if (shadowed[k] == 0) { 
+                    float time1 = r[k]*2.0/Options->SIMULATOR_WAVE_SPEED;
+                    int RangeBinStart = time1/rangeBinPeriod;
+                    int RangeBinEnd = (time1 + pulseInterval)/rangeBinPeriod;
+                    // Isotropic Power = Radar equation without antenna gains.
+                    double IsotropicPower = ERP;
                 
-                // Wavelength in meters.
-                double wavelength = Options->SIMULATOR_WAVE_SPEED/Options->SIMULATOR_TRANSMIT_FREQUENCY;
-                IsotropicPower *= pow(wavelength,2);
+                    // Wavelength in meters.
+                    double wavelength = Options->SIMULATOR_WAVE_SPEED/Options->SIMULATOR_TRANSMIT_FREQUENCY;
+                    IsotropicPower *= pow(wavelength,2);
                 
-                // Radar Cross Section = A * sigma0
-                IsotropicPower *= (30*30);
-                IsotropicPower *= calculateClutterCoefficient(TerrainRural, chunk.grazing);
+                    // Radar Cross Section = A * sigma0
+                    IsotropicPower *= map->cellArea(i, j0 + k);
+                    IsotropicPower *= calculateClutterCoefficient(TerrainRural, grazing[k]);
                 
-                // 1/R^4, 1/(4pi)^3
-                IsotropicPower /= (pow(chunk.r,4)*pow(4*M_PI,3));
-                assert(IsotropicPower >= 0.0);
-                AddPowerReceived(   IsotropicPower * (1+RangeBinStart - time1/rangeBinPeriod),
-                                    chunk.az,
-                                    chunk.el,
-                                    RangeBinStart,RangeBinStart);
-                AddPowerReceived(   IsotropicPower*(-1*RangeBinEnd + (time1+pulseInterval)/rangeBinPeriod),
-                                    chunk.az,
-                                    chunk.el,
-                                    RangeBinEnd,RangeBinEnd);
-                AddPowerReceived(IsotropicPower, chunk.az, chunk.el, RangeBinStart + 1, RangeBinEnd-1);
+                    // 1/R^4, 1/(4pi)^3
+                    IsotropicPower /= (pow(r[k],4)*pow(4*M_PI,3));
+                    assert(IsotropicPower >= 0.0);
+                    AddPowerReceived(   IsotropicPower * (1+RangeBinStart - time1/rangeBinPeriod),
+                                        az[k],
+                                        el[k],
+                                        RangeBinStart,RangeBinStart);
+                    AddPowerReceived(   IsotropicPower*(-1*RangeBinEnd + (time1+pulseInterval)/rangeBinPeriod),
+                                        az[k],
+                                        el[k],
+                                        RangeBinEnd,RangeBinEnd);
+                    AddPowerReceived(IsotropicPower, az[k], el[k], RangeBinStart + 1, RangeBinEnd-1);
+                }
             }
         }
     }
+}
+
+/** EchoSimulator::PopulateAttenTablePolar
+ * DESCRIPTION:
+ *      Adds the echoes of a polar map, an azimuth bin at a time. The rays
+ *      of a bin only differ in azimuth by less than the resolution of the
+ *      table, so the power of their cells is first summed per range bin,
+ *      with the power weighted mean of their azimuth and elevation angles,
+ *      and the antenna pattern is applied once per azimuth and range bin
+ *      rather than three times per cell, see AccumulatePolar.
+ * ARGUMENTS:
+ *      int start, end
+ *          The first and last azimuth bins.
+ */
+void EchoSimulator::PopulateAttenTablePolar(int start, int end) {
+    std::vector<double> edge(polarPlanes*(rangeBinCount + 1)), run(polarPlanes*(rangeBinCount + 1));
+    int raysPerBin = std::max(1, map->mapSizeX / azimuthCount);
+    int n = map->mapSizeY;
+    std::vector<float> buffers(4 * n);
+    for (int bin = start; bin <= end; bin++) {
+        std::fill(edge.begin(), edge.end(), 0.0);
+        std::fill(run.begin(), run.end(), 0.0);
+        // Azimuths are taken relative to the first ray of the bin, so that
+        // the bin at +-pi does not average to 0.
+        float azRef = map->azimuthRow(bin*raysPerBin, 0, 1, &buffers[0])[0];
+        for (int i = bin*raysPerBin; i < (bin+1)*raysPerBin && i < map->mapSizeX; i++) {
+            const float* r = map->rangeRow(i, 0, n, &buffers[0]);
+            const float* az = map->azimuthRow(i, 0, n, &buffers[n]);
+            const float* el = map->elevationRow(i, 0, n, &buffers[2 * n]);
+            const uint8_t* shadowed = map->shadowedRow(i);
+            const float* grazing = map->grazingRow(i, 0, n, &buffers[3 * n]);
+            AccumulatePolar(i, 0, n, r, az, el, shadowed, grazing, azRef, &edge[0], &run[0]);
+        }
+        AddPolarBin(azRef, &edge[0], &run[0]);
+    }
+}
+
+/** EchoSimulator::PopulateAttenTableFused
+ * DESCRIPTION:
+ *      Adds the echoes of a polar map that is never stored: each thread
+ *      produces the rays of its azimuth bins a tile at a time, see
+ *      ElevationMap::nextRayTile, and accumulates each tile while it is
+ *      still in cache, as PopulateAttenTablePolar does for stored rays.
+ */
+void EchoSimulator::PopulateAttenTableFused() {
+    map->beginFused();
+    AllocateAttenTable();
     if (Options->PROG_VERBOSE)
-        cout << ".";
+       cout << "Power table allocated." << endl;
+    int raysPerBin = std::max(1, map->mapSizeX / azimuthCount);
+    int bins = (map->mapSizeX + raysPerBin - 1) / raysPerBin;
+    ThreadPool::Instance().ParallelFor(0, bins - 1, 4, [this, raysPerBin](int start, int end) {
+        std::vector<double> edge(polarPlanes*(rangeBinCount + 1)), run(polarPlanes*(rangeBinCount + 1));
+        RayTile tile;
+        for (int bin = start; bin <= end; bin++) {
+            std::fill(edge.begin(), edge.end(), 0.0);
+            std::fill(run.begin(), run.end(), 0.0);
+            float azRef = 0;
+            for (int i = bin*raysPerBin; i < (bin+1)*raysPerBin && i < map->mapSizeX; i++) {
+                map->beginRay(&tile, i);
+                while (map->nextRayTile(&tile)) {
+                    if (i == bin*raysPerBin && tile.first == 0)
+                        azRef = tile.az[0];
+                    AccumulatePolar(i, tile.first, tile.n, &tile.r[0], &tile.az[0], &tile.el[0],
+                                    &tile.shadowed[0], &tile.grazing[0], azRef, &edge[0], &run[0]);
+                }
+            }
+            AddPolarBin(azRef, &edge[0], &run[0]);
+        }
+    });
+    map->endFused();
+    if (Options->PROG_VERBOSE)
+        ThreadPool::Instance().Report("Map and echoes");
+}
+
+/** EchoSimulator::AccumulatePolar
+ * DESCRIPTION:
+ *      Sums the power of cells of a polar ray per range bin. The pulse of
+ *      a cell covers a run of range bins, kept as a difference array.
+ * ARGUMENTS:
+ *      int i, j0, n
+ *          The ray, its first cell and the number of cells.
+ *      const float* r, az, el, grazing
+ *      const uint8_t* shadowed
+ *          The fields of the cells.
+ *      float azRef
+ *          The azimuth the angles of the bin are taken relative to.
+ *      double* edge, run
+ *          Per range bin: power, power * azimuth and power * elevation of
+ *          the partially covered bins, then of the fully covered runs, as
+ *          differences.
+ */
+void EchoSimulator::AccumulatePolar(int i, int j0, int n, const float* r, const float* az, const float* el,
+                                    const uint8_t* shadowed, const float* grazing, float azRef,
+                                    double* edge, double* run) {
+    const int planes = polarPlanes;
+    double wavelength = Options->SIMULATOR_WAVE_SPEED/Options->SIMULATOR_TRANSMIT_FREQUENCY;
+    for (int j = 0; j < n; j++) {
+        if (shadowed[j] != 0)
+            continue;
+        float time1 = r[j]*2.0/Options->SIMULATOR_WAVE_SPEED;
+        int RangeBinStart = time1/rangeBinPeriod;
+        int RangeBinEnd = (time1 + pulseInterval)/rangeBinPeriod;
+        if (RangeBinStart >= rangeBinCount)
+            continue;
+        // Same radar equation as PopulateAttenTablePartial.
+        double IsotropicPower = ERP * pow(wavelength,2) * map->cellArea(i, j0 + j);
+        IsotropicPower *= calculateClutterCoefficient(TerrainRural, grazing[j]);
+        IsotropicPower /= (pow(r[j],4)*pow(4*M_PI,3));
+        assert(IsotropicPower >= 0.0);
+        double dAz = az[j] - azRef;
+        if (dAz > M_PI)
+            dAz -= 2*M_PI;
+        else if (dAz < -M_PI)
+            dAz += 2*M_PI;
+
+        double first = IsotropicPower * (1+RangeBinStart - time1/rangeBinPeriod);
+        edge[planes*RangeBinStart] += first;
+        edge[planes*RangeBinStart + 1] += first * dAz;
+        edge[planes*RangeBinStart + 2] += first * el[j];
+        if (RangeBinEnd < rangeBinCount) {
+            double last = IsotropicPower*(-1*RangeBinEnd + (time1+pulseInterval)/rangeBinPeriod);
+            edge[planes*RangeBinEnd] += last;
+            edge[planes*RangeBinEnd + 1] += last * dAz;
+            edge[planes*RangeBinEnd + 2] += last * el[j];
+        }
+        int runEnd = std::min(RangeBinEnd, (int)rangeBinCount);
+        if (RangeBinStart + 1 < runEnd) {
+            run[planes*(RangeBinStart + 1)] += IsotropicPower;
+            run[planes*(RangeBinStart + 1) + 1] += IsotropicPower * dAz;
+            run[planes*(RangeBinStart + 1) + 2] += IsotropicPower * el[j];
+            run[planes*runEnd] -= IsotropicPower;
+            run[planes*runEnd + 1] -= IsotropicPower * dAz;
+            run[planes*runEnd + 2] -= IsotropicPower * el[j];
+        }
+    }
+}
+
+/** EchoSimulator::AddPolarBin
+ * DESCRIPTION:
+ *      Adds the power summed by AccumulatePolar for an azimuth bin to the
+ *      table, through the antenna pattern once per range bin.
+ * ARGUMENTS:
+ *      float azRef
+ *          See AccumulatePolar.
+ *      const double* edge, run
+ *          See AccumulatePolar.
+ */
+void EchoSimulator::AddPolarBin(float azRef, const double* edge, const double* run) {
+    const int planes = polarPlanes;
+    double power = 0, powerAz = 0, powerEl = 0;
+    for (int b = 0; b < rangeBinCount; b++) {
+        power += run[planes*b];
+        powerAz += run[planes*b + 1];
+        powerEl += run[planes*b + 2];
+        double watts = power + edge[planes*b];
+        if (watts > 0)
+            AddPowerReceived(   watts,
+                                azRef + (powerAz + edge[planes*b + 1]) / watts,
+                                (powerEl + edge[planes*b + 2]) / watts,
+                                b, b);
+    }
 }
 
 void EchoSimulator::AllocateAttenTable() {
     attenTable = new double* [rangeBinCount];
     mutexTable = new std::mutex [rangeBinCount];
     for (int i = 0; i < rangeBinCount; i++)
-        attenTable[i] = new double [azimuthCount];
+        attenTable[i] = new double [azimuthCount]();
 }
 
 float EchoSimulator::GetRotatedAzimuthAngle(float az, int azBin) {
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+    #define NUMA_TOPOLOGY_SYSFS 1
+    #include <sched.h>
+    #include <unistd.h>
+    #include <sys/syscall.h>
+    #include <linux/mempolicy.h>
+#endif
+
+#include "numa_topology.h"
+
+// Pages queried per move_pages call.
+static const size_t residentBatch = 4096;
+
+#ifdef NUMA_TOPOLOGY_SYSFS
+/* Parses a sysfs CPU or node list, such as "0-3,8-11". */
+static std::vector<int> ParseList(const std::string& list) {
+    std::vector<int> items;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        int first, last;
+        int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (fields < 1)
+            continue;
+        if (fields == 1)
+            last = first;
+        for (int i = first; i <= last; i++)
+            items.push_back(i);
+    }
+    return items;
+}
+
+/* Reads the first line of a sysfs file, or returns an empty string. */
+static std::string ReadLine(const std::string& path) {
+    std::ifstream file(path.c_str());
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+/* Reads an integer from a sysfs file, or returns fallback. */
+static int ReadInt(const std::string& path, int fallback) {
+    std::string line = ReadLine(path);
+    return line.empty() ? fallback : atoi(line.c_str());
+}
+
+/* Sets the memory policy of a range of pages over a set of sysfs node
+ * ids. */
+static bool SetPolicy(void* addr, size_t bytes, int mode, const std::vector<int>& nodes) {
+    // The kernel reads maxnode - 1 bits of the mask.
+    const int bits = 8 * sizeof(unsigned long);
+    int top = *std::max_element(nodes.begin(), nodes.end());
+    std::vector<unsigned long> mask(top / bits + 1, 0);
+    for (size_t i = 0; i < nodes.size(); i++)
+        mask[nodes[i] / bits] |= 1UL << (nodes[i] % bits);
+    return syscall(SYS_mbind, addr, bytes, mode, mask.data(),
+                   (unsigned long)(mask.size() * bits + 1), 0UL) == 0;
+}
+#endif
+
+/** NumaTopology::NumaTopology
+ * DESCRIPTION:
+ *      Reads the online nodes and the CPUs of each, and orders the CPUs
+ *      of a node by SMT sibling, then by package and core.
+ */
+NumaTopology::NumaTopology() {
+#ifdef NUMA_TOPOLOGY_SYSFS
+    std::string base = "/sys/devices/system/";
+    std::vector<int> nodes = ParseList(ReadLine(base + "node/online"));
+    for (size_t k = 0; k < nodes.size(); k++) {
+        std::string node = base + "node/node" + std::to_string(nodes[k]);
+        std::vector<int> list = ParseList(ReadLine(node + "/cpulist"));
+        // Nodes made only of memory run no threads.
+        if (list.empty())
+            continue;
+        // Sort by rank among the siblings of the core, then by core.
+        struct cpu_t { int rank, package, core, cpu; };
+        std::vector<cpu_t> order;
+        for (size_t i = 0; i < list.size(); i++) {
+            std::string topology = base + "cpu/cpu" + std::to_string(list[i]) + "/topology/";
+            std::vector<int> siblings = ParseList(ReadLine(topology + "thread_siblings_list"));
+            cpu_t c;
+            c.rank = std::find(siblings.begin(), siblings.end(), list[i]) - siblings.begin();
+            c.package = ReadInt(topology + "physical_package_id", 0);
+            c.core = ReadInt(topology + "core_id", list[i]);
+            c.cpu = list[i];
+            order.push_back(c);
+        }
+        std::sort(order.begin(), order.end(), [](const cpu_t& a, const cpu_t& b) {
+            if (a.rank != b.rank)
+                return a.rank < b.rank;
+            if (a.package != b.package)
+                return a.package < b.package;
+            if (a.core != b.core)
+                return a.core < b.core;
+            return a.cpu < b.cpu;
+        });
+        cpus.push_back(std::vector<int>());
+        for (size_t i = 0; i < order.size(); i++)
+            cpus.back().push_back(order[i].cpu);
+        ids.push_back(nodes[k]);
+    }
+#endif
+    if (cpus.empty()) {
+        // One node of every CPU, which are not pinned to.
+        cpus.push_back(std::vector<int>());
+        ids.push_back(-1);
+    }
+}
+
+const NumaTopology& NumaTopology::Instance() {
+    static NumaTopology topology;
+    return topology;
+}
+
+/** NumaTopology::NodeOf
+ * DESCRIPTION:
+ *      Returns the node of a thread: threads fill the nodes in contiguous
+ *      blocks, see NumaTopology.
+ * ARGUMENTS:
+ *      int index
+ *          The thread, from 0.
+ *      int count
+ *          The number of threads.
+ */
+int NumaTopology::NodeOf(int index, int count) const {
+    return (int)((int64_t)index * Nodes() / std::max(1, count));
+}
+
+/** NumaTopology::CpuOf
+ * DESCRIPTION:
+ *      Returns the logical CPU of a thread, or -1 if the CPUs are not
+ *      known. Threads past the CPUs of their node wrap around.
+ * ARGUMENTS:
+ *      int index, count
+ *          See NodeOf.
+ */
+int NumaTopology::CpuOf(int index, int count) const {
+    int node = NodeOf(index, count);
+    if (cpus[node].empty())
+        return -1;
+    return cpus[node][(index - FirstOf(node, count)) % cpus[node].size()];
+}
+
+/** NumaTopology::FirstOf
+ * DESCRIPTION:
+ *      Returns the first thread of a node, see NodeOf: the threads of node
+ *      k are FirstOf(k) to FirstOf(k + 1) - 1.
+ * ARGUMENTS:
+ *      int node
+ *          The node, from 0 to Nodes().
+ *      int count
+ *          The number of threads.
+ */
+int NumaTopology::FirstOf(int node, int count) const {
+    return (int)(((int64_t)node * count + Nodes() - 1) / Nodes());
+}
+
+/** NumaTopology::PinToCpu, PinToNode
+ * DESCRIPTION:
+ *      Restricts the calling thread to a logical CPU, or to the CPUs of a
+ *      node. Threads it starts afterwards inherit the restriction.
+ */
+bool NumaTopology::PinToCpu(int cpu) const {
+#ifdef NUMA_TOPOLOGY_SYSFS
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+bool NumaTopology::PinToNode(int node) const {
+#ifdef NUMA_TOPOLOGY_SYSFS
+    if (node < 0 || node >= Nodes() || cpus[node].empty())
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus[node].size(); i++)
+        if (cpus[node][i] < CPU_SETSIZE)
+            CPU_SET(cpus[node][i], &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)node;
+    return false;
+#endif
+}
+
+/** NumaTopology::Bind
+ * DESCRIPTION:
+ *      Sets the preferred node of a range of pages: the kernel backs them
+ *      there when they are first touched, by any thread, and falls back
+ *      to other nodes once the node is full.
+ * ARGUMENTS:
+ *      void* addr
+ *          The first page.
+ *      size_t bytes
+ *          The length of the range.
+ *      int node
+ *          The node, as an index of the topology.
+ */
+bool NumaTopology::Bind(void* addr, size_t bytes, int node) {
+#ifdef NUMA_TOPOLOGY_SYSFS
+    const NumaTopology& topology = Instance();
+    if (bytes == 0 || node < 0 || node >= topology.Nodes() || topology.ids[node] < 0)
+        return false;
+    return SetPolicy(addr, bytes, MPOL_PREFERRED, std::vector<int>(1, topology.ids[node]));
+#else
+    (void)addr;
+    (void)bytes;
+    (void)node;
+    return false;
+#endif
+}
+
+/** NumaTopology::Interleave
+ * DESCRIPTION:
+ *      Spreads a range of pages not touched yet over every node, a page
+ *      at a time, for data written or read by threads of every node.
+ * ARGUMENTS:
+ *      void* addr
+ *          The first page.
+ *      size_t bytes
+ *          The length of the range.
+ */
+bool NumaTopology::Interleave(void* addr, size_t bytes) {
+#ifdef NUMA_TOPOLOGY_SYSFS
+    const NumaTopology& topology = Instance();
+    if (bytes == 0 || topology.ids[0] < 0)
+        return false;
+    return SetPolicy(addr, bytes, MPOL_INTERLEAVE, topology.ids);
+#else
+    (void)addr;
+    (void)bytes;
+    return false;
+#endif
+}
+
+/** NumaTopology::Resident
+ * DESCRIPTION:
+ *      Counts the resident pages of a range per node. Pages not touched
+ *      yet are not counted.
+ * ARGUMENTS:
+ *      const void* addr
+ *          The start of the range, page aligned.
+ *      size_t bytes
+ *          The length of the range.
+ *      std::vector<size_t>* perNode
+ *          The bytes held by each node, added to. It is resized to the
+ *          nodes of the topology.
+ */
+void NumaTopology::Resident(const void* addr, size_t bytes, std::vector<size_t>* perNode) const {
+    perNode->resize(Nodes(), 0);
+#ifdef NUMA_TOPOLOGY_SYSFS
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (bytes + page - 1) / page;
+    std::vector<void*> batch(residentBatch);
+    std::vector<int> status(residentBatch);
+    for (size_t first = 0; first < pages; first += residentBatch) {
+        size_t n = std::min(residentBatch, pages - first);
+        for (size_t i = 0; i < n; i++)
+            batch[i] = (char*)addr + (first + i) * page;
+        // Without target nodes, move_pages only reports where pages are.
+        if (syscall(SYS_move_pages, 0, (unsigned long)n, batch.data(), NULL, status.data(), 0) != 0)
+            return;
+        for (size_t i = 0; i < n; i++) {
+            int k = std::find(ids.begin(), ids.end(), status[i]) - ids.begin();
+            if (status[i] >= 0 && k < Nodes())
+                (*perNode)[k] += page;
+        }
+    }
+#else
+    (void)addr;
+    (void)bytes;
+#endif
+}
+
+/** NumaTopology::Counters
+ * DESCRIPTION:
+ *      Reads the numastat of a node. Both counters are 0 when unknown.
+ */
+NumaTopology::counters_t NumaTopology::Counters(int node) const {
+    counters_t counters;
+    counters.local = counters.remote = 0;
+#ifdef NUMA_TOPOLOGY_SYSFS
+    if (node < 0 || node >= Nodes() || ids[node] < 0)
+        return counters;
+    std::ifstream file(("/sys/devices/system/node/node" + std::to_string(ids[node]) + "/numastat").c_str());
+    std::string name;
+    uint64_t value;
+    while (file >> name >> value) {
+        if (name == "local_node")
+            counters.local = value;
+        else if (name == "other_node")
+            counters.remote = value;
+    }
+#else
+    (void)node;
+#endif
+    return counters;
+}
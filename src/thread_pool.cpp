@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "thread_pool.h"
+#include "numa_topology.h"
+
+using std::cout;
+using std::endl;
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+// Set on the pool's threads while they run a tile, so that nested loops
+// run in place.
+static thread_local bool insideLoop = false;
+// The share of the calling thread, see ThreadIndex.
+static thread_local int threadIndex = 0;
+
+// Tiles per thread cut by WeightedFor: enough for stealing to even out
+// the estimates.
+static const int weightedTiles = 16;
+
+ThreadPool::ThreadPool() {
+    size = 1;
+    numa = false;
+    elapsed = 0;
+    generation = 0;
+    busy = 0;
+    stopping = false;
+    body = NULL;
+}
+
+ThreadPool::~ThreadPool() {
+    Stop();
+}
+
+ThreadPool& ThreadPool::Instance() {
+    static ThreadPool pool;
+    return pool;
+}
+
+/** ThreadPool::Start
+ * DESCRIPTION:
+ *      Starts the workers, stopping any previous ones.
+ * ARGUMENTS:
+ *      int threads
+ *          The number of threads running each loop, the caller included.
+ *          One runs every loop on the caller.
+ *      bool numa
+ *          Pin the threads to the cores of the NUMA nodes.
+ */
+void ThreadPool::Start(int threads, bool numa) {
+    Stop();
+    threads = std::max(1, threads);
+    shares.reset(new share_t[threads]);
+    for (int i = 0; i < threads; i++) {
+        shares[i].next = shares[i].end = 0;
+        shares[i].busy = 0;
+        shares[i].tiles = 0;
+    }
+    elapsed = 0;
+    stopping = false;
+    size = threads;
+    this->numa = numa;
+    // The caller is held on its node rather than on one core: the threads
+    // it starts, such as the tile loaders, share the node with it.
+    if (numa)
+        NumaTopology::Instance().PinToNode(NumaTopology::Instance().NodeOf(0, size));
+    for (int i = 1; i < threads; i++)
+        workers.push_back(std::thread(&ThreadPool::Worker, this, i, generation));
+}
+
+/** ThreadPool::Stop
+ * DESCRIPTION:
+ *      Stops the workers once they are idle.
+ */
+void ThreadPool::Stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+    size = 1;
+}
+
+/** ThreadPool::ParallelFor
+ * DESCRIPTION:
+ *      Runs a loop on every thread of the pool, see ThreadPool.
+ * ARGUMENTS:
+ *      int first, last
+ *          The first and last indices of the loop.
+ *      int grain
+ *          The number of indices per tile. Tiles should take at least
+ *          tens of microseconds, so that taking them is negligible.
+ *      const std::function<void(int, int)>& body
+ *          Called with the first and last indices of each tile, on any
+ *          thread. Tiles of a loop may run concurrently.
+ */
+void ThreadPool::ParallelFor(int first, int last, int grain, const std::function<void(int, int)>& body) {
+    if (last < first)
+        return;
+    grain = std::max(1, grain);
+    std::vector<int> tiles;
+    for (int begin = first; begin <= last; begin += grain)
+        tiles.push_back(begin);
+    tiles.push_back(last + 1);
+    Loop(tiles, body);
+}
+
+/** ThreadPool::WeightedFor
+ * DESCRIPTION:
+ *      Runs a loop on every thread of the pool, in tiles of about equal
+ *      weight rather than of equal length. Tiles are never cut below one
+ *      index, so a heavy index makes a tile of its own.
+ * ARGUMENTS:
+ *      int first, last
+ *          The first and last indices of the loop.
+ *      const std::vector<double>& weight
+ *          The work of each index, from first to last. Only the ratios
+ *          matter.
+ *      const std::function<void(int, int)>& body
+ *          See ParallelFor.
+ */
+void ThreadPool::WeightedFor(int first, int last, const std::vector<double>& weight,
+                             const std::function<void(int, int)>& body) {
+    if (last < first)
+        return;
+    double total = 0;
+    for (int k = 0; k <= last - first; k++)
+        total += weight[k];
+    int count = size * weightedTiles;
+    std::vector<int> tiles(1, first);
+    double sum = 0;
+    for (int k = 0; k < last - first; k++) {
+        sum += weight[k];
+        // Cut once the tile reaches its share of the total.
+        if (sum >= total * tiles.size() / count)
+            tiles.push_back(first + k + 1);
+    }
+    tiles.push_back(last + 1);
+    Loop(tiles, body);
+}
+
+/** ThreadPool::Loop
+ * DESCRIPTION:
+ *      Hands tiles out to the threads, runs the caller's share and
+ *      waits for the others.
+ * ARGUMENTS:
+ *      std::vector<int>& tiles
+ *          The first index of each tile, then the index after the last.
+ *          This will be swapped with the previous loop's.
+ *      const std::function<void(int, int)>& body
+ *          See ParallelFor.
+ */
+void ThreadPool::Loop(std::vector<int>& tiles, const std::function<void(int, int)>& body) {
+    steady_clock::time_point start = steady_clock::now();
+    if (workers.empty() || insideLoop) {
+        body(tiles.front(), tiles.back() - 1);
+        if (!insideLoop && shares) {
+            double seconds = duration<double>(steady_clock::now() - start).count();
+            shares[0].busy += seconds;
+            shares[0].tiles++;
+            elapsed += seconds;
+        }
+        return;
+    }
+    int count = tiles.size() - 1;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        // Workers that woke up late for the previous loop may still be
+        // looking for tiles.
+        idle.wait(guard, [this] { return busy == 0; });
+        this->body = &body;
+        bounds.swap(tiles);
+        // A NUMA pool cuts the shares at equal indices rather than equal
+        // tiles, so that each thread starts with the rows placed on its
+        // node, however the tiles are weighted.
+        int length = bounds.back() - bounds.front();
+        for (int i = 0; i < size; i++) {
+            int from = bounds.front() + (int)((int64_t)length * i / size);
+            shares[i].next = !numa ? (int)((int64_t)count * i / size)
+                           : std::lower_bound(bounds.begin(), bounds.end() - 1, from) - bounds.begin();
+            if (i > 0)
+                shares[i - 1].end = shares[i].next;
+        }
+        shares[size - 1].end = count;
+        generation++;
+    }
+    wake.notify_all();
+    insideLoop = true;
+    Run(0);
+    insideLoop = false;
+    // Every tile has been taken: wait for those still running.
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this] { return busy == 0; });
+    elapsed += duration<double>(steady_clock::now() - start).count();
+}
+
+int ThreadPool::ThreadIndex() {
+    return threadIndex;
+}
+
+/** ThreadPool::Worker
+ * DESCRIPTION:
+ *      The loop of a worker: runs tiles of each new loop until there are
+ *      none left.
+ * ARGUMENTS:
+ *      int index
+ *          The share of the worker.
+ *      uint64_t seen
+ *          The last loop run before the worker was started.
+ */
+void ThreadPool::Worker(int index, uint64_t seen) {
+    insideLoop = true;
+    threadIndex = index;
+    if (numa)
+        NumaTopology::Instance().PinToCpu(NumaTopology::Instance().CpuOf(index, size));
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        wake.wait(guard, [&] { return stopping || generation != seen; });
+        if (stopping)
+            return;
+        seen = generation;
+        busy++;
+        guard.unlock();
+        Run(index);
+        guard.lock();
+        if (--busy == 0)
+            idle.notify_all();
+    }
+}
+
+/** ThreadPool::Run
+ * DESCRIPTION:
+ *      Runs tiles of the current loop until there are none left to take.
+ */
+void ThreadPool::Run(int index) {
+    share_t& own = shares[index];
+    int tile;
+    while (Take(index, &tile)) {
+        steady_clock::time_point start = steady_clock::now();
+        (*body)(bounds[tile], bounds[tile + 1] - 1);
+        own.busy += duration<double>(steady_clock::now() - start).count();
+        own.tiles++;
+    }
+}
+
+/** ThreadPool::Take
+ * DESCRIPTION:
+ *      Takes the next tile of a thread's share or, once it is empty, the
+ *      last tile of the next share that is not.
+ * ARGUMENTS:
+ *      int index
+ *          The share of the thread.
+ *      int* tile
+ *          The tile taken. This will be overwritten.
+ * RETURNS:
+ *      bool
+ *          False once every tile of the loop has been taken.
+ */
+bool ThreadPool::Take(int index, int* tile) {
+    share_t& own = shares[index];
+    {
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (own.next < own.end) {
+            *tile = own.next++;
+            return true;
+        }
+    }
+    for (int k = 1; k < size; k++) {
+        share_t& victim = shares[(index + k) % size];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (victim.next < victim.end) {
+            *tile = --victim.end;
+            return true;
+        }
+    }
+    return false;
+}
+
+/** ThreadPool::Report
+ * DESCRIPTION:
+ *      Prints, for each thread, the share of the wall time of the loops
+ *      since the last report that it spent running tiles, and how many
+ *      tiles it ran. Threads well under 100% waited for the others. A
+ *      NUMA pool also prints the mean of the threads of each node.
+ * ARGUMENTS:
+ *      const char* stage
+ *          The name of the loops.
+ */
+void ThreadPool::Report(const char* stage) {
+    if (!shares || elapsed <= 0)
+        return;
+    cout << stage << ": " << std::fixed << std::setprecision(3) << elapsed << " s, threads busy";
+    const NumaTopology& topology = NumaTopology::Instance();
+    std::vector<double> nodeBusy(topology.Nodes(), 0), nodeThreads(topology.Nodes(), 0);
+    for (int i = 0; i < size; i++) {
+        cout << " " << std::setprecision(0) << 100 * shares[i].busy / elapsed << "% (" << shares[i].tiles << ")";
+        nodeBusy[topology.NodeOf(i, size)] += shares[i].busy;
+        nodeThreads[topology.NodeOf(i, size)]++;
+        shares[i].busy = 0;
+        shares[i].tiles = 0;
+    }
+    if (numa && topology.Nodes() > 1)
+        for (int k = 0; k < topology.Nodes(); k++)
+            if (nodeThreads[k] > 0)
+                cout << (k == 0 ? "; nodes" : ",") << " " << k << ": "
+                     << 100 * nodeBusy[k] / (nodeThreads[k] * elapsed) << "%";
+    cout.unsetf(std::ios::floatfield);
+    cout << std::setprecision(6) << endl;
+    elapsed = 0;
+}